@@ -0,0 +1,222 @@
+/* Multi-buffer AES-CBC encryption with AES-NI
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "aes-mb.h"
+
+#ifdef HAVE_AES_MB
+
+#include <string.h>
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AES_MB_TARGET __attribute__((target("aes,sse2")))
+
+int aes_mb_available(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_AES) != 0;
+}
+
+/*
+ * Key expansion as in Intel's AES-NI white paper: aeskeygenassist does
+ * the S-box and rotation, the rest is spreading the word over the
+ * round key.
+ */
+static AES_MB_TARGET __m128i aes_mb_expand(__m128i k, __m128i t)
+{
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, t);
+}
+
+#define AES_128_ROUND(i, rcon) \
+	rk[i] = aes_mb_expand(rk[i - 1], \
+		_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+
+static AES_MB_TARGET void aes_mb_expand128(__m128i *rk, const uint8_t *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	AES_128_ROUND(1, 0x01);
+	AES_128_ROUND(2, 0x02);
+	AES_128_ROUND(3, 0x04);
+	AES_128_ROUND(4, 0x08);
+	AES_128_ROUND(5, 0x10);
+	AES_128_ROUND(6, 0x20);
+	AES_128_ROUND(7, 0x40);
+	AES_128_ROUND(8, 0x80);
+	AES_128_ROUND(9, 0x1b);
+	AES_128_ROUND(10, 0x36);
+}
+
+/* The next 24 bytes of key schedule, in t1 and the low half of t3 */
+static AES_MB_TARGET void aes_mb_assist192(__m128i *t1, __m128i t2, __m128i *t3)
+{
+	*t1 = aes_mb_expand(*t1, _mm_shuffle_epi32(t2, 0x55));
+	t2 = _mm_shuffle_epi32(*t1, 0xff);
+	*t3 = _mm_xor_si128(*t3, _mm_slli_si128(*t3, 4));
+	*t3 = _mm_xor_si128(*t3, t2);
+}
+
+#define AES_192_ROUND(rcon) \
+	aes_mb_assist192(&t1, _mm_aeskeygenassist_si128(t3, rcon), &t3)
+#define AES_192_LO(a, b) ((__m128i)_mm_shuffle_pd((__m128d)(a), (__m128d)(b), 0))
+#define AES_192_HI(a, b) ((__m128i)_mm_shuffle_pd((__m128d)(a), (__m128d)(b), 1))
+
+static AES_MB_TARGET void aes_mb_expand192(__m128i *rk, const uint8_t *key)
+{
+	uint8_t tail[16];
+	__m128i t1, t3;
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, key + 16, 8);
+	t1 = _mm_loadu_si128((const __m128i *)key);
+	t3 = _mm_loadu_si128((const __m128i *)tail);
+	rk[0] = t1;
+	rk[1] = t3;
+	AES_192_ROUND(0x01);
+	rk[1] = AES_192_LO(rk[1], t1);
+	rk[2] = AES_192_HI(t1, t3);
+	AES_192_ROUND(0x02);
+	rk[3] = t1;
+	rk[4] = t3;
+	AES_192_ROUND(0x04);
+	rk[4] = AES_192_LO(rk[4], t1);
+	rk[5] = AES_192_HI(t1, t3);
+	AES_192_ROUND(0x08);
+	rk[6] = t1;
+	rk[7] = t3;
+	AES_192_ROUND(0x10);
+	rk[7] = AES_192_LO(rk[7], t1);
+	rk[8] = AES_192_HI(t1, t3);
+	AES_192_ROUND(0x20);
+	rk[9] = t1;
+	rk[10] = t3;
+	AES_192_ROUND(0x40);
+	rk[10] = AES_192_LO(rk[10], t1);
+	rk[11] = AES_192_HI(t1, t3);
+	AES_192_ROUND(0x80);
+	rk[12] = t1;
+}
+
+#define AES_256_ROUND(i, rcon) do { \
+	rk[i] = aes_mb_expand(rk[i - 2], \
+		_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff)); \
+	if (i < 14) \
+		rk[i + 1] = aes_mb_expand(rk[i - 1], \
+			_mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa)); \
+	} while (0)
+
+static AES_MB_TARGET void aes_mb_expand256(__m128i *rk, const uint8_t *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+	AES_256_ROUND(2, 0x01);
+	AES_256_ROUND(4, 0x02);
+	AES_256_ROUND(6, 0x04);
+	AES_256_ROUND(8, 0x08);
+	AES_256_ROUND(10, 0x10);
+	AES_256_ROUND(12, 0x20);
+	AES_256_ROUND(14, 0x40);
+}
+
+int aes_mb_setkey(struct aes_mb_key *k, const uint8_t *key, unsigned int len)
+{
+	__m128i *rk = (__m128i *)k->rk;
+
+	switch (len) {
+	case 16:
+		aes_mb_expand128(rk, key);
+		k->rounds = 10;
+		break;
+	case 24:
+		aes_mb_expand192(rk, key);
+		k->rounds = 12;
+		break;
+	case 32:
+		aes_mb_expand256(rk, key);
+		k->rounds = 14;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Encrypt up to AES_MB_LANES packets at a time, a block of each per
+ * step. Whenever one is done the next job takes its lane.
+ */
+AES_MB_TARGET
+void aes_mb_cbc_encrypt(const struct aes_mb_key *k, struct aes_mb_job *jobs, unsigned int n)
+{
+	const __m128i *rk = (const __m128i *)k->rk;
+	__m128i st[AES_MB_LANES];
+	uint8_t *p[AES_MB_LANES];
+	unsigned int left[AES_MB_LANES];
+	unsigned int next = 0, lanes = 0, steps, i, l;
+	int r;
+
+	for (;;) {
+		while (lanes < AES_MB_LANES && next < n) {
+			if (jobs[next].len >= 16) {
+				p[lanes] = jobs[next].data;
+				left[lanes] = jobs[next].len / 16;
+				st[lanes] = _mm_loadu_si128((const __m128i *)jobs[next].iv);
+				lanes++;
+			}
+			next++;
+		}
+		if (lanes == 0)
+			break;
+
+		for (steps = left[0], l = 1; l < lanes; l++)
+			if (left[l] < steps)
+				steps = left[l];
+
+		for (i = 0; i < steps; i++) {
+			for (l = 0; l < lanes; l++)
+				st[l] = _mm_xor_si128(_mm_xor_si128(st[l],
+					_mm_loadu_si128((const __m128i *)p[l])), rk[0]);
+			for (r = 1; r < k->rounds; r++)
+				for (l = 0; l < lanes; l++)
+					st[l] = _mm_aesenc_si128(st[l], rk[r]);
+			for (l = 0; l < lanes; l++) {
+				st[l] = _mm_aesenclast_si128(st[l], rk[k->rounds]);
+				_mm_storeu_si128((__m128i *)p[l], st[l]);
+				p[l] += 16;
+			}
+		}
+
+		for (l = 0; l < lanes;) {
+			left[l] -= steps;
+			if (left[l]) {
+				l++;
+				continue;
+			}
+			lanes--;
+			p[l] = p[lanes];
+			left[l] = left[lanes];
+			st[l] = st[lanes];
+		}
+	}
+}
+
+#endif
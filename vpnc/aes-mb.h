@@ -0,0 +1,56 @@
+/* Multi-buffer AES-CBC encryption with AES-NI
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __AES_MB_H__
+#define __AES_MB_H__
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_AES_MB 1
+#endif
+
+#ifdef HAVE_AES_MB
+
+#include <stdint.h>
+
+/*
+ * CBC encryption can't be parallelized within a packet, every block
+ * depends on the one before. The AES instructions have a latency of
+ * several cycles but can start one per cycle, so a single packet
+ * leaves the unit idle most of the time. Encrypting the packets of a
+ * batch side by side, one block of each in turn, keeps it busy.
+ */
+#define AES_MB_LANES 8
+
+struct aes_mb_key {
+	uint8_t rk[15][16] __attribute__((aligned(16))); /* round keys */
+	int rounds;
+};
+
+/* One packet: len bytes, a multiple of 16, encrypted in place */
+struct aes_mb_job {
+	uint8_t *data;
+	unsigned int len;
+	const uint8_t *iv;
+};
+
+extern int aes_mb_available(void);
+/* len is 16, 24 or 32, returns -1 otherwise */
+extern int aes_mb_setkey(struct aes_mb_key *k, const uint8_t *key, unsigned int len);
+extern void aes_mb_cbc_encrypt(const struct aes_mb_key *k, struct aes_mb_job *jobs, unsigned int n);
+
+#endif
+#endif
@@ -0,0 +1,1294 @@
+/* Micro benchmarks for the ESP data path
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <gcrypt.h>
+
+#include "sysdep.h"
+#include "config.h"
+#include "isakmp.h"
+#include "esp.h"
+#include "pktbuf.h"
+#include "replay.h"
+#include "gso.h"
+#include "cksum.h"
+#include "aes-mb.h"
+#include "esp-openssl.h"
+
+#ifndef MIN
+#define MIN(a,b)	((a)<(b)?(a):(b))
+#endif
+
+/* "bench-esp -q" only checks results, with few iterations, for make test */
+static int quick;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Cycles where there is a time stamp counter, or else nanoseconds */
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+static uint32_t rnd_state = 2463534242U;
+
+static uint32_t rnd(void)
+{
+	/* xorshift32, good enough to shuffle packets */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/*
+ * Feed a stream of sequence numbers, shuffled in blocks of half the window
+ * and with every 32nd packet sent twice, through check and update.
+ * All originals must be accepted and all duplicates dropped. With esn
+ * only the low 32 bits are passed on, the stream starts at base.
+ * Without a window nothing is dropped, the blocks are 16 packets.
+ */
+static int bench_replay_window(unsigned int size, unsigned int npkt, uint64_t base, int esn)
+{
+	struct replay_window w;
+	uint64_t *seq, q;
+	unsigned int i, j, n, block, accepted = 0, wrong = 0, dups = npkt / 32;
+	double t;
+
+	seq = malloc((npkt + dups) * sizeof(uint64_t));
+	if (seq == NULL)
+		error(1, errno, "malloc");
+
+	block = size ? size / 2 : 16;
+	for (i = 0; i < npkt; i++)
+		seq[i] = base + i + 1;
+	for (i = 0; i < npkt; i += block)
+		for (j = MIN(block, npkt - i) - 1; j > 0; j--) {
+			uint64_t k = rnd() % (j + 1), tmp;
+
+			tmp = seq[i + j];
+			seq[i + j] = seq[i + k];
+			seq[i + k] = tmp;
+		}
+	/* repeat one of the last 16 packets after each run of 32, in place from the end */
+	for (i = npkt, n = npkt + dups; i-- > 0;) {
+		uint64_t orig = seq[i];
+
+		if (i % 32 == 31)
+			seq[--n] = seq[i - rnd() % 16];
+		seq[--n] = orig;
+	}
+	n = npkt + dups;
+
+	replay_init(&w, size);
+	w.top = base;
+	t = now_ns();
+	for (i = 0; i < n; i++) {
+		q = esn ? replay_esn(&w, (uint32_t)seq[i]) : seq[i];
+		wrong += q != seq[i];
+		if (replay_check(&w, q) == 0) {
+			replay_update(&w, q);
+			accepted++;
+		}
+	}
+	t = now_ns() - t;
+	replay_free(&w);
+	free(seq);
+
+	if (!quick)
+		printf("replay window %4u%s: %6.2f ns/packet (%u packets, %u replayed)\n",
+			size, esn ? " esn" : "", t / n, n, dups);
+	if (accepted != (size ? npkt : n) || wrong) {
+		printf("replay window %u%s: accepted %u of %u packets, expected %u, %u misplaced\n",
+			size, esn ? " esn" : "", accepted, n, size ? npkt : n, wrong);
+		return 1;
+	}
+	return 0;
+}
+
+static int bench_replay(void)
+{
+	static const unsigned int sizes[] = { 64, 256, 1024, 4096 };
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= bench_replay_window(sizes[i], quick ? 100000 : 10000000, 0, 0);
+	/* across the first wrap of the low 32 bits */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= bench_replay_window(sizes[i], quick ? 100000 : 10000000,
+			UINT32_MAX - (quick ? 50000 : 5000000), 1);
+	/* the high half is still inferred without a window, despite reordering */
+	ret |= bench_replay_window(0, quick ? 100000 : 10000000,
+		UINT32_MAX - (quick ? 50000 : 5000000), 1);
+	return ret;
+}
+
+/* The refused packets below are expected, don't log them */
+static void log_quiet(int priority __attribute__((unused)),
+	const char *format __attribute__((unused)), ...)
+{
+}
+
+/* The ICMP echo request of RFC 7634, appendix A, as the inner packet */
+static const uint8_t esp_kat_inner[84] =
+	"\x45\x00\x00\x54\xa6\xf2\x00\x00\x40\x01\xe7\x78\xc6\x33\x64\x05"
+	"\xc0\x00\x02\x05\x08\x00\x5b\x7a\x3a\x08\x00\x00\x55\x3b\xec\x10"
+	"\x00\x07\x36\x27\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f\x10\x11\x12\x13"
+	"\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x20\x21\x22\x23"
+	"\x24\x25\x26\x27\x28\x29\x2a\x2b\x2c\x2d\x2e\x2f\x30\x31\x32\x33"
+	"\x34\x35\x36\x37";
+
+/*
+ * Whole ESP packets as the negotiated transform, the keymat and the
+ * sequence number determine them. The keymat is the encryption key
+ * followed by the salt (RFC 4106, 8.1) or the HMAC key. The GCM key and
+ * salt are those of test case 4 of the GCM specification, the packets
+ * were computed independently of libgcrypt. The first ChaCha20-Poly1305
+ * packet is the one of RFC 7634, appendix A. Its IV is not the sequence
+ * number, nor are the random ones of CBC, so those are only opened.
+ * With esn the high half of the sequence number is only in the ICV.
+ */
+struct esp_kat {
+	const char *name;
+	int enc, keylen, auth; /* as in the phase 2 proposal */
+	const char *keymat;
+	uint32_t spi;
+	uint64_t seq;
+	const char *esp; /* header, IV, ciphertext and ICV */
+	unsigned int len;
+	int open_only;
+	int esn;
+	const char *iv_key; /* CBC: the IV is then sealed too */
+};
+
+static const struct esp_kat esp_kats[] = {
+	{ "aes128-gcm", ISAKMP_IPSEC_ESP_AES_GCM_16, 128, 0,
+		"\xfe\xff\xe9\x92\x86\x65\x73\x1c\x6d\x6a\x8f\x94\x67\x30\x83\x08"
+		"\xca\xfe\xba\xbe",
+		0x01020304, 5,
+		"\x01\x02\x03\x04\x00\x00\x00\x05\x00\x00\x00\x00\x00\x00\x00\x05"
+		"\xba\x28\x4e\x96\x44\x61\xcf\x27\x45\x19\xfc\x36\x25\x28\x76\xa0"
+		"\x1d\x85\xe0\x96\xa8\xa1\x96\xfa\x61\x8e\xc3\xcc\x2e\xbf\x38\x8b"
+		"\x06\xa1\xf9\xec\xcd\xf0\x2c\x7e\x0f\xc3\x74\x01\x45\x9b\x22\x69"
+		"\x0f\x25\x79\xc3\xff\xf2\xad\x83\x56\x00\x1b\xd6\xcc\x66\xab\xca"
+		"\xf9\x53\x43\xa1\x47\x43\xc7\xaf\x4a\x53\xa7\x11\x0a\x90\xa7\xf9"
+		"\x13\x4d\x10\x42\x98\x7e\xf0\x11\x41\xfe\x2c\xcf\xc3\x91\xe7\x00"
+		"\xe9\xd4\x8c\xb7\xde\xe7\x39\x04", 120, 0, 0, NULL },
+	{ "aes256-gcm", ISAKMP_IPSEC_ESP_AES_GCM_16, 256, 0,
+		"\xfe\xff\xe9\x92\x86\x65\x73\x1c\x6d\x6a\x8f\x94\x67\x30\x83\x08"
+		"\xfe\xff\xe9\x92\x86\x65\x73\x1c\x6d\x6a\x8f\x94\x67\x30\x83\x08"
+		"\xca\xfe\xba\xbe",
+		0x01020304, 0x12345678,
+		"\x01\x02\x03\x04\x12\x34\x56\x78\x00\x00\x00\x00\x12\x34\x56\x78"
+		"\xc8\x6c\x23\xff\x41\xee\xa5\x04\xe7\x83\xa7\x48\x81\xf9\xfb\x65"
+		"\xef\xf7\xa3\x7b\x8b\x72\xbf\x7f\xfe\x12\xb4\x3f\xd2\x24\x19\xb0"
+		"\x22\x7e\xfe\xe8\xc3\x36\x9b\xea\x39\x4b\xa5\x29\x6a\xa8\xcf\xe4"
+		"\x75\x51\x7c\x95\xaf\x01\x7e\x9c\xc0\x15\x88\xda\xad\xe5\x91\x73"
+		"\xb3\x64\x7b\x3f\x12\x9e\x93\xcb\xfd\x0d\xfe\x53\x8c\x67\x89\xdb"
+		"\x93\xae\x50\x22\x7b\xb7\x03\x0d\xf2\xcd\x9a\x32\x8a\x0d\x8a\xc8"
+		"\xc9\x6b\xc2\x75\xb5\x17\x46\xaf", 120, 0, 0, NULL },
+	{ "chacha20-poly1305", ISAKMP_IPSEC_ESP_CHACHA20_POLY1305, 0, 0,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3",
+		0x01020304, 5,
+		"\x01\x02\x03\x04\x00\x00\x00\x05\x10\x11\x12\x13\x14\x15\x16\x17"
+		"\x24\x03\x94\x28\xb9\x7f\x41\x7e\x3c\x13\x75\x3a\x4f\x05\x08\x7b"
+		"\x67\xc3\x52\xe6\xa7\xfa\xb1\xb9\x82\xd4\x66\xef\x40\x7a\xe5\xc6"
+		"\x14\xee\x80\x99\xd5\x28\x44\xeb\x61\xaa\x95\xdf\xab\x4c\x02\xf7"
+		"\x2a\xa7\x1e\x7c\x4c\x4f\x64\xc9\xbe\xfe\x2f\xac\xc6\x38\xe8\xf3"
+		"\xcb\xec\x16\x3f\xac\x46\x9b\x50\x27\x73\xf6\xfb\x94\xe6\x64\xda"
+		"\x91\x65\xb8\x28\x29\xf6\x41\xe0\x76\xaa\xa8\x26\x6b\x7f\xb0\xf7"
+		"\xb1\x1b\x36\x99\x07\xe1\xad\x43", 120, 1, 0, NULL },
+	{ "chacha20-poly1305", ISAKMP_IPSEC_ESP_CHACHA20_POLY1305, 0, 0,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3",
+		0x01020304, 42,
+		"\x01\x02\x03\x04\x00\x00\x00\x2a\x00\x00\x00\x00\x00\x00\x00\x2a"
+		"\xaa\x6a\x9a\x23\x7c\xa5\xb1\xd8\xfb\xd4\xb7\x9e\x4f\xe6\x77\x49"
+		"\xde\xe2\xdf\x18\x73\xad\x1a\xa6\x26\xaf\xec\x52\x10\x42\x3d\x3f"
+		"\xb0\xbc\xa8\x8e\x48\xdf\x1d\x5f\x0c\x52\x9e\x04\x27\x38\x29\x59"
+		"\x34\x1a\x4d\x08\x32\xc0\x3f\x97\x48\xd7\xad\x00\xd6\x2d\xae\x23"
+		"\xbc\x28\x7f\xf5\xb4\xe1\x48\x14\xa3\xfa\xea\x27\xc3\x93\x10\xed"
+		"\x83\xcd\xc5\xbf\xa7\x34\x59\x24\x47\xd1\xd9\xb5\xa7\xf1\x81\x58"
+		"\xa8\xf7\xe2\xc1\xd7\x70\x61\x14", 120, 0, 0, NULL },
+	{ "aes128-gcm-esn", ISAKMP_IPSEC_ESP_AES_GCM_16, 128, 0,
+		"\xfe\xff\xe9\x92\x86\x65\x73\x1c\x6d\x6a\x8f\x94\x67\x30\x83\x08"
+		"\xca\xfe\xba\xbe",
+		0x01020304, 0x100000005ull,
+		"\x01\x02\x03\x04\x00\x00\x00\x05\x00\x00\x00\x01\x00\x00\x00\x05"
+		"\xdb\x17\x5d\x5e\xd2\x43\xa0\xa9\x99\x7f\xbe\x2a\x0c\x59\x1b\x3e"
+		"\xe1\xbf\x76\xbc\xaa\x3b\x44\x7b\x04\x53\x8a\xa3\x65\xb6\xa7\xcf"
+		"\x40\x44\xa2\x9c\x52\x91\xbc\x6b\x37\x29\x0e\xfc\x46\x6d\x7f\xc9"
+		"\xfb\xbd\x63\xbc\x19\xfc\xdf\x74\x2d\x31\x70\xa1\x8f\x96\xd5\xbf"
+		"\xd8\x8a\x9e\xc9\x30\x7e\x76\x62\x36\x4c\x3a\x80\xc8\x2e\xe7\xf4"
+		"\xa9\xe0\x5e\x73\xa8\xbf\x9f\xdb\xec\xa6\x58\xa3\xcf\x73\xb0\x13"
+		"\x9a\x92\xba\x7b\x87\x59\x73\x3c", 120, 0, 1, NULL },
+	{ "aes128-cbc-sha1", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3",
+		0x01020304, 7,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\x10\x11\x12\x13\x14\x15\x16\x17"
+		"\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x65\xc9\x31\x79\x16\xe3\x92\x6d"
+		"\x7c\xb6\x48\x42\x61\xaf\xba\xf3\x96\x1d\xd2\x0a\x87\x23\xbe\x9b"
+		"\x15\xad\x70\xf0\x5d\xe0\x11\xde\x8c\x98\xe0\x4b\xb7\x88\x6d\x01"
+		"\x30\xa0\xa0\x82\xde\xa9\x12\xba\x14\x3c\x5e\x10\x1f\x77\x3e\x2e"
+		"\x0b\xb0\x05\xb7\x84\x75\xdb\x8b\x1d\x8b\x27\x82\xa6\xdc\x77\x22"
+		"\x6e\x79\xcd\x66\x4a\xea\xdf\x5b\xcf\x3b\x20\x48\x62\xde\xdd\xbe"
+		"\x91\x61\xb1\xf2\x69\x07\xeb\x7b\x02\xd7\x60\xb9\xac\x29\x2e\x0c"
+		"\xc6\xe0\x74\x8a", 132, 1, 0, NULL },
+	{ "aes128-cbc-sha1-esn", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3",
+		0x01020304, 0x100000007ull,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\x10\x11\x12\x13\x14\x15\x16\x17"
+		"\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f\x65\xc9\x31\x79\x16\xe3\x92\x6d"
+		"\x7c\xb6\x48\x42\x61\xaf\xba\xf3\x96\x1d\xd2\x0a\x87\x23\xbe\x9b"
+		"\x15\xad\x70\xf0\x5d\xe0\x11\xde\x8c\x98\xe0\x4b\xb7\x88\x6d\x01"
+		"\x30\xa0\xa0\x82\xde\xa9\x12\xba\x14\x3c\x5e\x10\x1f\x77\x3e\x2e"
+		"\x0b\xb0\x05\xb7\x84\x75\xdb\x8b\x1d\x8b\x27\x82\xa6\xdc\x77\x22"
+		"\x6e\x79\xcd\x66\x4a\xea\xdf\x5b\xcf\x3b\x20\x48\x62\xde\xdd\xbe"
+		"\x91\x61\xb1\xf2\x69\x07\xeb\x7b\xe2\x59\x6a\x53\x5c\xa4\x46\xa9"
+		"\xb1\xd8\x77\xf8", 132, 1, 1, NULL },
+	{ "aes128-cbc-sha256", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA2_256,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3\xa4\xa5\xa6\xa7\xa8\xa9\xaa\xab\xac\xad\xae\xaf",
+		0x01020304, 7,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\xb5\x0f\x9e\x96\x30\x31\xc7\xff"
+		"\x5d\xca\x59\x2d\x6c\x8b\x80\x02\x8f\x60\x4f\xb3\x1f\x9e\x3b\xa6"
+		"\x38\xbf\xd5\x54\xb6\xb6\x41\xbd\x15\x28\xa0\xc2\x85\x8b\xfa\x91"
+		"\x44\x89\xd2\xe4\xe8\x6f\x47\x18\xdf\x8d\xc8\x7b\x56\x34\xbf\x1c"
+		"\xa1\x4a\x7d\x36\x68\xc4\x19\xed\xb8\xa2\xda\x01\x9c\xb1\x1d\x45"
+		"\x2b\x0d\x99\x17\x72\x9d\x2f\x56\x6e\x8d\x9f\xc1\x94\x90\x2b\x40"
+		"\x06\x0f\x88\x66\xd7\xf7\x94\xc3\x28\x3f\x24\x9b\x09\x6d\x08\x36"
+		"\xf2\x1a\xce\x3e\x2e\x08\xbf\x19\x61\x0d\x91\x0b\x32\x3e\x29\x1c"
+		"\x80\x19\x5e\x64\xb2\xe2\xe5\x89", 136, 0, 0,
+		"\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9\xca\xcb\xcc\xcd\xce\xcf" },
+	{ "aes128-cbc-sha256-esn", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA2_256,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3\xa4\xa5\xa6\xa7\xa8\xa9\xaa\xab\xac\xad\xae\xaf",
+		0x01020304, 0x100000007ull,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\x71\x98\x8a\xb3\xd8\x88\x4b\x80"
+		"\xd3\xdf\xd7\xb3\x54\xb4\x78\x2a\x6d\x60\x00\x50\x86\x5f\xb4\x3c"
+		"\x83\xf2\x17\x54\x68\xbb\x8e\x68\x6c\xcb\x91\x04\x73\x0c\x6d\xe5"
+		"\xe3\xe8\x64\xfb\x55\xa1\x44\x82\x8f\x28\x22\xd2\x22\x0f\xfd\xec"
+		"\x1c\x67\x3c\x6b\x17\xa1\x92\x19\x9b\x4a\xf8\x21\x60\x11\x22\x28"
+		"\xdc\x58\x15\xcb\xee\x45\x81\x59\x35\x85\x81\x21\x52\x69\x4a\x31"
+		"\x56\x6c\x28\x9f\x18\xbb\x93\x66\xee\x46\xcf\x04\x79\x15\x34\xe0"
+		"\x2f\x50\xcd\xa5\xdf\x38\x33\x11\xab\xee\x73\x24\x12\x80\xb7\x4f"
+		"\x45\x60\x27\x98\xbd\xb1\xe7\xab", 136, 0, 1,
+		"\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9\xca\xcb\xcc\xcd\xce\xcf" },
+	{ "aes128-cbc-sha384-esn", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA2_384,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3\xa4\xa5\xa6\xa7\xa8\xa9\xaa\xab\xac\xad\xae\xaf"
+		"\xb0\xb1\xb2\xb3\xb4\xb5\xb6\xb7\xb8\xb9\xba\xbb\xbc\xbd\xbe\xbf",
+		0x01020304, 0x100000007ull,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\x71\x98\x8a\xb3\xd8\x88\x4b\x80"
+		"\xd3\xdf\xd7\xb3\x54\xb4\x78\x2a\x6d\x60\x00\x50\x86\x5f\xb4\x3c"
+		"\x83\xf2\x17\x54\x68\xbb\x8e\x68\x6c\xcb\x91\x04\x73\x0c\x6d\xe5"
+		"\xe3\xe8\x64\xfb\x55\xa1\x44\x82\x8f\x28\x22\xd2\x22\x0f\xfd\xec"
+		"\x1c\x67\x3c\x6b\x17\xa1\x92\x19\x9b\x4a\xf8\x21\x60\x11\x22\x28"
+		"\xdc\x58\x15\xcb\xee\x45\x81\x59\x35\x85\x81\x21\x52\x69\x4a\x31"
+		"\x56\x6c\x28\x9f\x18\xbb\x93\x66\xee\x46\xcf\x04\x79\x15\x34\xe0"
+		"\x2f\x50\xcd\xa5\xdf\x38\x33\x11\xec\x5c\xaa\x54\xe1\xcf\x20\x79"
+		"\x89\x96\xc7\xcf\xc5\xc7\xdf\xf5\x0e\x1d\xb9\x49\x9e\x4e\xbb\xc6", 144, 0, 1,
+		"\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9\xca\xcb\xcc\xcd\xce\xcf" },
+	{ "aes128-cbc-sha512-esn", ISAKMP_IPSEC_ESP_AES, 128, IPSEC_AUTH_HMAC_SHA2_512,
+		"\x80\x81\x82\x83\x84\x85\x86\x87\x88\x89\x8a\x8b\x8c\x8d\x8e\x8f"
+		"\x90\x91\x92\x93\x94\x95\x96\x97\x98\x99\x9a\x9b\x9c\x9d\x9e\x9f"
+		"\xa0\xa1\xa2\xa3\xa4\xa5\xa6\xa7\xa8\xa9\xaa\xab\xac\xad\xae\xaf"
+		"\xb0\xb1\xb2\xb3\xb4\xb5\xb6\xb7\xb8\xb9\xba\xbb\xbc\xbd\xbe\xbf"
+		"\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9\xca\xcb\xcc\xcd\xce\xcf",
+		0x01020304, 0x100000007ull,
+		"\x01\x02\x03\x04\x00\x00\x00\x07\x71\x98\x8a\xb3\xd8\x88\x4b\x80"
+		"\xd3\xdf\xd7\xb3\x54\xb4\x78\x2a\x6d\x60\x00\x50\x86\x5f\xb4\x3c"
+		"\x83\xf2\x17\x54\x68\xbb\x8e\x68\x6c\xcb\x91\x04\x73\x0c\x6d\xe5"
+		"\xe3\xe8\x64\xfb\x55\xa1\x44\x82\x8f\x28\x22\xd2\x22\x0f\xfd\xec"
+		"\x1c\x67\x3c\x6b\x17\xa1\x92\x19\x9b\x4a\xf8\x21\x60\x11\x22\x28"
+		"\xdc\x58\x15\xcb\xee\x45\x81\x59\x35\x85\x81\x21\x52\x69\x4a\x31"
+		"\x56\x6c\x28\x9f\x18\xbb\x93\x66\xee\x46\xcf\x04\x79\x15\x34\xe0"
+		"\x2f\x50\xcd\xa5\xdf\x38\x33\x11\x93\x6f\xde\x6b\x9d\x59\x73\xb9"
+		"\xd6\xa3\x55\xa8\xc8\xfd\x38\x15\xd0\xeb\x5c\x5c\x3c\x6e\x34\x71"
+		"\xac\x41\xa9\x40\xd5\x3f\x11\x93", 152, 0, 1,
+		"\xc0\xc1\xc2\xc3\xc4\xc5\xc6\xc7\xc8\xc9\xca\xcb\xcc\xcd\xce\xcf" },
+};
+
+/* The SA set of a test, one SA used in both directions */
+struct esp_kat_sa {
+	struct esp_sa sa;
+	struct esp_sa_set set;
+	uint8_t keymat[16 + 64];
+};
+
+/* Key the contexts of both directions of s as esp_sa_sync() would for k */
+static void esp_kat_setup(struct sa_block *s, const struct esp_kat *k, struct esp_kat_sa *ks)
+{
+	memset(s, 0, sizeof(*s));
+	memset(ks, 0, sizeof(*ks));
+	esp_set_algos(s, k->enc, k->keylen, k->auth);
+	esp_provider_choose(s);
+	s->ipsec.esn = k->esn;
+	memcpy(ks->keymat, k->keymat, s->ipsec.key_len + s->ipsec.salt_len + s->ipsec.md_len);
+	ks->sa.key = ks->keymat;
+	ks->sa.spi = htonl(k->spi);
+	ks->sa.seq_id = k->seq;
+	ks->sa.iv_key = (uint8_t *)k->iv_key;
+	ks->sa.id = 1;
+	ks->set.tx = ks->set.rx[0] = &ks->sa;
+	ks->set.nrx = 1;
+	ks->set.rx_hash[esp_spi_hash(ks->sa.spi)] = 1;
+	s->ipsec.set = &ks->set;
+	esp_ctx_setkey(s, &s->ipsec.tx_ctx, &ks->sa);
+	esp_ctx_setkey(s, &s->ipsec.rx_ctx[0], &ks->sa);
+	/* as if the packets before had arrived, for replay_esn() */
+	s->ipsec.rx_ctx[0].replay.top = k->seq - 1;
+}
+
+static void esp_kat_done(struct sa_block *s)
+{
+	esp_ctx_setkey(s, &s->ipsec.tx_ctx, NULL);
+	esp_ctx_setkey(s, &s->ipsec.rx_ctx[0], NULL);
+}
+
+/*
+ * Frame the inner packet as encap_udp_send_peer() does and seal it, the
+ * ESP packet starts at the head of p
+ */
+static void esp_kat_seal(struct sa_block *s, struct pkt *p, const uint8_t *inner, unsigned int len)
+{
+	pkt_reset(p, sizeof(esp_encap_header_t) + s->ipsec.iv_len);
+	memcpy(pkt_put(p, len), inner, len);
+	p->var_header_size = sizeof(esp_encap_header_t) + s->ipsec.iv_len;
+	pkt_push(p, p->var_header_size);
+	encap_esp_frame(s, p);
+	encap_esp_seal(s, &s->ipsec.tx_ctx, p);
+}
+
+/*
+ * Open the len bytes at the head of p and advance the replay window as
+ * esp_recv_done() does, 0 and the inner packet at *inner if it is
+ * authentic
+ */
+static int esp_kat_open(struct sa_block *s, struct pkt *p, unsigned int len,
+	uint8_t **inner, unsigned int *inner_len)
+{
+	pkt_reset(p, 0);
+	pkt_put(p, len);
+	p->sa = s->ipsec.rx_ctx[0].sa;
+	if (encap_esp_recv_peer(s, p) != 0 || encap_esp_open(s, &s->ipsec.rx_ctx[0], p) != 0)
+		return -1;
+	replay_update(&s->ipsec.rx_ctx[0].replay, p->seq);
+	*inner = p->data + p->payload + sizeof(esp_encap_header_t) + p->var_header_size;
+	*inner_len = p->len - p->payload - sizeof(esp_encap_header_t) - p->var_header_size;
+	return 0;
+}
+
+/*
+ * Each packet sealed from the inner one, opened back to it and, with one
+ * bit of the ICV flipped or a second time, refused
+ */
+static int bench_esp_kat(const struct esp_kat *k)
+{
+	struct sa_block s;
+	struct pkt p;
+	struct esp_kat_sa ks;
+	uint8_t buf[256], *inner;
+	unsigned int inner_len;
+	int wrong = 0;
+
+	esp_kat_setup(&s, k, &ks);
+	pkt_init(&p, buf, sizeof(buf));
+	esp_kat_seal(&s, &p, esp_kat_inner, sizeof(esp_kat_inner));
+	if (!k->open_only && (p.len != k->len || memcmp(p.data, k->esp, k->len))) {
+		printf("%s: sealed the wrong bytes\n", k->name);
+		wrong++;
+	}
+	if (esp_kat_open(&s, &p, p.len, &inner, &inner_len) != 0
+		|| inner_len != sizeof(esp_kat_inner)
+		|| memcmp(inner, esp_kat_inner, inner_len)) {
+		printf("%s: doesn't open what it sealed\n", k->name);
+		wrong++;
+	}
+
+	memcpy(buf, k->esp, k->len);
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != 0
+		|| inner_len != sizeof(esp_kat_inner)
+		|| memcmp(inner, esp_kat_inner, inner_len)) {
+		printf("%s: doesn't open\n", k->name);
+		wrong++;
+	}
+
+	memcpy(buf, k->esp, k->len);
+	buf[k->len - 1] ^= 1;
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != -1) {
+		printf("%s: takes a wrong ICV\n", k->name);
+		wrong++;
+	}
+
+	replay_init(&s.ipsec.rx_ctx[0].replay, 64);
+	s.ipsec.rx_ctx[0].replay.top = k->seq - 1;
+	memcpy(buf, k->esp, k->len);
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != 0) {
+		printf("%s: doesn't open with a replay window\n", k->name);
+		wrong++;
+	}
+	memcpy(buf, k->esp, k->len);
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != -1) {
+		printf("%s: takes a replayed packet\n", k->name);
+		wrong++;
+	}
+	replay_free(&s.ipsec.rx_ctx[0].replay);
+	esp_kat_done(&s);
+	return wrong;
+}
+
+/* Seal full sized packets with the transform of k */
+static void bench_esp_seal(const struct esp_kat *k, const char *prov)
+{
+	static uint8_t inner[1400], buf[1500];
+	struct sa_block s;
+	struct pkt p;
+	struct esp_kat_sa ks;
+	unsigned int i, n = 1000000;
+	double t;
+
+	esp_kat_setup(&s, k, &ks);
+	pkt_init(&p, buf, sizeof(buf));
+	t = now_ns();
+	for (i = 0; i < n; i++)
+		esp_kat_seal(&s, &p, inner, sizeof(inner));
+	t = now_ns() - t;
+	printf("seal %-21s %-7s %4u bytes: %6.1f ns/packet\n", k->name, prov,
+		(unsigned int)sizeof(inner), t / n);
+	esp_kat_done(&s);
+}
+
+/* The vectors through each provider compiled in, as --esp-provider picks it */
+static int bench_esp(void)
+{
+	static const struct {
+		const char *name;
+		enum esp_provider_enum id;
+	} provs[] = {
+		{ "gcrypt", ESP_PROVIDER_GCRYPT },
+#ifdef OPENSSL_ESP
+		{ "openssl", ESP_PROVIDER_OPENSSL },
+#endif
+	};
+	unsigned int i, j;
+	int wrong = 0, prov_wrong;
+
+	for (j = 0; j < sizeof(provs) / sizeof(provs[0]); j++) {
+		opt_esp_provider = provs[j].id;
+		prov_wrong = 0;
+		for (i = 0; i < sizeof(esp_kats) / sizeof(esp_kats[0]); i++) {
+			prov_wrong += bench_esp_kat(&esp_kats[i]);
+			if (!quick && !esp_kats[i].open_only)
+				bench_esp_seal(&esp_kats[i], provs[j].name);
+		}
+		if (prov_wrong)
+			printf("esp: %d wrong with %s\n", prov_wrong, provs[j].name);
+		wrong += prov_wrong;
+	}
+	opt_esp_provider = ESP_PROVIDER_GCRYPT;
+	return wrong != 0;
+}
+
+/*
+ * A batch of CBC packets of different sizes sealed by
+ * encap_esp_seal_batch(), side by side where aes-mb.c can, must come out
+ * as encap_esp_seal() seals them one by one
+ */
+static int bench_esp_seal_batch(void)
+{
+	enum { NPKT = 9 };
+	static uint8_t iv_key[16] = "fedcba9876543210";
+	static uint8_t inner[NPKT][1400], one[NPKT][1500], batch[NPKT][1500];
+	struct sa_block s;
+	struct pkt p[NPKT], *pp[NPKT];
+	struct esp_kat_sa ks;
+	const struct esp_kat *k = esp_kats;
+	unsigned int i, j, len[NPKT], sealed[NPKT], wrong = 0;
+
+	while (strcmp(k->name, "aes128-cbc-sha1"))
+		k++;
+	esp_kat_setup(&s, k, &ks);
+	ks.sa.iv_key = iv_key;
+	esp_ctx_setkey(&s, &s.ipsec.tx_ctx, &ks.sa);
+	for (i = 0; i < NPKT; i++) {
+		len[i] = 20 + i * 151;
+		for (j = 0; j < len[i]; j++)
+			inner[i][j] = rnd();
+		pkt_init(&p[i], one[i], sizeof(one[i]));
+		esp_kat_seal(&s, &p[i], inner[i], len[i]);
+		sealed[i] = p[i].len;
+	}
+
+	ks.sa.seq_id = k->seq;
+	for (i = 0; i < NPKT; i++) {
+		pkt_init(&p[i], batch[i], sizeof(batch[i]));
+		pkt_reset(&p[i], sizeof(esp_encap_header_t) + s.ipsec.iv_len);
+		memcpy(pkt_put(&p[i], len[i]), inner[i], len[i]);
+		p[i].var_header_size = sizeof(esp_encap_header_t) + s.ipsec.iv_len;
+		pkt_push(&p[i], p[i].var_header_size);
+		encap_esp_frame(&s, &p[i]);
+		pp[i] = &p[i];
+	}
+	encap_esp_seal_batch(&s, &s.ipsec.tx_ctx, pp, NPKT);
+	for (i = 0; i < NPKT; i++)
+		wrong += p[i].len != sealed[i] || memcmp(one[i], batch[i], sealed[i]);
+	if (wrong)
+		printf("seal batch: %u packets differ from encap_esp_seal()\n", wrong);
+	esp_kat_done(&s);
+	return wrong != 0;
+}
+
+/*
+ * CBC IVs from esp_seal_iv(): decrypted under the iv_key of the SA, each
+ * must give back its sequence number, the high half included
+ */
+static int bench_iv(void)
+{
+	static const uint64_t seqs[] = { 1, 2, 0xffffffff, 0x100000000ULL, 0x123456789abcdef0ULL };
+	static uint8_t iv_key[16] = "0123456789abcdef";
+	struct sa_block s;
+	struct pkt p;
+	struct esp_kat_sa ks;
+	uint8_t buf[64], blk[16], want[16];
+	unsigned char *iv;
+	gcry_cipher_hd_t ecb;
+	unsigned int i, n = quick ? 10000 : 2000000, wrong = 0;
+	uint32_t hi, lo;
+	uint64_t c;
+
+	for (i = 0; strcmp(esp_kats[i].name, "aes128-cbc-sha1"); i++)
+		;
+	esp_kat_setup(&s, &esp_kats[i], &ks);
+	ks.sa.iv_key = iv_key;
+	esp_ctx_setkey(&s, &s.ipsec.tx_ctx, &ks.sa);
+	gcry_cipher_open(&ecb, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB, 0);
+	gcry_cipher_setkey(ecb, iv_key, sizeof(iv_key));
+	pkt_init(&p, buf, sizeof(buf));
+	pkt_put(&p, sizeof(esp_encap_header_t) + s.ipsec.iv_len);
+
+	for (i = 0; i < n; i++) {
+		p.seq = i < sizeof(seqs) / sizeof(seqs[0]) ? seqs[i] : (uint64_t)rnd() << 32 | rnd();
+		iv = esp_seal_iv(&s, &s.ipsec.tx_ctx, &p);
+		gcry_cipher_decrypt(ecb, blk, sizeof(blk), iv, s.ipsec.iv_len);
+		hi = htonl(p.seq >> 32);
+		lo = htonl((uint32_t)p.seq);
+		memset(want, 0, 8);
+		memcpy(want + 8, &hi, 4);
+		memcpy(want + 12, &lo, 4);
+		wrong += memcmp(blk, want, sizeof(want)) != 0;
+	}
+	if (wrong)
+		printf("cbc iv: %u not the encrypted sequence number\n", wrong);
+
+	if (!quick) {
+		c = now_cycles();
+		for (i = 0; i < n; i++) {
+			p.seq = i + 1;
+			esp_seal_iv(&s, &s.ipsec.tx_ctx, &p);
+		}
+		c = now_cycles() - c;
+		printf("cbc iv: %7.1f cycles/packet\n", (double)c / n);
+	}
+	gcry_cipher_close(ecb);
+	esp_kat_done(&s);
+	return wrong != 0;
+}
+
+#ifdef HAVE_TUN_OFFLOAD
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+#define TCP_HLEN 52 /* IP and TCP header with timestamps */
+
+/* RFC 1071 one's complement sum, a byte pair at a time */
+static uint32_t tcp_sum(uint32_t sum, const uint8_t *p, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += p[i] << 8 | p[i + 1];
+	if (len & 1)
+		sum += p[len - 1] << 8;
+	return sum;
+}
+
+static uint16_t tcp_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/* Checksums of an IPv4 TCP packet, both 0 when they are right */
+static uint16_t tcp_ip_csum(const uint8_t *p)
+{
+	return tcp_fold(tcp_sum(0, p, 20));
+}
+
+static uint16_t tcp_csum(const uint8_t *p, unsigned int len)
+{
+	uint8_t pseudo[4] = { 0, 6, (len - 20) >> 8, (len - 20) & 0xff };
+
+	return tcp_fold(tcp_sum(tcp_sum(tcp_sum(0, p + 12, 8), pseudo, 4), p + 20, len - 20));
+}
+
+/* Set the lengths and checksums of a packet built by tcp_packet() or changed */
+static void tcp_fix(uint8_t *p, unsigned int len)
+{
+	uint16_t v16;
+
+	p[2] = len >> 8;
+	p[3] = len & 0xff;
+	memset(p + 10, 0, 2);
+	v16 = tcp_ip_csum(p);
+	p[10] = v16 >> 8;
+	p[11] = v16 & 0xff;
+	memset(p + 36, 0, 2);
+	v16 = tcp_csum(p, len);
+	p[36] = v16 >> 8;
+	p[37] = v16 & 0xff;
+}
+
+/* 10.0.0.1:1234 -> 10.0.0.2:80 with random payload */
+static unsigned int tcp_packet(uint8_t *p, unsigned int plen, uint8_t flags, uint32_t seq, uint16_t id)
+{
+	static const uint8_t hdr[TCP_HLEN] = {
+		0x45, 0, 0, 0, 0, 0, 0x40, 0, 64, 6, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2,
+		0x04, 0xd2, 0, 80, 0, 0, 0, 0, 0x12, 0x34, 0x56, 0x78, 0x80, 0, 0x01, 0xf5, 0, 0, 0, 0,
+		1, 1, 8, 10, 0, 0, 0, 1, 0, 0, 0, 2 /* NOP NOP timestamps */
+	};
+	unsigned int i;
+
+	memcpy(p, hdr, TCP_HLEN);
+	p[4] = id >> 8;
+	p[5] = id & 0xff;
+	p[24] = seq >> 24;
+	p[25] = seq >> 16;
+	p[26] = seq >> 8;
+	p[27] = seq;
+	p[33] = flags;
+	for (i = 0; i < plen; i++)
+		p[TCP_HLEN + i] = rnd();
+	tcp_fix(p, TCP_HLEN + plen);
+	return TCP_HLEN + plen;
+}
+
+static uint32_t tcp_seq(const uint8_t *p)
+{
+	return (uint32_t)p[24] << 24 | p[25] << 16 | p[26] << 8 | p[27];
+}
+
+/*
+ * Segment a TSO super-packet from the tunnel device, 3.5 MSS of payload
+ * with FIN, PSH and CWR set. Every segment must carry the right lengths,
+ * IP id, sequence number, payload and checksums, CWR only on the first
+ * one and FIN and PSH only on the last.
+ */
+static int bench_gso(void)
+{
+	static uint8_t super[GSO_MAX_PACKET], seg[1500];
+	struct virtio_net_hdr vh;
+	struct gso_iter it;
+	unsigned int mss = 1000, plen = 3500, len, n, i, rounds = quick ? 1 : 100000;
+	uint32_t seq0 = 0xfffffc00; /* wraps in the middle */
+	uint16_t id0 = 0xfffe;
+	int wrong = 0;
+	double t;
+
+	len = tcp_packet(super, plen, TCP_ACK | TCP_PSH | TCP_FIN | TCP_CWR, seq0, id0);
+	memset(&vh, 0, sizeof(vh));
+	vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	vh.gso_size = mss;
+	vh.hdr_len = TCP_HLEN;
+	vh.csum_start = 20;
+	vh.csum_offset = 16;
+
+	t = now_ns();
+	for (i = 0; i < rounds; i++) {
+		if (gso_start(&it, super, len, &vh, sizeof(seg)) == -1) {
+			printf("gso: super-packet refused\n");
+			return 1;
+		}
+		for (n = 0; (len = gso_next(&it, seg)) != 0; n++) {
+			unsigned int slen = MIN(mss, plen - n * mss), last = (n + 1) * mss >= plen;
+
+			if (i)
+				continue;
+			if (len != TCP_HLEN + slen || (unsigned int)(seg[2] << 8 | seg[3]) != len
+				|| (uint16_t)(seg[4] << 8 | seg[5]) != (uint16_t)(id0 + n)
+				|| tcp_seq(seg) != seq0 + n * mss
+				|| memcmp(seg + TCP_HLEN, super + TCP_HLEN + n * mss, slen)
+				|| tcp_ip_csum(seg) != 0 || tcp_csum(seg, len) != 0
+				|| seg[33] != (TCP_ACK | (n == 0 ? TCP_CWR : 0) | (last ? TCP_PSH | TCP_FIN : 0))) {
+				printf("gso: segment %u wrong\n", n);
+				wrong++;
+			}
+		}
+		if (n != 4) {
+			printf("gso: %u segments instead of 4\n", n);
+			return 1;
+		}
+		len = TCP_HLEN + plen;
+	}
+	t = now_ns() - t;
+	if (!quick)
+		printf("gso %u bytes: %6.1f ns/segment\n", len, t / (rounds * 4));
+	return wrong != 0;
+}
+
+/*
+ * Coalesce the segments of a super-packet as they come out of gso_next()
+ * again: with the checksum the kernel is left to fill in, the result
+ * must be the original. Segments out of order, from a different flow or
+ * with a bad checksum must be turned down.
+ */
+static int bench_gro(void)
+{
+	static uint8_t super[GSO_MAX_PACKET], buf[GSO_MAX_PACKET], seg[4][1500], bad[1500];
+	unsigned int mss = 1000, plen = 3500, len, seglen[4], n, i, rounds = quick ? 1 : 100000;
+	struct virtio_net_hdr vh;
+	struct gso_iter it;
+	struct gro g;
+	int r, wrong = 0;
+	double t;
+
+	len = tcp_packet(super, plen, TCP_ACK | TCP_PSH, 0x10000000, 0x1234);
+	memset(&vh, 0, sizeof(vh));
+	vh.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	vh.gso_size = mss;
+	gso_start(&it, super, len, &vh, sizeof(seg[0]));
+	for (n = 0; n < 4; n++)
+		seglen[n] = gso_next(&it, seg[n]);
+
+	memset(&g, 0, sizeof(g));
+	g.buf = buf;
+	t = now_ns();
+	for (i = 0; i < rounds; i++) {
+		for (n = 0; n < 4; n++) {
+			r = gro_add(&g, seg[n], seglen[n]);
+			if (r != (n == 3 ? GRO_FLUSH : GRO_MERGED)) {
+				printf("gro: segment %u not merged (%d)\n", n, r);
+				return 1;
+			}
+		}
+		if (gro_finish(&g, &vh) != len) {
+			printf("gro: super-packet of the wrong length\n");
+			return 1;
+		}
+	}
+	t = now_ns() - t;
+	if (vh.gso_type != VIRTIO_NET_HDR_GSO_TCPV4 || vh.gso_size != mss || vh.hdr_len != TCP_HLEN
+		|| gso_csum(buf, len, &vh) == -1 || memcmp(buf, super, len)) {
+		printf("gro: super-packet differs from the original\n");
+		wrong++;
+	}
+	if (!quick)
+		printf("gro %u bytes: %6.1f ns/segment\n", len, t / (rounds * 4));
+
+	/* one after the other: the first one is taken, the odd one not */
+#define GRO_REFUSE(what, pkt, plen) do { \
+		gro_add(&g, seg[0], seglen[0]); \
+		if (gro_add(&g, pkt, plen) != GRO_NO) { \
+			printf("gro: %s merged\n", what); \
+			wrong++; \
+		} \
+		gro_finish(&g, &vh); \
+	} while (0)
+
+	GRO_REFUSE("segment out of order", seg[2], seglen[2]);
+	memcpy(bad, seg[1], seglen[1]);
+	bad[1] = 0x10; /* tos */
+	tcp_fix(bad, seglen[1]);
+	GRO_REFUSE("segment with another TOS", bad, seglen[1]);
+	memcpy(bad, seg[1], seglen[1]);
+	bad[23] = 81; /* destination port */
+	tcp_fix(bad, seglen[1]);
+	GRO_REFUSE("segment of another flow", bad, seglen[1]);
+	memcpy(bad, seg[1], seglen[1]);
+	bad[TCP_HLEN] ^= 1;
+	GRO_REFUSE("segment with a bad checksum", bad, seglen[1]);
+	memcpy(bad, seg[1], seglen[1]);
+	bad[33] |= TCP_FIN;
+	tcp_fix(bad, seglen[1]);
+	GRO_REFUSE("FIN segment", bad, seglen[1]);
+#undef GRO_REFUSE
+	return wrong != 0;
+}
+#endif
+
+/* The 16 bit word loop tunip.c used to have, as the reference */
+static uint16_t cksum_rfc1071(const uint16_t *w, int len)
+{
+	int sum = 0;
+	uint16_t odd = 0;
+
+	while (len > 1) {
+		sum += *w++;
+		len -= 2;
+	}
+	if (len == 1) {
+		*(uint8_t *)&odd = *(const uint8_t *)w;
+		sum += odd;
+	}
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return ~sum;
+}
+
+/* Full checksums of packets of all sizes up to 1500 bytes */
+static int bench_cksum_full(void)
+{
+	static uint16_t buf[1500 / 2];
+	unsigned int i, n = quick ? 20000 : 2000000, wrong = 0;
+	uint32_t sink = 0;
+	double t_ref, t_new;
+
+	for (i = 0; i < sizeof(buf) / 2; i++)
+		buf[i] = rnd();
+	for (i = 0; i <= 1500; i++)
+		wrong += cksum_rfc1071(buf, i) != in_cksum(buf, i);
+	/* odd start, as on the bytes behind an IP header with options */
+	for (i = 0; i < 1499; i++)
+		wrong += cksum_rfc1071((const uint16_t *)((uint8_t *)buf + 1), i)
+			!= in_cksum((uint8_t *)buf + 1, i);
+
+	t_ref = now_ns();
+	for (i = 0; i < n; i++)
+		sink += cksum_rfc1071(buf, 64 + i % 1437);
+	t_ref = now_ns() - t_ref;
+	t_new = now_ns();
+	for (i = 0; i < n; i++)
+		sink += in_cksum(buf, 64 + i % 1437);
+	t_new = now_ns() - t_new;
+
+	if (!quick)
+		printf("in_cksum 64-1500 bytes: %6.2f ns/packet, 16 bit loop %6.2f (%u)\n",
+			t_new / n, t_ref / n, sink & 1);
+	if (wrong) {
+		printf("in_cksum: %u sums differ from the 16 bit loop\n", wrong);
+		return 1;
+	}
+	return 0;
+}
+
+/* The outer IP header of IP ESP as tunip.c used to build and sum it */
+static void cksum_header_built(struct ip *ip, const struct ip *tmpl, unsigned int i)
+{
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = 5;
+	ip->ip_id = htons(i);
+	ip->ip_p = IPPROTO_ESP;
+	ip->ip_src = tmpl->ip_src;
+	ip->ip_dst = tmpl->ip_dst;
+	ip->ip_tos = i >> 10;
+	ip->ip_off = 0;
+	ip->ip_ttl = IPDEFTTL;
+	ip->ip_sum = 0;
+	ip->ip_len = htons(60 + i % 1440);
+	ip->ip_sum = cksum_rfc1071((uint16_t *)ip, sizeof(*ip));
+}
+
+/*
+ * That header built and summed for every packet, against filling in the
+ * template of the SA with ip_template_fill() as encap_esp_send_peer()
+ * does. Both must come out the same.
+ */
+static int bench_cksum_header(void)
+{
+	struct ip tmpl, full, fill;
+	unsigned int i, n = quick ? 100000 : 20000000, wrong = 0;
+	uint32_t sink = 0;
+	double t_full, t_tmpl;
+
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.ip_v = IPVERSION;
+	tmpl.ip_hl = 5;
+	tmpl.ip_ttl = IPDEFTTL;
+	tmpl.ip_p = IPPROTO_ESP;
+	tmpl.ip_src.s_addr = htonl(0xc0a80102);
+	tmpl.ip_dst.s_addr = htonl(0xcb007105);
+	tmpl.ip_sum = in_cksum(&tmpl, sizeof(tmpl));
+
+	/* all TOS values, lengths up to 1500 bytes, ids across the 16 bits */
+	for (i = 0; i < 1 << 18; i += quick ? 7 : 1) {
+		cksum_header_built(&full, &tmpl, i);
+		ip_template_fill(&fill, &tmpl, i >> 10, htons(60 + i % 1440), htons(i));
+		wrong += memcmp(&full, &fill, sizeof(full)) != 0;
+	}
+
+	t_full = now_ns();
+	for (i = 0; i < n; i++) {
+		cksum_header_built(&full, &tmpl, i);
+		sink += full.ip_sum;
+	}
+	t_full = now_ns() - t_full;
+
+	t_tmpl = now_ns();
+	for (i = 0; i < n; i++) {
+		ip_template_fill(&fill, &tmpl, i >> 10, htons(60 + i % 1440), htons(i));
+		sink += fill.ip_sum;
+	}
+	t_tmpl = now_ns() - t_tmpl;
+
+	if (!quick)
+		printf("outer ip header: %6.2f ns/packet from the template, %6.2f built (%u)\n",
+			t_tmpl / n, t_full / n, sink & 1);
+	if (wrong) {
+		printf("outer ip header: %u headers from the template differ\n", wrong);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Open the ESN vector called name through the ESP code, as it is and
+ * with the receiver a whole 2^32 packets behind: the high half of the
+ * sequence number it infers is then another one, which the ICV must
+ * catch
+ */
+static int esp_kat_esn_hi(const char *name, unsigned int icv_len)
+{
+	const struct esp_kat *k = esp_kats;
+	struct sa_block s;
+	struct pkt p;
+	struct esp_kat_sa ks;
+	uint8_t buf[256], *inner;
+	unsigned int inner_len;
+	int wrong = 0;
+
+	while (strcmp(k->name, name))
+		k++;
+	esp_kat_setup(&s, k, &ks);
+	pkt_init(&p, buf, sizeof(buf));
+	if (s.ipsec.icv_len != icv_len) {
+		printf("%s: %u byte ICV\n", name, (unsigned int)s.ipsec.icv_len);
+		wrong++;
+	}
+	memcpy(buf, k->esp, k->len);
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != 0) {
+		printf("%s: doesn't open\n", name);
+		wrong++;
+	}
+	s.ipsec.rx_ctx[0].replay.top = k->seq - 1 - ((uint64_t)1 << 32);
+	memcpy(buf, k->esp, k->len);
+	if (esp_kat_open(&s, &p, k->len, &inner, &inner_len) != -1) {
+		printf("%s: takes the wrong high sequence number bits\n", name);
+		wrong++;
+	}
+	esp_kat_done(&s);
+	return wrong;
+}
+
+/*
+ * The ESP HMACs on a full sized packet, keyed as vpnc keys them: with
+ * as many bytes as the digest has. RFC 4231 test case 2 checks the
+ * SHA-2 ones, truncated to the ICV RFC 4868 sends, and an ESN vector
+ * each the way the ESP code authenticates the high sequence number bits.
+ */
+static int bench_hmac(void)
+{
+	static const struct {
+		const char *name;
+		int algo;
+		unsigned int icv_len;
+		const char *tc2; /* HMAC of "what do ya want for nothing?" keyed "Jefe" */
+		const char *kat; /* in esp_kats[], with ESN */
+	} hmacs[] = {
+		{ "sha1", GCRY_MD_SHA1, 12, NULL, "aes128-cbc-sha1-esn" },
+		{ "sha256", GCRY_MD_SHA256, 16,
+			"\x5b\xdc\xc1\x46\xbf\x60\x75\x4e\x6a\x04\x24\x26\x08\x95\x75\xc7",
+			"aes128-cbc-sha256-esn" },
+		{ "sha384", GCRY_MD_SHA384, 24,
+			"\xaf\x45\xd2\xe3\x76\x48\x40\x31\x61\x7f\x78\xd2\xb5\x8a\x6b\x1b"
+			"\x9c\x7e\xf4\x64\xf5\xa0\x1b\x47",
+			"aes128-cbc-sha384-esn" },
+		{ "sha512", GCRY_MD_SHA512, 32,
+			"\x16\x4b\x7a\x7b\xfc\xf8\x19\xe2\xe3\x95\xfb\xe7\x3b\x56\xe0\xa3"
+			"\x87\xbd\x64\x22\x2e\x83\x1f\xd6\x10\x27\x0c\xd7\xea\x25\x05\x54",
+			"aes128-cbc-sha512-esn" },
+	};
+	static const char data[] = "what do ya want for nothing?";
+	uint8_t pkt[1408], key[64];
+	gcry_md_hd_t md;
+	unsigned int i, j, n = quick ? 16 : 200000, wrong = 0;
+	uint64_t c;
+
+	for (j = 0; j < sizeof(pkt); j++)
+		pkt[j] = rnd();
+	for (j = 0; j < sizeof(key); j++)
+		key[j] = rnd();
+	for (i = 0; i < sizeof(hmacs) / sizeof(hmacs[0]); i++) {
+		gcry_md_open(&md, hmacs[i].algo, GCRY_MD_FLAG_HMAC);
+		if (hmacs[i].tc2) {
+			gcry_md_setkey(md, "Jefe", 4);
+			gcry_md_write(md, data, sizeof(data) - 1);
+			if (memcmp(gcry_md_read(md, 0), hmacs[i].tc2, hmacs[i].icv_len)) {
+				printf("hmac-%s: wrong RFC 4231 digest\n", hmacs[i].name);
+				wrong++;
+			}
+		}
+		wrong += esp_kat_esn_hi(hmacs[i].kat, hmacs[i].icv_len);
+		gcry_md_setkey(md, key, gcry_md_get_algo_dlen(hmacs[i].algo));
+		c = now_cycles();
+		for (j = 0; j < n; j++) {
+			gcry_md_reset(md);
+			gcry_md_write(md, pkt, sizeof(pkt));
+			pkt[0] ^= gcry_md_read(md, 0)[0];
+		}
+		c = now_cycles() - c;
+		gcry_md_close(md);
+		if (!quick)
+			printf("hmac-%s-%u %4u bytes: %8.1f cycles/packet\n", hmacs[i].name,
+				hmacs[i].icv_len * 8, (unsigned int)sizeof(pkt), (double)c / n);
+	}
+	return wrong != 0;
+}
+
+#ifdef HAVE_AES_MB
+/*
+ * AES-CBC over a batch of 32 packets of one size, one packet after the
+ * other with libgcrypt against side by side with aes_mb. The
+ * ciphertexts must be the same.
+ */
+static int bench_aes_mb_size(int algo, unsigned int keylen, unsigned int len)
+{
+	enum { NPKT = 32 };
+	static uint8_t ref[NPKT][1504], mb[NPKT][1504];
+	uint8_t key[32], iv[NPKT][16];
+	struct aes_mb_job job[NPKT];
+	struct aes_mb_key k;
+	gcry_cipher_hd_t ctx;
+	unsigned int i, j, rounds = quick ? 4 : 20000, wrong = 0;
+	uint64_t c_ref, c_mb;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = rnd();
+	gcry_cipher_open(&ctx, algo, GCRY_CIPHER_MODE_CBC, 0);
+	gcry_cipher_setkey(ctx, key, keylen);
+	aes_mb_setkey(&k, key, keylen);
+	for (i = 0; i < NPKT; i++) {
+		for (j = 0; j < 16; j++)
+			iv[i][j] = rnd();
+		for (j = 0; j < len; j++)
+			ref[i][j] = mb[i][j] = rnd();
+		job[i].data = mb[i];
+		job[i].len = len;
+		job[i].iv = iv[i];
+	}
+
+	/* the same data is encrypted over and over, both sides alike */
+	c_ref = now_cycles();
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < NPKT; i++) {
+			gcry_cipher_setiv(ctx, iv[i], 16);
+			gcry_cipher_encrypt(ctx, ref[i], len, NULL, 0);
+		}
+	c_ref = now_cycles() - c_ref;
+	c_mb = now_cycles();
+	for (j = 0; j < rounds; j++)
+		aes_mb_cbc_encrypt(&k, job, NPKT);
+	c_mb = now_cycles() - c_mb;
+	gcry_cipher_close(ctx);
+
+	for (i = 0; i < NPKT; i++)
+		wrong += memcmp(ref[i], mb[i], len) != 0;
+	if (!quick)
+		printf("aes%u-cbc %4u bytes: %8.1f cycles/packet multi-buffer, %8.1f one by one\n",
+			keylen * 8, len, (double)c_mb / (rounds * NPKT), (double)c_ref / (rounds * NPKT));
+	if (wrong) {
+		printf("aes%u-cbc %u bytes: %u packets differ from libgcrypt\n", keylen * 8, len, wrong);
+		return 1;
+	}
+	return 0;
+}
+
+static int bench_aes_mb(void)
+{
+	static const unsigned int sizes[] = { 64, 256, 576, 1408 };
+	unsigned int i;
+	int ret = 0;
+
+	if (!aes_mb_available())
+		return 0;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		ret |= bench_aes_mb_size(GCRY_CIPHER_AES128, 16, sizes[i]);
+	ret |= bench_aes_mb_size(GCRY_CIPHER_AES192, 24, 256);
+	ret |= bench_aes_mb_size(GCRY_CIPHER_AES256, 32, 256);
+	return ret;
+}
+#endif
+
+#ifdef OPENSSL_ESP
+/*
+ * Sealing a packet with libgcrypt and with OpenSSL: AES-128-CBC with
+ * HMAC-SHA1-96, and AES-128-GCM. Both must produce the same bytes.
+ */
+static int bench_openssl_size(int mode, unsigned int len)
+{
+	static uint8_t ref[1504 + 16], ossl[1504 + 16];
+	uint8_t key[16], md_key[20], iv[16], digest[ESP_OSSL_MAX_MD];
+	unsigned int i, n = quick ? 100 : 200000, tag = mode == GCRY_CIPHER_MODE_GCM ? 16 : 12;
+	gcry_cipher_hd_t cry;
+	gcry_md_hd_t md = NULL;
+	struct esp_ossl *o;
+	uint64_t c_ref, c_ossl;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = rnd();
+	for (i = 0; i < sizeof(md_key); i++)
+		md_key[i] = rnd();
+	for (i = 0; i < sizeof(iv); i++)
+		iv[i] = rnd();
+	for (i = 0; i < len; i++)
+		ref[i] = ossl[i] = rnd();
+
+	gcry_cipher_open(&cry, GCRY_CIPHER_AES128, mode, 0);
+	gcry_cipher_setkey(cry, key, sizeof(key));
+	if (mode == GCRY_CIPHER_MODE_CBC) {
+		gcry_md_open(&md, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
+		gcry_md_setkey(md, md_key, sizeof(md_key));
+	}
+	o = esp_ossl_new(GCRY_CIPHER_AES128, mode, key, sizeof(key),
+		md ? GCRY_MD_SHA1 : 0, md_key, sizeof(md_key));
+	if (o == NULL) {
+		printf("openssl: no context for mode %d\n", mode);
+		return 1;
+	}
+
+	c_ref = now_cycles();
+	for (i = 0; i < n; i++) {
+		if (md) {
+			gcry_cipher_setiv(cry, iv, 16);
+			gcry_cipher_encrypt(cry, ref, len, NULL, 0);
+			gcry_md_reset(md);
+			gcry_md_write(md, ref, len);
+			memcpy(ref + len, gcry_md_read(md, 0), tag);
+		} else {
+			gcry_cipher_setiv(cry, iv, 12);
+			gcry_cipher_authenticate(cry, iv, 8);
+			gcry_cipher_encrypt(cry, ref, len, NULL, 0);
+			gcry_cipher_gettag(cry, ref + len, tag);
+		}
+	}
+	c_ref = now_cycles() - c_ref;
+
+	c_ossl = now_cycles();
+	for (i = 0; i < n; i++) {
+		if (md) {
+			esp_ossl_cbc(o, 1, iv, ossl, len);
+			esp_ossl_hmac(o, ossl, len, NULL, digest);
+			memcpy(ossl + len, digest, tag);
+		} else
+			esp_ossl_aead(o, 1, iv, 12, iv, 8, ossl, len, ossl + len, tag);
+	}
+	c_ossl = now_cycles() - c_ossl;
+
+	if (!quick)
+		printf("%s %4u bytes: %8.1f cycles/packet OpenSSL, %8.1f libgcrypt\n",
+			md ? "aes128-cbc-sha1" : "aes128-gcm     ", len,
+			(double)c_ossl / n, (double)c_ref / n);
+	if (memcmp(ref, ossl, len + tag)) {
+		printf("openssl: mode %d, %u bytes differ from libgcrypt\n", mode, len);
+		ret = 1;
+	}
+	esp_ossl_free(o);
+	gcry_cipher_close(cry);
+	if (md)
+		gcry_md_close(md);
+	return ret;
+}
+
+static int bench_openssl(void)
+{
+	static const unsigned int sizes[] = { 64, 576, 1408 };
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ret |= bench_openssl_size(GCRY_CIPHER_MODE_CBC, sizes[i]);
+		ret |= bench_openssl_size(GCRY_CIPHER_MODE_GCM, sizes[i]);
+	}
+	return ret;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+
+	quick = (argc > 1 && !strcmp(argv[1], "-q"));
+	gcry_check_version(NULL);
+	logmsg = log_quiet;
+
+	ret |= bench_replay();
+	ret |= bench_esp();
+	ret |= bench_iv();
+	ret |= bench_esp_seal_batch();
+	ret |= bench_hmac();
+	ret |= bench_cksum_full();
+	ret |= bench_cksum_header();
+#ifdef HAVE_AES_MB
+	ret |= bench_aes_mb();
+#endif
+#ifdef HAVE_TUN_OFFLOAD
+	ret |= bench_gso();
+	ret |= bench_gro();
+#endif
+#ifdef OPENSSL_ESP
+	ret |= bench_openssl();
+#endif
+
+	if (quick)
+		printf("%s\n", ret ? "Failed" : "Success");
+	return ret;
+}
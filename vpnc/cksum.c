@@ -0,0 +1,79 @@
+/* Internet checksum (RFC 1071)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "cksum.h"
+
+/*
+ * One's complement sum of 16 bit words. Summing 32 bit words into a 64
+ * bit accumulator and folding afterwards gives the same result, and
+ * leaves no carry to propagate inside the loop: it is a plain reduction
+ * the compiler can vectorize. A packet would have to be 16 GB to
+ * overflow the accumulator.
+ */
+uint64_t csum_add(uint64_t sum, const void *data, unsigned int len)
+{
+	const uint8_t *p = data;
+	unsigned int i, n = len / 4;
+	uint32_t w;
+	uint16_t h = 0;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&w, p + 4 * i, 4);
+		sum += w;
+	}
+	p += 4 * n;
+	len -= 4 * n;
+	if (len >= 2) {
+		memcpy(&h, p, 2);
+		sum += h;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		h = 0;
+		memcpy(&h, p, 1);
+		sum += h;
+	}
+	return sum;
+}
+
+/*
+ * Copy an IP header from a template whose checksum was computed with
+ * ip_tos, ip_len and ip_id 0, fill those in and fix the checksum up for
+ * them, instead of summing the header again. len and id are stored as
+ * they are, in the byte order the header wants.
+ */
+void ip_template_fill(struct ip *ip, const struct ip *tmpl, uint8_t tos, uint16_t len, uint16_t id)
+{
+	uint8_t tos_word[2] = { 0, tos };
+	uint16_t w, check;
+
+	memcpy(ip, tmpl, sizeof(struct ip));
+	ip->ip_tos = tos;
+	/* the 16 bit word it is in, the version and header length left out */
+	memcpy(&w, tos_word, 2);
+	check = csum_replace(ip->ip_sum, 0, w);
+	ip->ip_len = len;
+	check = csum_replace(check, 0, len);
+	ip->ip_id = id;
+	ip->ip_sum = csum_replace(check, 0, id);
+}
@@ -0,0 +1,57 @@
+/* Internet checksum (RFC 1071)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __CKSUM_H__
+#define __CKSUM_H__
+
+#include <stdint.h>
+
+struct ip;
+
+/*
+ * The sums are kept in host byte order over words read in network
+ * order, which the one's complement sum doesn't care about: a folded
+ * checksum can be stored as is.
+ */
+extern uint64_t csum_add(uint64_t sum, const void *data, unsigned int len);
+
+static __inline__ uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static __inline__ uint16_t in_cksum(const void *data, unsigned int len)
+{
+	return csum_fold(csum_add(0, data, len));
+}
+
+/*
+ * The checksum after the 16 bit word old of the data it covers was
+ * changed to new, without summing the data again (RFC 1624, eqn. 3)
+ */
+static __inline__ uint16_t csum_replace(uint16_t check, uint16_t old, uint16_t new)
+{
+	return csum_fold((uint64_t)(uint16_t)~check + (uint16_t)~old + new);
+}
+
+extern void ip_template_fill(struct ip *ip, const struct ip *tmpl, uint8_t tos, uint16_t len, uint16_t id);
+
+#endif
@@ -49,6 +49,20 @@ enum natt_mode_enum opt_natt_mode;
 enum vendor_enum opt_vendor;
 enum if_mode_enum opt_if_mode;
 uint16_t opt_udpencapport;
+int opt_batch;
+int opt_tun_queues;
+int opt_replay_window;
+int opt_io_uring;
+int opt_tun_offload;
+int opt_udp_offload;
+int opt_kernel_ipsec;
+int opt_hugepages;
+int opt_crypto_threads;
+int opt_duplex;
+int opt_sa_grace;
+int opt_rekey_at;
+int opt_esn;
+enum esp_provider_enum opt_esp_provider;
 
 static void log_to_stderr(int priority __attribute__((unused)), const char *format, ...)
 {
@@ -340,6 +354,41 @@ static const char *config_def_dpd_idle(void)
 	return "300";
 }
 
+static const char *config_def_batch(void)
+{
+	return "32";
+}
+
+static const char *config_def_tun_queues(void)
+{
+	return "1";
+}
+
+static const char *config_def_crypto_threads(void)
+{
+	return "0";
+}
+
+static const char *config_def_replay_window(void)
+{
+	return "64";
+}
+
+static const char *config_def_sa_grace(void)
+{
+	return "30";
+}
+
+static const char *config_def_rekey_at(void)
+{
+	return "85";
+}
+
+static const char *config_def_esp_provider(void)
+{
+	return "auto";
+}
+
 static const char *config_ca_dir(void)
 {
 	return "/etc/ssl/certs";
@@ -649,6 +698,137 @@ static const struct config_names_s {
 		"<executable>",
 		"path to password program or helper name\n",
 		NULL
+	}, {
+		CONFIG_BATCH, 1, 1,
+		"--batch",
+		"Batch size",
+		"<1-64>",
+		"Maximum number of ESP packets received or sent per wakeup.\n"
+		"The number actually used adapts to the traffic load.\n"
+		"Use 1 to handle each packet on its own.\n",
+		config_def_batch
+	}, {
+		CONFIG_TUN_QUEUES, 1, 1,
+		"--tun-queues",
+		"Tunnel queues",
+		"<1-16>",
+		"Number of tunnel device queues. Each queue is read by its own\n"
+		"thread, pinned to a CPU, which encrypts the packets for the peer.\n"
+		"Needs a Linux tun/tap driver with multi-queue support.\n",
+		config_def_tun_queues
+	}, {
+		CONFIG_REPLAY_WINDOW, 1, 1,
+		"--replay-window",
+		"Replay window",
+		"<0-4096>",
+		"Number of ESP packets the anti-replay check keeps track of.\n"
+		"Packets older than that or received twice are dropped.\n"
+		"Larger windows tolerate more reordering. 0 disables the check.\n",
+		config_def_replay_window
+	}, {
+		CONFIG_IO_URING, 0, 1,
+		"--io-uring",
+		"Use io_uring",
+		NULL,
+		"Move packets between the tunnel device and the peer with io_uring,\n"
+		"saving most of the per-packet system calls.\n"
+		"Needs Linux 6.0 or later, falls back to epoll otherwise.\n",
+		NULL
+	}, {
+		CONFIG_NO_TUN_OFFLOAD, 0, 1,
+		"--no-tun-offload",
+		"Disable tunnel offload",
+		NULL,
+		"Don't let the kernel pass TCP super-packets to vpnc (TSO), which\n"
+		"vpnc otherwise splits up itself right before encryption, saving\n"
+		"most tunnel device reads for bulk TCP. Linux tun mode only,\n"
+		"not used together with --io-uring.\n",
+		NULL
+	}, {
+		CONFIG_NO_UDP_OFFLOAD, 0, 1,
+		"--no-udp-offload",
+		"Disable UDP offload",
+		NULL,
+		"Don't send and receive UDP encapsulated ESP packets as trains of\n"
+		"equal sized packets (UDP_SEGMENT and UDP_GRO), but one by one.\n",
+		NULL
+	}, {
+		CONFIG_KERNEL_IPSEC, 0, 1,
+		"--kernel-ipsec",
+		"Use kernel IPSec",
+		NULL,
+		"Install the negotiated SAs and matching policies in the kernel\n"
+		"(Linux XFRM), which then carries the ESP traffic itself; vpnc\n"
+		"only handles IKE, DPD and rekeying. Not available with the old\n"
+		"NAT-T drafts, falls back to userspace ESP if the kernel refuses.\n",
+		NULL
+	}, {
+		CONFIG_HUGEPAGES, 0, 1,
+		"--hugepages",
+		"Use huge pages",
+		NULL,
+		"Put the packet buffers in huge pages, saving TLB misses at high\n"
+		"packet rates. Needs pages reserved with vm.nr_hugepages, uses\n"
+		"normal memory otherwise.\n",
+		NULL
+	}, {
+		CONFIG_CRYPTO_THREADS, 1, 1,
+		"--crypto-threads",
+		"Crypto threads",
+		"<0-16>",
+		"Number of threads encrypting and decrypting ESP packets, so a\n"
+		"single tunnel can use several CPUs. Packets leave in the order\n"
+		"they arrived. 0 does the crypto in the main loop. Not used\n"
+		"together with --io-uring.\n",
+		config_def_crypto_threads
+	}, {
+		CONFIG_DUPLEX, 0, 1,
+		"--duplex",
+		"Duplex mode",
+		NULL,
+		"Give both directions of the tunnel a thread of their own: one\n"
+		"reads the tunnel device and encrypts, one receives from the peer\n"
+		"and decrypts. IKE, DPD and rekeying stay in the main thread.\n"
+		"Not used together with --io-uring.\n",
+		NULL
+	}, {
+		CONFIG_SA_GRACE, 1, 1,
+		"--sa-grace",
+		"Inbound SA grace period",
+		"<0-3600>",
+		"Seconds an inbound SA replaced by a rekey is still accepted, for\n"
+		"the packets the peer sent before it switched over. 0 drops them.\n",
+		config_def_sa_grace
+	}, {
+		CONFIG_REKEY_AT, 1, 1,
+		"--rekey-at",
+		"IPSec rekey at",
+		"<0-99>",
+		"Percentage of the IPSec SA lifetime, in seconds or kbytes, after which\n"
+		"we negotiate the next SA ourselves. The old one is only deleted once\n"
+		"the new one is in use. 0 leaves rekeying to the peer.\n",
+		config_def_rekey_at
+	}, {
+		CONFIG_ESN, 0, 1,
+		"--esn",
+		"Enable ESN",
+		NULL,
+		"propose extended (64 bit) sequence numbers for the IPSec SA,\n"
+		"which the peer must support. Without them the SA is rekeyed\n"
+		"before its 32 bit sequence number runs out.\n",
+		NULL
+	}, {
+		CONFIG_ESP_PROVIDER, 1, 1,
+		"--esp-provider",
+		"ESP crypto provider",
+		"<auto/gcrypt/openssl>",
+		"Which library encrypts and authenticates the ESP packets:\n"
+		" * auto -- benchmark the ones compiled in with the negotiated\n"
+		"           algorithms at startup and use the fastest\n"
+		" * gcrypt -- libgcrypt\n"
+		" * openssl -- OpenSSL, if built with OPENSSL_ESP=yes\n"
+		"The choice is logged. Algorithms a library lacks fall back to libgcrypt.\n",
+		config_def_esp_provider
 	}, {
 		0, 0, 0, NULL, NULL, NULL, NULL, NULL
 	}
@@ -907,6 +1087,13 @@ void do_config(int argc, char **argv)
 		opt_debug = (config[CONFIG_DEBUG]) ? atoi(config[CONFIG_DEBUG]) : 0;
 		opt_nd = (config[CONFIG_ND]) ? 1 : 0;
 		opt_1des = (config[CONFIG_ENABLE_1DES]) ? 1 : 0;
+		opt_io_uring = (config[CONFIG_IO_URING]) ? 1 : 0;
+		opt_tun_offload = (config[CONFIG_NO_TUN_OFFLOAD]) ? 0 : 1;
+		opt_udp_offload = (config[CONFIG_NO_UDP_OFFLOAD]) ? 0 : 1;
+		opt_kernel_ipsec = (config[CONFIG_KERNEL_IPSEC]) ? 1 : 0;
+		opt_hugepages = (config[CONFIG_HUGEPAGES]) ? 1 : 0;
+		opt_duplex = (config[CONFIG_DUPLEX]) ? 1 : 0;
+		opt_esn = (config[CONFIG_ESN]) ? 1 : 0;
 
 		if (!strcmp(config[CONFIG_AUTH_MODE], "psk")) {
 			opt_auth_mode = AUTH_MODE_PSK;
@@ -920,6 +1107,36 @@ void do_config(int argc, char **argv)
 		}
 		opt_no_encryption = (config[CONFIG_ENABLE_NO_ENCRYPTION]) ? 1 : 0;
 		opt_udpencapport=atoi(config[CONFIG_UDP_ENCAP_PORT]);
+		opt_batch = atoi(config[CONFIG_BATCH]);
+		if (opt_batch < 1 || opt_batch > MAX_BATCH) {
+			printf("%s: batch size %s out of range\nvalid sizes: 1-%d\n", argv[0], config[CONFIG_BATCH], MAX_BATCH);
+			exit(1);
+		}
+		opt_tun_queues = atoi(config[CONFIG_TUN_QUEUES]);
+		if (opt_tun_queues < 1 || opt_tun_queues > MAX_TUN_QUEUES) {
+			printf("%s: number of tunnel queues %s out of range\nvalid numbers: 1-%d\n", argv[0], config[CONFIG_TUN_QUEUES], MAX_TUN_QUEUES);
+			exit(1);
+		}
+		opt_crypto_threads = atoi(config[CONFIG_CRYPTO_THREADS]);
+		if (opt_crypto_threads < 0 || opt_crypto_threads > MAX_CRYPTO_THREADS) {
+			printf("%s: number of crypto threads %s out of range\nvalid numbers: 0-%d\n", argv[0], config[CONFIG_CRYPTO_THREADS], MAX_CRYPTO_THREADS);
+			exit(1);
+		}
+		opt_replay_window = atoi(config[CONFIG_REPLAY_WINDOW]);
+		if (opt_replay_window < 0 || opt_replay_window > MAX_REPLAY_WINDOW) {
+			printf("%s: replay window %s out of range\nvalid sizes: 0-%d\n", argv[0], config[CONFIG_REPLAY_WINDOW], MAX_REPLAY_WINDOW);
+			exit(1);
+		}
+		opt_sa_grace = atoi(config[CONFIG_SA_GRACE]);
+		if (opt_sa_grace < 0 || opt_sa_grace > MAX_SA_GRACE) {
+			printf("%s: SA grace period %s out of range\nvalid periods: 0-%d\n", argv[0], config[CONFIG_SA_GRACE], MAX_SA_GRACE);
+			exit(1);
+		}
+		opt_rekey_at = atoi(config[CONFIG_REKEY_AT]);
+		if (opt_rekey_at < 0 || opt_rekey_at > MAX_REKEY_AT) {
+			printf("%s: rekey percentage %s out of range\nvalid percentages: 0-%d\n", argv[0], config[CONFIG_REKEY_AT], MAX_REKEY_AT);
+			exit(1);
+		}
 
 		if (!strcmp(config[CONFIG_NATT_MODE], "natt")) {
 			opt_natt_mode = NATT_NORMAL;
@@ -934,6 +1151,23 @@ void do_config(int argc, char **argv)
 			exit(1);
 		}
 
+		if (!strcmp(config[CONFIG_ESP_PROVIDER], "auto")) {
+			opt_esp_provider = ESP_PROVIDER_AUTO;
+		} else if (!strcmp(config[CONFIG_ESP_PROVIDER], "gcrypt")) {
+			opt_esp_provider = ESP_PROVIDER_GCRYPT;
+#ifdef OPENSSL_ESP
+		} else if (!strcmp(config[CONFIG_ESP_PROVIDER], "openssl")) {
+			opt_esp_provider = ESP_PROVIDER_OPENSSL;
+#endif
+		} else {
+			printf("%s: unknown ESP crypto provider %s\nknown providers: auto gcrypt"
+#ifdef OPENSSL_ESP
+				" openssl"
+#endif
+				"\n", argv[0], config[CONFIG_ESP_PROVIDER]);
+			exit(1);
+		}
+
 		if (!strcmp(config[CONFIG_IF_MODE], "tun")) {
 			opt_if_mode = IF_MODE_TUN;
 		} else if (!strcmp(config[CONFIG_IF_MODE], "tap")) {
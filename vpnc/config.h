@@ -60,6 +60,20 @@ enum config_enum {
 	CONFIG_CA_FILE,
 	CONFIG_CA_DIR,
 	CONFIG_PASSWORD_HELPER,
+	CONFIG_BATCH,
+	CONFIG_TUN_QUEUES,
+	CONFIG_REPLAY_WINDOW,
+	CONFIG_IO_URING,
+	CONFIG_NO_TUN_OFFLOAD,
+	CONFIG_NO_UDP_OFFLOAD,
+	CONFIG_KERNEL_IPSEC,
+	CONFIG_HUGEPAGES,
+	CONFIG_CRYPTO_THREADS,
+	CONFIG_DUPLEX,
+	CONFIG_SA_GRACE,
+	CONFIG_REKEY_AT,
+	CONFIG_ESN,
+	CONFIG_ESP_PROVIDER,
 	LAST_CONFIG
 };
 
@@ -81,6 +95,13 @@ enum natt_mode_enum {
 	NATT_CISCO_UDP
 };
 
+/* Less one, the providers index the list in esp.c */
+enum esp_provider_enum {
+	ESP_PROVIDER_AUTO,
+	ESP_PROVIDER_GCRYPT,
+	ESP_PROVIDER_OPENSSL
+};
+
 enum if_mode_enum {
 	IF_MODE_TUN,
 	IF_MODE_TAP
@@ -103,6 +124,27 @@ extern int opt_1des, opt_no_encryption, opt_auth_mode;
 extern enum natt_mode_enum opt_natt_mode;
 extern enum if_mode_enum opt_if_mode;
 extern uint16_t opt_udpencapport;
+extern int opt_batch;
+extern int opt_tun_queues;
+extern int opt_replay_window;
+extern int opt_io_uring;
+extern int opt_tun_offload;
+extern int opt_udp_offload;
+extern int opt_kernel_ipsec;
+extern int opt_hugepages;
+extern int opt_crypto_threads;
+extern int opt_duplex;
+extern int opt_sa_grace;
+extern int opt_rekey_at;
+extern int opt_esn;
+extern enum esp_provider_enum opt_esp_provider;
+
+#define MAX_BATCH 64
+#define MAX_TUN_QUEUES 16
+#define MAX_CRYPTO_THREADS 16
+#define MAX_REPLAY_WINDOW 4096
+#define MAX_SA_GRACE 3600
+#define MAX_REKEY_AT 99
 
 #define TIMESTAMP() ({				\
 	char st[20];				\
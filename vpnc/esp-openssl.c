@@ -0,0 +1,193 @@
+/* ESP encryption and authentication with OpenSSL
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "esp-openssl.h"
+
+#ifdef OPENSSL_ESP
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <gcrypt.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+
+/*
+ * OpenSSL's stitched aes-*-cbc-hmac-sha* ciphers would do both passes in
+ * one, but they are made for TLS: they MAC the plaintext. ESP MACs the
+ * ciphertext with the ESP header in front (RFC 4303, 3.3.2), so CBC and
+ * HMAC stay two passes here as well.
+ */
+struct esp_ossl {
+	EVP_CIPHER_CTX *enc, *dec; /* keyed once, the IV is set per packet */
+	EVP_MAC_CTX *mac; /* keyed once, re-initialized per packet */
+};
+
+static const EVP_CIPHER *esp_ossl_cipher(int algo, int mode)
+{
+	switch (mode) {
+	case GCRY_CIPHER_MODE_CBC:
+		switch (algo) {
+		case GCRY_CIPHER_AES128: return EVP_aes_128_cbc();
+		case GCRY_CIPHER_AES192: return EVP_aes_192_cbc();
+		case GCRY_CIPHER_AES256: return EVP_aes_256_cbc();
+		case GCRY_CIPHER_3DES: return EVP_des_ede3_cbc();
+		}
+		break;
+	case GCRY_CIPHER_MODE_GCM:
+		switch (algo) {
+		case GCRY_CIPHER_AES128: return EVP_aes_128_gcm();
+		case GCRY_CIPHER_AES192: return EVP_aes_192_gcm();
+		case GCRY_CIPHER_AES256: return EVP_aes_256_gcm();
+		}
+		break;
+	case GCRY_CIPHER_MODE_POLY1305:
+		if (algo == GCRY_CIPHER_CHACHA20)
+			return EVP_chacha20_poly1305();
+		break;
+	}
+	return NULL;
+}
+
+static const char *esp_ossl_digest(int algo)
+{
+	switch (algo) {
+	case GCRY_MD_MD5: return "MD5";
+	case GCRY_MD_SHA1: return "SHA1";
+	case GCRY_MD_SHA256: return "SHA256";
+	case GCRY_MD_SHA384: return "SHA384";
+	case GCRY_MD_SHA512: return "SHA512";
+	}
+	return NULL;
+}
+
+static EVP_CIPHER_CTX *esp_ossl_cipher_ctx(const EVP_CIPHER *cipher, const uint8_t *key, int enc)
+{
+	EVP_CIPHER_CTX *c;
+
+	c = EVP_CIPHER_CTX_new();
+	if (c == NULL)
+		return NULL;
+	if (!EVP_CipherInit_ex(c, cipher, NULL, key, NULL, enc)) {
+		EVP_CIPHER_CTX_free(c);
+		return NULL;
+	}
+	EVP_CIPHER_CTX_set_padding(c, 0);
+	return c;
+}
+
+struct esp_ossl *esp_ossl_new(int cry_algo, int cry_mode, const uint8_t *key, size_t key_len,
+	int md_algo, const uint8_t *md_key, size_t md_len)
+{
+	const EVP_CIPHER *cipher = NULL;
+	const char *digest = NULL;
+	struct esp_ossl *o;
+	EVP_MAC *mac;
+	OSSL_PARAM params[2];
+
+	if (cry_algo && (cipher = esp_ossl_cipher(cry_algo, cry_mode)) == NULL)
+		return NULL;
+	if (cipher && (size_t)EVP_CIPHER_get_key_length(cipher) != key_len)
+		return NULL;
+	if (md_algo && (digest = esp_ossl_digest(md_algo)) == NULL)
+		return NULL;
+
+	o = calloc(1, sizeof(struct esp_ossl));
+	if (o == NULL)
+		return NULL;
+	if (cipher) {
+		o->enc = esp_ossl_cipher_ctx(cipher, key, 1);
+		o->dec = esp_ossl_cipher_ctx(cipher, key, 0);
+		if (o->enc == NULL || o->dec == NULL)
+			goto fail;
+	}
+	if (digest) {
+		mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+		if (mac == NULL)
+			goto fail;
+		o->mac = EVP_MAC_CTX_new(mac);
+		EVP_MAC_free(mac);
+		params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)digest, 0);
+		params[1] = OSSL_PARAM_construct_end();
+		if (o->mac == NULL || !EVP_MAC_init(o->mac, md_key, md_len, params))
+			goto fail;
+	}
+	return o;
+
+fail:
+	esp_ossl_free(o);
+	return NULL;
+}
+
+void esp_ossl_free(struct esp_ossl *o)
+{
+	if (o == NULL)
+		return;
+	EVP_CIPHER_CTX_free(o->enc);
+	EVP_CIPHER_CTX_free(o->dec);
+	EVP_MAC_CTX_free(o->mac);
+	free(o);
+}
+
+void esp_ossl_cbc(struct esp_ossl *o, int enc, const uint8_t *iv, uint8_t *data, unsigned int len)
+{
+	EVP_CIPHER_CTX *c = enc ? o->enc : o->dec;
+	int outl, ret;
+
+	ret = EVP_CipherInit_ex2(c, NULL, NULL, iv, enc, NULL);
+	ret &= EVP_CipherUpdate(c, data, &outl, data, len);
+	assert(ret == 1 && (unsigned int)outl == len);
+}
+
+int esp_ossl_aead(struct esp_ossl *o, int enc, const uint8_t *nonce, unsigned int nonce_len,
+	const uint8_t *aad, unsigned int aad_len, uint8_t *data, unsigned int len,
+	uint8_t *tag, unsigned int tag_len)
+{
+	EVP_CIPHER_CTX *c = enc ? o->enc : o->dec;
+	uint8_t final[16];
+	int outl;
+
+	/* GCM and ChaCha20-Poly1305 default to the 12 bytes of ESP */
+	assert(nonce_len == 12);
+	if (!EVP_CipherInit_ex2(c, NULL, NULL, nonce, enc, NULL)
+		|| !EVP_CipherUpdate(c, NULL, &outl, aad, aad_len)
+		|| !EVP_CipherUpdate(c, data, &outl, data, len))
+		return -1;
+	if (enc)
+		return (EVP_CipherFinal_ex(c, final, &outl)
+			&& EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_GET_TAG, tag_len, tag)) ? 0 : -1;
+	if (!EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_AEAD_SET_TAG, tag_len, tag))
+		return -1;
+	return EVP_CipherFinal_ex(c, final, &outl) ? 0 : -1;
+}
+
+void esp_ossl_hmac(struct esp_ossl *o, const uint8_t *data, unsigned int len,
+	const uint32_t *esn_hi, uint8_t *digest)
+{
+	size_t outl;
+	int ret;
+
+	/* no key: start over with the one set by esp_ossl_new() */
+	ret = EVP_MAC_init(o->mac, NULL, 0, NULL);
+	ret &= EVP_MAC_update(o->mac, data, len);
+	if (esn_hi)
+		ret &= EVP_MAC_update(o->mac, (const uint8_t *)esn_hi, sizeof(*esn_hi));
+	ret &= EVP_MAC_final(o->mac, digest, &outl, ESP_OSSL_MAX_MD);
+	assert(ret == 1);
+}
+
+#endif
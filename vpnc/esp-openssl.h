@@ -0,0 +1,50 @@
+/* ESP encryption and authentication with OpenSSL
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __ESP_OPENSSL_H__
+#define __ESP_OPENSSL_H__
+
+#ifdef OPENSSL_ESP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ESP_OSSL_MAX_MD 64 /* EVP_MAX_MD_SIZE */
+
+/* The contexts of one thread for one SA, the counterpart of struct esp_ctx */
+struct esp_ossl;
+
+/*
+ * The algorithms are given by their libgcrypt ids, as negotiated.
+ * Returns NULL if OpenSSL can't do one of them.
+ */
+extern struct esp_ossl *esp_ossl_new(int cry_algo, int cry_mode, const uint8_t *key, size_t key_len,
+	int md_algo, const uint8_t *md_key, size_t md_len);
+extern void esp_ossl_free(struct esp_ossl *o);
+
+/* CBC in place, len a multiple of the block size */
+extern void esp_ossl_cbc(struct esp_ossl *o, int enc, const uint8_t *iv, uint8_t *data, unsigned int len);
+/* AEAD in place; the tag is written, or checked and -1 returned if it doesn't match */
+extern int esp_ossl_aead(struct esp_ossl *o, int enc, const uint8_t *nonce, unsigned int nonce_len,
+	const uint8_t *aad, unsigned int aad_len, uint8_t *data, unsigned int len,
+	uint8_t *tag, unsigned int tag_len);
+/* HMAC of data and the ESN high bits if not NULL, ESP_OSSL_MAX_MD bytes at most */
+extern void esp_ossl_hmac(struct esp_ossl *o, const uint8_t *data, unsigned int len,
+	const uint32_t *esn_hi, uint8_t *digest);
+
+#endif
+#endif
@@ -0,0 +1,733 @@
+/* ESP packet framing (RFC 4303)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gcrypt.h>
+#include "sysdep.h"
+#include "config.h"
+#include "supp.h"
+#include "esp.h"
+#include "aes-mb.h"
+#include "esp-openssl.h"
+
+/* Set up the ESP parameters of a proposal accepted by check_ipsec_algos() */
+void esp_set_algos(struct sa_block *s, int seen_enc, int seen_keylen, int seen_auth)
+{
+	const supported_algo_t *crypt, *hash = NULL;
+
+	crypt = get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc, NULL, seen_keylen);
+	if (seen_auth)
+		hash = get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0);
+
+	s->ipsec.cry_algo = crypt->my_id;
+	s->ipsec.cry_mode = crypt->mode;
+	s->ipsec.md_algo = hash ? hash->my_id : 0;
+	s->ipsec.salt_len = 0;
+
+	if (SUPP_ALGO_IS_AEAD(crypt)) {
+		/* RFC 4106, 7634: 4 byte salt from keymat, 8 byte explicit IV, 16 byte ICV */
+		gcry_cipher_algo_info(s->ipsec.cry_algo, GCRYCTL_GET_KEYLEN, NULL, &(s->ipsec.key_len));
+		s->ipsec.salt_len = 4;
+		s->ipsec.iv_len = 8;
+		s->ipsec.blk_len = 4;
+	} else if (s->ipsec.cry_algo) {
+		gcry_cipher_algo_info(s->ipsec.cry_algo, GCRYCTL_GET_KEYLEN, NULL, &(s->ipsec.key_len));
+		gcry_cipher_algo_info(s->ipsec.cry_algo, GCRYCTL_GET_BLKLEN, NULL, &(s->ipsec.blk_len));
+		s->ipsec.iv_len = s->ipsec.blk_len;
+	} else {
+		s->ipsec.key_len = 0;
+		s->ipsec.iv_len = 0;
+		s->ipsec.blk_len = 8; /* seems to be this without encryption... */
+	}
+
+	if (hash) {
+		s->ipsec.md_len = gcry_md_get_algo_dlen(s->ipsec.md_algo);
+		/* RFC 2403, 2404: 96 bit; RFC 4868: half of SHA-2's output, as is its key */
+		s->ipsec.icv_len = s->ipsec.md_len > 20 ? s->ipsec.md_len / 2 : 12;
+	} else {
+		s->ipsec.md_len = 0;
+		s->ipsec.icv_len = 16;
+	}
+
+	DEBUG(1, printf("IPSEC SA selected %s%s%s\n", crypt->name,
+			hash ? "-" : "", hash ? hash->name : ""));
+}
+
+/*
+ * Sequence numbers are shared by all tx workers. Together with the IP id
+ * they are the only per-packet state the workers have in common, so take
+ * them with an atomic increment instead of a lock.
+ */
+static uint64_t esp_next_seq(struct sa_block *s, struct esp_sa *sa)
+{
+	if (s->ipsec.shared)
+		return __sync_fetch_and_add(&sa->seq_id, 1);
+	return sa->seq_id++;
+}
+
+/*
+ * The implementations of the ESP transforms. A thread keys its contexts
+ * for an SA with the one esp_provider_choose() picked, or with libgcrypt
+ * if that one doesn't have the algorithms.
+ */
+struct esp_provider {
+	const char *name;
+	/* key ctx for the keymat of an SA, -1 if the algorithms aren't there */
+	int (*setkey)(struct sa_block *s, struct esp_ctx *ctx, const uint8_t *key);
+	void (*close)(struct esp_ctx *ctx);
+	/* encrypt (enc) or decrypt len bytes in place */
+	void (*cbc)(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *iv,
+		unsigned char *data, unsigned int len, int enc);
+	/* same, the ICV behind them is written or checked: -1 if it doesn't match */
+	int (*aead)(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *nonce,
+		const unsigned char *aad, unsigned int aad_len,
+		unsigned char *data, unsigned int len, int enc);
+	/* the HMAC of data and esn_hi, in buf or a buffer of ctx */
+	const unsigned char *(*hmac)(struct esp_ctx *ctx, const unsigned char *data,
+		unsigned int len, const uint32_t *esn_hi, unsigned char *buf);
+};
+
+#define ESP_MAX_MD 64 /* SHA-512 */
+
+static int esp_gcrypt_setkey(struct sa_block *s, struct esp_ctx *ctx, const uint8_t *key)
+{
+	int ret;
+
+	if (s->ipsec.cry_algo) {
+		gcry_cipher_open(&ctx->cry_ctx, s->ipsec.cry_algo, s->ipsec.cry_mode, 0);
+		gcry_cipher_setkey(ctx->cry_ctx, key, s->ipsec.key_len);
+	}
+	if (s->ipsec.md_algo) {
+		gcry_md_open(&ctx->md_ctx, s->ipsec.md_algo, GCRY_MD_FLAG_HMAC);
+		assert(ctx->md_ctx != NULL);
+		ret = gcry_md_setkey(ctx->md_ctx, key + s->ipsec.key_len + s->ipsec.salt_len,
+			s->ipsec.md_len);
+		assert(ret == 0);
+	}
+	return 0;
+}
+
+static void esp_gcrypt_close(struct esp_ctx *ctx)
+{
+	if (ctx->cry_ctx) {
+		gcry_cipher_close(ctx->cry_ctx);
+		ctx->cry_ctx = NULL;
+	}
+	if (ctx->md_ctx) {
+		gcry_md_close(ctx->md_ctx);
+		ctx->md_ctx = NULL;
+	}
+}
+
+static void esp_gcrypt_cbc(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *iv,
+	unsigned char *data, unsigned int len, int enc)
+{
+	gcry_cipher_setiv(ctx->cry_ctx, iv, s->ipsec.iv_len);
+	if (enc)
+		gcry_cipher_encrypt(ctx->cry_ctx, data, len, NULL, 0);
+	else
+		gcry_cipher_decrypt(ctx->cry_ctx, data, len, NULL, 0);
+}
+
+static int esp_gcrypt_aead(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *nonce,
+	const unsigned char *aad, unsigned int aad_len,
+	unsigned char *data, unsigned int len, int enc)
+{
+	gcry_cipher_setiv(ctx->cry_ctx, nonce, s->ipsec.salt_len + s->ipsec.iv_len);
+	gcry_cipher_authenticate(ctx->cry_ctx, aad, aad_len);
+	if (enc) {
+		gcry_cipher_encrypt(ctx->cry_ctx, data, len, NULL, 0);
+		gcry_cipher_gettag(ctx->cry_ctx, data + len, s->ipsec.icv_len);
+		return 0;
+	}
+	gcry_cipher_decrypt(ctx->cry_ctx, data, len, NULL, 0);
+	return gcry_cipher_checktag(ctx->cry_ctx, data + len, s->ipsec.icv_len) ? -1 : 0;
+}
+
+/*
+ * md_ctx has been keyed by esp_gcrypt_setkey(), gcry_md_reset() brings it
+ * back to the state after the key (inner pad) has been hashed.
+ */
+static const unsigned char *esp_gcrypt_hmac(struct esp_ctx *ctx, const unsigned char *data,
+	unsigned int len, const uint32_t *esn_hi, unsigned char *buf)
+{
+	(void)buf;
+	/* See RFC 2104 */
+	gcry_md_reset(ctx->md_ctx);
+	gcry_md_write(ctx->md_ctx, data, len);
+	if (esn_hi) /* RFC 4303, 2.2.1: the high bits are authenticated, not sent */
+		gcry_md_write(ctx->md_ctx, esn_hi, sizeof(*esn_hi));
+	return gcry_md_read(ctx->md_ctx, 0);
+}
+
+static const struct esp_provider esp_gcrypt = {
+	"gcrypt", esp_gcrypt_setkey, esp_gcrypt_close,
+	esp_gcrypt_cbc, esp_gcrypt_aead, esp_gcrypt_hmac
+};
+
+#ifdef OPENSSL_ESP
+static int esp_openssl_setkey(struct sa_block *s, struct esp_ctx *ctx, const uint8_t *key)
+{
+	ctx->ossl = esp_ossl_new(s->ipsec.cry_algo, s->ipsec.cry_mode, key, s->ipsec.key_len,
+		s->ipsec.md_algo, key + s->ipsec.key_len + s->ipsec.salt_len, s->ipsec.md_len);
+	return ctx->ossl ? 0 : -1;
+}
+
+static void esp_openssl_close(struct esp_ctx *ctx)
+{
+	esp_ossl_free(ctx->ossl);
+	ctx->ossl = NULL;
+}
+
+static void esp_openssl_cbc(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *iv,
+	unsigned char *data, unsigned int len, int enc)
+{
+	(void)s;
+	esp_ossl_cbc(ctx->ossl, enc, iv, data, len);
+}
+
+static int esp_openssl_aead(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *nonce,
+	const unsigned char *aad, unsigned int aad_len,
+	unsigned char *data, unsigned int len, int enc)
+{
+	return esp_ossl_aead(ctx->ossl, enc, nonce, s->ipsec.salt_len + s->ipsec.iv_len,
+		aad, aad_len, data, len, data + len, s->ipsec.icv_len);
+}
+
+static const unsigned char *esp_openssl_hmac(struct esp_ctx *ctx, const unsigned char *data,
+	unsigned int len, const uint32_t *esn_hi, unsigned char *buf)
+{
+	esp_ossl_hmac(ctx->ossl, data, len, esn_hi, buf);
+	return buf;
+}
+
+static const struct esp_provider esp_openssl = {
+	"openssl", esp_openssl_setkey, esp_openssl_close,
+	esp_openssl_cbc, esp_openssl_aead, esp_openssl_hmac
+};
+#endif
+
+/* Compiled in, indexed by enum esp_provider_enum - 1 */
+static const struct esp_provider *esp_providers[] = {
+	&esp_gcrypt,
+#ifdef OPENSSL_ESP
+	&esp_openssl,
+#endif
+};
+#define ESP_PROVIDERS (sizeof(esp_providers) / sizeof(esp_providers[0]))
+
+/* For new contexts, set before the first SA is published */
+static const struct esp_provider *esp_provider = &esp_gcrypt;
+
+/*
+ * Compute HMAC for an arbitrary stream of bytes.
+ */
+/*
+ * Compute HMAC for an arbitrary stream of bytes.
+ */
+static int hmac_compute(struct esp_ctx *ctx,
+	const unsigned char *data, unsigned int data_size, const uint32_t *esn_hi,
+	unsigned char *digest, unsigned int hmac_len, unsigned char do_store)
+{
+	int ret;
+	const unsigned char *hmac_digest;
+	unsigned char buf[ESP_MAX_MD];
+
+	hmac_digest = ctx->prov->hmac(ctx, data, data_size, esn_hi, buf);
+
+	if (do_store) {
+		memcpy(digest, hmac_digest, hmac_len);
+		ret = 0;
+	} else
+		ret = memcmp(digest, hmac_digest, hmac_len);
+
+	return ret;
+}
+
+#ifdef HAVE_AES_MB
+/* AES-CBC, which aes-mb.c can do on this CPU */
+static int esp_aes_mb(struct sa_block *s)
+{
+	static int available = -1;
+
+	if (s->ipsec.cry_mode != GCRY_CIPHER_MODE_CBC
+		|| (s->ipsec.cry_algo != GCRY_CIPHER_AES128
+			&& s->ipsec.cry_algo != GCRY_CIPHER_AES192
+			&& s->ipsec.cry_algo != GCRY_CIPHER_AES256))
+		return 0;
+	if (available == -1)
+		available = aes_mb_available();
+	return available;
+}
+#endif
+
+/*
+ * (Re)key the cipher and HMAC contexts of a thread for an SA, or just
+ * close them if sa is NULL
+ */
+void esp_ctx_setkey(struct sa_block *s, struct esp_ctx *ctx, struct esp_sa *sa)
+{
+	if (ctx->prov) {
+		ctx->prov->close(ctx);
+		ctx->prov = NULL;
+	}
+	if (ctx->iv_ctx) {
+		gcry_cipher_close(ctx->iv_ctx);
+		ctx->iv_ctx = NULL;
+	}
+#ifdef HAVE_AES_MB
+	free(ctx->mb);
+	ctx->mb = NULL;
+#endif
+	ctx->sa = sa;
+	ctx->id = sa ? sa->id : 0;
+	if (sa == NULL)
+		return;
+
+	assert(s->ipsec.salt_len <= sizeof(ctx->salt));
+	memcpy(ctx->salt, sa->key + s->ipsec.key_len, s->ipsec.salt_len);
+
+	ctx->prov = esp_provider;
+	if (ctx->prov->setkey(s, ctx, sa->key) == -1) {
+		DEBUG(2, printf("no %s for these ESP algorithms, using libgcrypt\n", ctx->prov->name));
+		ctx->prov = &esp_gcrypt;
+		ctx->prov->setkey(s, ctx, sa->key);
+	}
+	if (sa->iv_key) {
+		gcry_cipher_open(&ctx->iv_ctx, s->ipsec.cry_algo, GCRY_CIPHER_MODE_ECB, 0);
+		gcry_cipher_setkey(ctx->iv_ctx, sa->iv_key, s->ipsec.key_len);
+	}
+#ifdef HAVE_AES_MB
+	if (sa->iv_key && esp_aes_mb(s)) {
+		ctx->mb = malloc(sizeof(struct aes_mb_key));
+		if (ctx->mb == NULL)
+			error(1, errno, "malloc");
+		aes_mb_setkey(ctx->mb, sa->key, s->ipsec.key_len);
+	}
+#endif
+}
+
+/*
+ * Nanoseconds one provider takes to seal a packet with the negotiated
+ * algorithms, on a mix of small and full sized ones. 0 if it doesn't have
+ * them.
+ */
+static unsigned long esp_provider_bench(struct sa_block *s, const struct esp_provider *prov)
+{
+	static const unsigned int sizes[2] = { 64, 1408 }; /* multiples of any block size */
+	size_t key_len = s->ipsec.key_len + s->ipsec.salt_len + s->ipsec.md_len;
+	unsigned char iv[16], aad[12], nonce[16], md[ESP_MAX_MD];
+	unsigned char key[32 + 4 + ESP_MAX_MD], buf[1408 + ESP_MAX_MD];
+	struct esp_ctx ctx;
+	struct timespec start, now;
+	unsigned long n = 0, ns;
+
+	memset(&ctx, 0, sizeof(ctx));
+	assert(key_len <= sizeof(key));
+	memset(buf, 0, sizeof(buf));
+	gcry_randomize(key, key_len, GCRY_WEAK_RANDOM);
+	memset(iv, 0, sizeof(iv));
+	memset(aad, 0, sizeof(aad));
+	memset(nonce, 0, sizeof(nonce));
+	if (prov->setkey(s, &ctx, key) == -1)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		unsigned int len = sizes[n & 1];
+
+		if (ESP_AEAD(s))
+			prov->aead(s, &ctx, nonce, aad, sizeof(esp_encap_header_t), buf, len, 1);
+		else if (s->ipsec.cry_algo)
+			prov->cbc(s, &ctx, iv, buf, len, 1);
+		if (!ESP_AEAD(s) && s->ipsec.md_algo)
+			prov->hmac(&ctx, buf, len, NULL, md);
+		n++;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ns = (now.tv_sec - start.tv_sec) * 1000000000UL + now.tv_nsec - start.tv_nsec;
+	} while (ns < 5000000 || n < 16);
+
+	prov->close(&ctx);
+	return ns / n ? ns / n : 1;
+}
+
+/*
+ * Pick the provider for the ESP contexts, the configured one or, with
+ * "auto", the fastest one for the negotiated algorithms on this CPU. The
+ * choice holds for the whole run: worker threads key their contexts
+ * with it as they see new SAs, and rekeys don't change the algorithms.
+ */
+void esp_provider_choose(struct sa_block *s)
+{
+	unsigned long ns[ESP_PROVIDERS];
+	char result[128];
+	size_t i, best = 0, len = 0;
+
+	if (opt_esp_provider != ESP_PROVIDER_AUTO) {
+		assert((size_t)opt_esp_provider - 1 < ESP_PROVIDERS);
+		esp_provider = esp_providers[opt_esp_provider - 1];
+		logmsg(LOG_INFO, "ESP crypto: %s", esp_provider->name);
+		return;
+	}
+	if (ESP_PROVIDERS == 1) {
+		esp_provider = esp_providers[0];
+		return;
+	}
+
+	result[0] = '\0';
+	for (i = 0; i < ESP_PROVIDERS; i++) {
+		ns[i] = esp_provider_bench(s, esp_providers[i]);
+		if (ns[i] == 0) {
+			len += snprintf(result + len, sizeof(result) - len, "%s%s n/a",
+				i ? ", " : "", esp_providers[i]->name);
+			continue;
+		}
+		len += snprintf(result + len, sizeof(result) - len, "%s%s %lu ns/packet",
+			i ? ", " : "", esp_providers[i]->name, ns[i]);
+		if (ns[i] < ns[best])
+			best = i;
+	}
+	esp_provider = esp_providers[best];
+	logmsg(LOG_INFO, "ESP crypto: %s (%s)", esp_provider->name, result);
+}
+
+/*
+ * The AEAD nonce is the salt from the keymat followed by the explicit IV
+ * (RFC 4106 section 4, RFC 7634 section 2); the ESP header is the
+ * associated data. Encrypts (enc) or decrypts len bytes in place, the
+ * ICV behind them is written or checked: returns -1 if it doesn't match.
+ */
+static int esp_aead(struct sa_block *s, struct esp_ctx *ctx, const unsigned char *eh,
+	const unsigned char *iv, uint64_t seq, unsigned char *data, unsigned int len, int enc)
+{
+	unsigned char nonce[16], aad[12];
+	unsigned int aad_len = sizeof(esp_encap_header_t);
+	uint32_t hi;
+
+	memcpy(nonce, ctx->salt, s->ipsec.salt_len);
+	memcpy(nonce + s->ipsec.salt_len, iv, s->ipsec.iv_len);
+	if (!s->ipsec.esn)
+		memcpy(aad, eh, aad_len);
+	else {
+		/* RFC 4106, 5: SPI, then the whole 64 bit sequence number */
+		hi = htonl(seq >> 32);
+		memcpy(aad, eh, 4);
+		memcpy(aad + 4, &hi, 4);
+		memcpy(aad + 8, eh + 4, 4);
+		aad_len = 12;
+	}
+
+	return ctx->prov->aead(s, ctx, nonce, aad, aad_len, data, len, enc);
+}
+
+/* The high bits of the sequence number for the ICV, NULL without ESN */
+static const uint32_t *esp_esn_hi(struct sa_block *s, const struct pkt *p, uint32_t *hi)
+{
+	if (!s->ipsec.esn)
+		return NULL;
+	*hi = htonl(p->seq >> 32);
+	return hi;
+}
+
+/*
+ * Frame a packet in ESP: padding, trailer and ESP header. The IV and
+ * the ICV are left to encap_esp_seal(). Fails once the sequence number
+ * would cycle, which it must not (RFC 4303, 3.3.3).
+ */
+int encap_esp_frame(struct sa_block *s, struct pkt *p)
+{
+	esp_encap_header_t *eh;
+	size_t i, padding, pad_blksz;
+
+	p->sa = s->ipsec.tx_ctx.sa;
+	p->seq = esp_next_seq(s, p->sa);
+	if (!s->ipsec.esn && p->seq > UINT32_MAX) {
+		if (p->seq == (uint64_t)UINT32_MAX + 1)
+			logmsg(LOG_ERR, "sequence numbers of the IPSec SA used up, dropping until rekeyed");
+		return -1;
+	}
+
+	/*
+	 * Add padding as necessary
+	 *
+	 * done: this should be checked, RFC 2406 section 2.4 is quite
+	 *      obscure on that point.
+	 * seems fine
+	 */
+	pad_blksz = s->ipsec.blk_len;
+	while (pad_blksz & 3) /* must be multiple of 4 */
+		pad_blksz <<= 1;
+	padding = pad_blksz - ((p->len + 2 - p->var_header_size - p->payload) % pad_blksz);
+	DEBUG(3, printf("sending packet: len = %u, padding = %lu\n", p->len, (unsigned long)padding));
+	if (padding == pad_blksz)
+		padding = 0;
+
+	for (i = 1; i <= padding; i++) {
+		p->data[p->len] = i;
+		p->len++;
+	}
+
+	/* Add trailing padlen and next_header */
+	p->data[p->len++] = padding;
+	p->data[p->len++] = IPPROTO_IPIP;
+
+	eh = (esp_encap_header_t *) (p->data + p->payload);
+	eh->spi = p->sa->spi;
+	eh->seq_id = htonl((uint32_t)p->seq);
+	return 0;
+}
+
+/* Length of the ICV encap_esp_seal() appends */
+unsigned int esp_icv_len(struct sa_block *s)
+{
+	return (ESP_AEAD(s) || s->ipsec.md_algo) ? s->ipsec.icv_len : 0;
+}
+
+/*
+ * Fill in the IV of a framed packet, returns where it is. CBC IVs are
+ * the sequence number encrypted under the iv_key of the SA.
+ */
+unsigned char *esp_seal_iv(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p)
+{
+	unsigned char *iv, blk[16];
+	uint32_t hi, lo;
+
+	iv = p->data + p->payload + sizeof(esp_encap_header_t);
+	hi = htonl(p->seq >> 32);
+	lo = htonl((uint32_t)p->seq);
+	if (ESP_AEAD(s)) {
+		/* must never repeat under one key, the sequence number doesn't */
+		memcpy(iv, &hi, 4);
+		memcpy(iv + 4, &lo, 4);
+	} else if (ctx->iv_ctx) {
+		memset(blk, 0, s->ipsec.iv_len - 8);
+		memcpy(blk + s->ipsec.iv_len - 8, &hi, 4);
+		memcpy(blk + s->ipsec.iv_len - 4, &lo, 4);
+		gcry_cipher_encrypt(ctx->iv_ctx, iv, s->ipsec.iv_len, blk, s->ipsec.iv_len);
+	} else
+		gcry_create_nonce(iv, s->ipsec.iv_len);
+	hex_dump("iv", iv, s->ipsec.iv_len, NULL);
+	return iv;
+}
+
+/* Append the HMAC of a packet encrypted without AEAD */
+static void esp_seal_icv(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p)
+{
+	unsigned int len = p->len - p->payload;
+	uint32_t hi;
+
+	if (!s->ipsec.md_algo)
+		return;
+	hmac_compute(ctx, p->data + p->payload, len, esp_esn_hi(s, p, &hi),
+		p->data + p->payload + len, s->ipsec.icv_len, 1);
+	p->len += s->ipsec.icv_len;
+	hex_dump("sending ESP packet (after ah)", p->data, p->len, NULL);
+}
+
+/*
+ * Encrypt and authenticate a packet framed by encap_esp_frame() with the
+ * contexts of its SA. Nothing else is used, so this can run on a crypto
+ * worker.
+ */
+void encap_esp_seal(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p)
+{
+	esp_encap_header_t *eh;
+	unsigned char *iv, *cleartext;
+	unsigned int cleartextlen;
+
+	cleartext = p->data + p->var_header_size + p->payload;
+	cleartextlen = p->len - p->var_header_size - p->payload;
+	eh = (esp_encap_header_t *) (p->data + p->payload);
+
+	iv = esp_seal_iv(s, ctx, p);
+
+	hex_dump("sending ESP packet (before crypt)", p->data, p->len, NULL);
+
+	if (ESP_AEAD(s)) {
+		esp_aead(s, ctx, (unsigned char *)eh, iv, p->seq, cleartext, cleartextlen, 1);
+		p->len += s->ipsec.icv_len;
+	} else if (s->ipsec.cry_algo)
+		ctx->prov->cbc(s, ctx, iv, cleartext, cleartextlen, 1);
+
+	hex_dump("sending ESP packet (after crypt)", p->data, p->len, NULL);
+
+	/* Handle optional authentication field */
+	esp_seal_icv(s, ctx, p);
+}
+
+/*
+ * Seal n packets of the SA ctx is keyed for. With AES-NI the CBC
+ * encryption runs over all of them side by side (aes-mb.c).
+ */
+void encap_esp_seal_batch(struct sa_block *s, struct esp_ctx *ctx, struct pkt **pkts,
+	unsigned int n)
+{
+	unsigned int i;
+#ifdef HAVE_AES_MB
+	struct aes_mb_job job[MAX_BATCH];
+	struct pkt *p;
+
+	if (ctx->mb && n > 1) {
+		assert(n <= MAX_BATCH);
+		for (i = 0; i < n; i++) {
+			p = pkts[i];
+			job[i].iv = esp_seal_iv(s, ctx, p);
+			job[i].data = p->data + p->var_header_size + p->payload;
+			job[i].len = p->len - p->var_header_size - p->payload;
+		}
+		aes_mb_cbc_encrypt(ctx->mb, job, n);
+		for (i = 0; i < n; i++)
+			esp_seal_icv(s, ctx, pkts[i]);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		encap_esp_seal(s, ctx, pkts[i]);
+}
+
+/*
+ * The cheap checks of a packet from the peer, before encap_esp_open()
+ */
+int encap_esp_recv_peer(struct sa_block *s, struct pkt *p)
+{
+	struct replay_window *replay;
+	int len;
+
+	p->var_header_size = s->ipsec.iv_len;
+	len = (int)p->len - p->payload - sizeof(esp_encap_header_t) - p->var_header_size;
+
+	if (len < (int)s->ipsec.icv_len) {
+		logmsg(LOG_ALERT, "Packet too short");
+		return -1;
+	}
+
+	/* The window is only advanced once the packet is authentic */
+	replay = &esp_rx_ctx(s, p)->replay;
+	p->seq = ntohl(((esp_encap_header_t *) (p->data + p->payload))->seq_id);
+	if (s->ipsec.esn)
+		p->seq = replay_esn(replay, p->seq);
+	if (replay_check(replay, p->seq) != 0) {
+		logmsg(LOG_DEBUG, "replayed or too old packet, seq %llu", (unsigned long long)p->seq);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Authenticate and decrypt a packet that passed encap_esp_recv_peer()
+ * with the contexts of its SA, in place, and strip the ICV and the
+ * trailer. Nothing else is used, so this can run on a crypto worker.
+ */
+int encap_esp_open(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p)
+{
+	int len, i;
+	size_t blksz;
+	unsigned char padlen, next_header;
+	unsigned char *pad;
+	unsigned char *iv;
+	uint32_t hi;
+
+	iv = p->data + p->payload + sizeof(esp_encap_header_t);
+	len = (int)p->len - p->payload - sizeof(esp_encap_header_t) - p->var_header_size;
+
+	/* Handle optional authentication field */
+	len -= s->ipsec.icv_len;
+	p->len -= s->ipsec.icv_len;
+	if (s->ipsec.md_algo) {
+		if (hmac_compute(ctx,
+				p->data + p->payload,
+				sizeof(esp_encap_header_t) + p->var_header_size + len,
+				esp_esn_hi(s, p, &hi),
+				p->data + p->payload
+				+ sizeof(esp_encap_header_t) + p->var_header_size + len,
+				s->ipsec.icv_len, 0) != 0) {
+			logmsg(LOG_ALERT, "HMAC mismatch in ESP mode");
+			return -1;
+		}
+	}
+
+	blksz = s->ipsec.blk_len;
+	if (s->ipsec.cry_algo && ((len % blksz) != 0)) {
+		logmsg(LOG_ALERT,
+			"payload len %d not a multiple of algorithm block size %lu", len,
+			(unsigned long)blksz);
+		return -1;
+	}
+
+	hex_dump("receiving ESP packet (before decrypt)",
+		&p->data[p->payload + sizeof(esp_encap_header_t) +
+			 p->var_header_size], len, NULL);
+
+	if (s->ipsec.cry_algo) {
+		unsigned char *data;
+
+		data = (p->data + p->payload
+			+ sizeof(esp_encap_header_t) + p->var_header_size);
+		if (ESP_AEAD(s)) {
+			if (esp_aead(s, ctx, p->data + p->payload, iv, p->seq, data, len, 0) != 0) {
+				logmsg(LOG_ALERT, "ICV mismatch in ESP mode");
+				return -1;
+			}
+		} else
+			ctx->prov->cbc(s, ctx, iv, data, len, 0);
+	}
+
+	hex_dump("receiving ESP packet (after decrypt)",
+		&p->data[p->payload + sizeof(esp_encap_header_t) +
+			p->var_header_size], len, NULL);
+
+	padlen = p->data[p->payload
+		+ sizeof(esp_encap_header_t) + p->var_header_size + len - 2];
+	next_header = p->data[p->payload
+		+ sizeof(esp_encap_header_t) + p->var_header_size + len - 1];
+
+	if (padlen + 2 > len) {
+		logmsg(LOG_ALERT, "Inconsistent padlen");
+		return -1;
+	}
+	if (next_header != IPPROTO_IPIP) {
+		logmsg(LOG_ALERT, "Inconsistent next_header %d", next_header);
+		return -1;
+	}
+	DEBUG(3, printf("pad len: %d, next_header: %d\n", padlen, next_header));
+
+	len -= padlen + 2;
+	p->len -= padlen + 2;
+
+	/* Check padding */
+	pad = p->data + p->payload
+		+ sizeof(esp_encap_header_t) + p->var_header_size + len;
+	for (i = 1; i <= padlen; i++) {
+		if (*pad != i) {
+			logmsg(LOG_ALERT, "Bad padding");
+			return -1;
+		}
+		pad++;
+	}
+
+	return 0;
+}
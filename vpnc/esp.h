@@ -0,0 +1,77 @@
+/* ESP packet framing (RFC 4303)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __ESP_H__
+#define __ESP_H__
+
+#include <stdint.h>
+#include <gcrypt.h>
+
+#include "tunip.h"
+#include "pktbuf.h"
+
+#define ESP_AEAD(s)	((s)->ipsec.cry_mode == GCRY_CIPHER_MODE_GCM || \
+			 (s)->ipsec.cry_mode == GCRY_CIPHER_MODE_POLY1305)
+
+/* A real ESP header (RFC 2406) */
+typedef struct esp_encap_header {
+	uint32_t spi; /* security parameters index */
+	uint32_t seq_id; /* sequence number, its low 32 bits with ESN */
+	/* variable-length payload data + padding */
+	/* unsigned char next_header */
+	/* optional auth data */
+} __attribute__((packed)) esp_encap_header_t;
+
+static __inline__ unsigned int esp_spi_hash(uint32_t spi)
+{
+	spi ^= spi >> 16;
+	spi ^= spi >> 8;
+	return spi & (ESP_RX_HASH - 1);
+}
+
+/* This thread's contexts for the inbound SA with this spi, NULL if none */
+static __inline__ struct esp_ctx *esp_rx_lookup(struct sa_block *s, uint32_t spi)
+{
+	const struct esp_sa_set *set = s->ipsec.set;
+	unsigned int h, i;
+
+	/* the table is never full */
+	for (h = esp_spi_hash(spi); (i = set->rx_hash[h]) != 0; h = (h + 1) & (ESP_RX_HASH - 1))
+		if (set->rx[i - 1]->spi == spi)
+			return &s->ipsec.rx_ctx[i - 1];
+	return NULL;
+}
+
+/* This thread's contexts for the inbound SA a packet arrived on */
+static __inline__ struct esp_ctx *esp_rx_ctx(struct sa_block *s, struct pkt *p)
+{
+	return esp_rx_lookup(s, p->sa->spi);
+}
+
+extern void esp_set_algos(struct sa_block *s, int enc, int keylen, int auth);
+extern void esp_provider_choose(struct sa_block *s);
+extern void esp_ctx_setkey(struct sa_block *s, struct esp_ctx *ctx, struct esp_sa *sa);
+extern int encap_esp_frame(struct sa_block *s, struct pkt *p);
+extern unsigned int esp_icv_len(struct sa_block *s);
+extern unsigned char *esp_seal_iv(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p);
+extern void encap_esp_seal(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p);
+extern void encap_esp_seal_batch(struct sa_block *s, struct esp_ctx *ctx, struct pkt **pkts,
+	unsigned int n);
+extern int encap_esp_recv_peer(struct sa_block *s, struct pkt *p);
+extern int encap_esp_open(struct sa_block *s, struct esp_ctx *ctx, struct pkt *p);
+
+#endif
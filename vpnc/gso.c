@@ -0,0 +1,266 @@
+/* Segmentation of TCP super-packets from a tun device with vnet headers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "gso.h"
+#include "cksum.h"
+
+#ifdef HAVE_TUN_OFFLOAD
+
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+/* Sum of the TCP pseudo header (RFC 793) */
+static uint64_t csum_pseudo(const uint8_t *ip, unsigned int tcp_len)
+{
+	uint8_t pseudo[4];
+
+	pseudo[0] = 0;
+	pseudo[1] = IPPROTO_TCP;
+	pseudo[2] = tcp_len >> 8;
+	pseudo[3] = tcp_len & 0xff;
+	return csum_add(csum_add(0, ip + 12, 8), pseudo, 4);
+}
+
+/*
+ * Fill in the checksum the kernel left to us (VIRTIO_NET_HDR_F_NEEDS_CSUM).
+ * The checksum field already holds the pseudo header sum.
+ */
+int gso_csum(uint8_t *pkt, unsigned int len, const struct virtio_net_hdr *vh)
+{
+	uint16_t csum;
+
+	if (!(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return 0;
+	if (vh->csum_start + vh->csum_offset + 2u > len)
+		return -1;
+
+	csum = csum_fold(csum_add(0, pkt + vh->csum_start, len - vh->csum_start));
+	if (csum == 0 && pkt[9] == IPPROTO_UDP)
+		csum = 0xffff;
+	memcpy(pkt + vh->csum_start + vh->csum_offset, &csum, 2);
+	return 0;
+}
+
+/*
+ * Prepare to segment pkt, each segment no longer than max.
+ * Returns -1 if the packet can't be handled.
+ */
+int gso_start(struct gso_iter *it, uint8_t *pkt, unsigned int len,
+	const struct virtio_net_hdr *vh, unsigned int max)
+{
+	unsigned int ihl;
+	uint16_t id;
+	uint32_t seq;
+
+	memset(it, 0, sizeof(*it));
+	it->pkt = pkt;
+	it->len = len;
+
+	if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_NONE) {
+		if (len > max || gso_csum(pkt, len, vh) == -1)
+			return -1;
+		it->mss = len;
+		return 0;
+	}
+	if ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_TCPV4)
+		return -1;
+
+	if (len < 40 || (pkt[0] >> 4) != 4 || pkt[9] != IPPROTO_TCP)
+		return -1;
+	ihl = (pkt[0] & 0x0f) << 2;
+	if (ihl < 20 || ihl + 20 > len)
+		return -1;
+	it->hlen = ihl + ((pkt[ihl + 12] >> 4) << 2);
+	it->mss = vh->gso_size;
+	if (it->hlen < ihl + 20 || it->hlen > len || it->mss == 0 || it->hlen + it->mss > max)
+		return -1;
+
+	memcpy(&id, pkt + 4, 2);
+	it->ip_id = ntohs(id);
+	memcpy(&seq, pkt + ihl + 4, 4);
+	it->seq = ntohl(seq);
+	return 0;
+}
+
+/*
+ * Write the next segment to out, with IP id, lengths, TCP sequence
+ * number, flags and both checksums fixed up. Returns its length,
+ * 0 once all segments have been handed out.
+ */
+unsigned int gso_next(struct gso_iter *it, uint8_t *out)
+{
+	unsigned int ihl, thl, plen, seg, first;
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t sum;
+
+	if (it->hlen == 0) {
+		/* no super-packet, hand it out once */
+		if (it->off)
+			return 0;
+		memcpy(out, it->pkt, it->len);
+		it->off = it->len;
+		return it->len;
+	}
+
+	if (it->hlen + it->off >= it->len)
+		return 0;
+	first = (it->off == 0);
+	plen = it->len - it->hlen - it->off;
+	if (plen > it->mss)
+		plen = it->mss;
+	seg = it->hlen + plen;
+
+	memcpy(out, it->pkt, it->hlen);
+	memcpy(out + it->hlen, it->pkt + it->hlen + it->off, plen);
+
+	ihl = (out[0] & 0x0f) << 2;
+	thl = it->hlen - ihl;
+
+	/* IP header */
+	v16 = htons(seg);
+	memcpy(out + 2, &v16, 2);
+	v16 = htons(it->ip_id++);
+	memcpy(out + 4, &v16, 2);
+	memset(out + 10, 0, 2);
+	v16 = csum_fold(csum_add(0, out, ihl));
+	memcpy(out + 10, &v16, 2);
+
+	/* TCP header, FIN and PSH only on the last segment, CWR on the first */
+	v32 = htonl(it->seq + it->off);
+	memcpy(out + ihl + 4, &v32, 4);
+	if (it->hlen + it->off + plen < it->len)
+		out[ihl + 13] &= ~(TCP_FIN | TCP_PSH);
+	if (!first)
+		out[ihl + 13] &= ~TCP_CWR;
+	memset(out + ihl + 16, 0, 2);
+
+	sum = csum_add(csum_pseudo(out, thl + plen), out + ihl, thl + plen);
+	v16 = csum_fold(sum);
+	memcpy(out + ihl + 16, &v16, 2);
+
+	it->off += plen;
+	return seg;
+}
+
+/*
+ * Add a segment. Only plain IPv4 TCP data segments with nothing but
+ * ACK and PSH set and valid checksums are coalesced, and only with
+ * the next in-order segment of the same flow whose headers match but
+ * for lengths, ids, sequence numbers and checksums, as the kernel
+ * does it. A segment shorter than the first one or with PSH set ends
+ * the super-packet.
+ */
+int gro_add(struct gro *g, const uint8_t *pkt, unsigned int len)
+{
+	unsigned int hlen, plen;
+	uint16_t v16;
+	uint32_t seq;
+	uint8_t flags;
+
+	if (len < 40 || pkt[0] != 0x45 || pkt[9] != IPPROTO_TCP)
+		return GRO_NO;
+	memcpy(&v16, pkt + 2, 2);
+	if (ntohs(v16) != len || (pkt[6] & 0x3f) || pkt[7])
+		return GRO_NO; /* padded or fragment */
+	hlen = 20 + ((pkt[32] >> 4) << 2);
+	if (hlen < 40 || hlen >= len)
+		return GRO_NO;
+	flags = pkt[33];
+	if ((flags & ~TCP_PSH) != TCP_ACK)
+		return GRO_NO;
+	plen = len - hlen;
+	memcpy(&seq, pkt + 24, 4);
+	seq = ntohl(seq);
+
+	if (g->len) {
+		if (hlen != g->hlen || plen > g->mss || seq != g->next_seq
+			|| g->len + plen > 65535
+			|| pkt[1] != g->buf[1] /* tos */
+			|| (pkt[6] ^ g->buf[6]) & 0x40 /* DF */
+			|| pkt[8] != g->buf[8] /* ttl */
+			|| memcmp(pkt + 12, g->buf + 12, 12) /* addresses, ports */
+			|| memcmp(pkt + 28, g->buf + 28, 5) /* ack, data offset */
+			|| memcmp(pkt + 34, g->buf + 34, 2) /* window */
+			|| memcmp(pkt + 38, g->buf + 38, hlen - 38)) /* urgent pointer, options */
+			return GRO_NO;
+	}
+
+	/* the kernel won't check the payload of the super-packet again */
+	if (csum_fold(csum_add(0, pkt, 20)) != 0
+		|| csum_fold(csum_add(csum_pseudo(pkt, len - 20), pkt + 20, len - 20)) != 0)
+		return GRO_NO;
+
+	if (g->len == 0) {
+		memcpy(g->buf, pkt, len);
+		g->len = len;
+		g->hlen = hlen;
+		g->mss = plen;
+		g->segs = 1;
+	} else {
+		memcpy(g->buf + g->len, pkt + hlen, plen);
+		g->len += plen;
+		g->buf[33] |= flags;
+		g->segs++;
+	}
+	g->next_seq = seq + plen;
+
+	if ((flags & TCP_PSH) || plen < g->mss)
+		return GRO_FLUSH;
+	return GRO_MERGED;
+}
+
+/*
+ * Finish the super-packet in g->buf and empty g. A single segment is
+ * left untouched, otherwise the TCP checksum is left to the kernel
+ * (VIRTIO_NET_HDR_F_NEEDS_CSUM). Returns its length.
+ */
+unsigned int gro_finish(struct gro *g, struct virtio_net_hdr *vh)
+{
+	unsigned int len = g->len;
+	uint16_t v16;
+
+	memset(vh, 0, sizeof(*vh));
+	g->len = 0;
+	if (g->segs < 2)
+		return len;
+
+	v16 = htons(len);
+	memcpy(g->buf + 2, &v16, 2);
+	memset(g->buf + 10, 0, 2);
+	v16 = csum_fold(csum_add(0, g->buf, 20));
+	memcpy(g->buf + 10, &v16, 2);
+
+	v16 = ~csum_fold(csum_pseudo(g->buf, len - 20));
+	memcpy(g->buf + 36, &v16, 2);
+
+	vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	vh->hdr_len = g->hlen;
+	vh->gso_size = g->mss;
+	vh->csum_start = 20;
+	vh->csum_offset = 16;
+	return len;
+}
+
+#endif
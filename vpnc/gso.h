@@ -0,0 +1,69 @@
+/* Segmentation of TCP super-packets from a tun device with vnet headers
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __GSO_H__
+#define __GSO_H__
+
+#include "sysdep.h"
+
+#ifdef HAVE_TUN_OFFLOAD
+
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+#define GSO_MAX_PACKET 65536
+
+/*
+ * Walks the MSS sized segments of an IPv4 TCP super-packet. A packet
+ * that is no super-packet comes out as a single segment.
+ */
+struct gso_iter {
+	const uint8_t *pkt;
+	unsigned int len;
+	unsigned int hlen; /* IP and TCP header */
+	unsigned int mss;
+	unsigned int off; /* payload already handed out */
+	uint16_t ip_id;
+	uint32_t seq;
+};
+
+/*
+ * Coalesces in-order TCP segments of one flow into a super-packet,
+ * the reverse of struct gso_iter.
+ */
+struct gro {
+	uint8_t *buf; /* GSO_MAX_PACKET bytes */
+	unsigned int len; /* 0 while empty */
+	unsigned int hlen; /* IP and TCP header */
+	unsigned int mss; /* payload of the first segment */
+	unsigned int segs;
+	uint32_t next_seq;
+};
+
+#define GRO_MERGED 0 /* taken, more may follow */
+#define GRO_FLUSH 1 /* taken, but ends the super-packet */
+#define GRO_NO -1 /* doesn't fit, flush and retry or send it as is */
+
+extern int gso_csum(uint8_t *pkt, unsigned int len, const struct virtio_net_hdr *vh);
+extern int gso_start(struct gso_iter *it, uint8_t *pkt, unsigned int len,
+	const struct virtio_net_hdr *vh, unsigned int max);
+extern unsigned int gso_next(struct gso_iter *it, uint8_t *out);
+extern int gro_add(struct gro *g, const uint8_t *pkt, unsigned int len);
+extern unsigned int gro_finish(struct gro *g, struct virtio_net_hdr *vh);
+
+#endif
+#endif
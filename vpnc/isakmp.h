@@ -319,6 +319,10 @@ enum isakmp_ipsec_esp_enum {
 	ISAKMP_IPSEC_ESP_NULL,
 	ISAKMP_IPSEC_ESP_AES,
 	ISAKMP_IPSEC_ESP_AES_128_CTR,
+	ISAKMP_IPSEC_ESP_AES_GCM_8 = 18, /* RFC 4106 */
+	ISAKMP_IPSEC_ESP_AES_GCM_12,
+	ISAKMP_IPSEC_ESP_AES_GCM_16,
+	ISAKMP_IPSEC_ESP_CHACHA20_POLY1305 = 28, /* RFC 7634 */
 	ISAKMP_IPSEC_ESP_AES_MARS = 249,
 	ISAKMP_IPSEC_ESP_AES_RC6,
 	ISAKMP_IPSEC_ESP_AES_RIJNDAEL,
@@ -337,7 +341,13 @@ enum isakmp_ipsec_attr_enum {
 	ISAKMP_IPSEC_ATTRIB_KEY_ROUNDS,
 	ISAKMP_IPSEC_ATTRIB_COMP_DICT_SIZE,
 	ISAKMP_IPSEC_ATTRIB_COMP_PRIVATE_ALG,
-	ISAKMP_IPSEC_ATTRIB_ECN_TUNNEL
+	ISAKMP_IPSEC_ATTRIB_ECN_TUNNEL,
+	ISAKMP_IPSEC_ATTRIB_ESN /* RFC 4304 */
+};
+
+/* IPSEC extended sequence number values.  */
+enum isakmp_ipsec_esn_enum {
+	ISAKMP_IPSEC_ESN_64 = 1
 };
 
 /* IPSEC compression IDs.  */
@@ -370,7 +380,10 @@ enum ipsec_auth_enum {
 	IPSEC_AUTH_HMAC_MD5 = 1,
 	IPSEC_AUTH_HMAC_SHA,
 	IPSEC_AUTH_DES_MAC,
-	IPSEC_AUTH_KPDK
+	IPSEC_AUTH_KPDK,
+	IPSEC_AUTH_HMAC_SHA2_256,
+	IPSEC_AUTH_HMAC_SHA2_384,
+	IPSEC_AUTH_HMAC_SHA2_512
 };
 
 /* Other numbers.  */
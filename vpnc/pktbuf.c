@@ -0,0 +1,118 @@
+/* Packet buffers, buffer pools and descriptor rings
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "sysdep.h"
+#include "pktbuf.h"
+#include "isakmp-pkt.h"
+
+#define PKT_ALIGN 64 /* cache line */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Huge pages save TLB misses on the per-packet path. There are only any
+ * if the administrator reserved some (vm.nr_hugepages), otherwise we
+ * use normal memory.
+ */
+static uint8_t *pkt_pool_mem(struct pkt_pool *pool, int huge)
+{
+	void *mem;
+
+#ifdef MAP_HUGETLB
+	if (huge) {
+		size_t len = (pool->mem_len + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			pool->mem_len = len;
+			pool->huge = 1;
+			return mem;
+		}
+	}
+#else
+	(void)huge;
+#endif
+	if (posix_memalign(&mem, PKT_ALIGN, pool->mem_len) != 0)
+		return NULL;
+	memset(mem, 0, pool->mem_len);
+	return mem;
+}
+
+struct pkt_pool *pkt_pool_new(unsigned int n, unsigned int size, int huge)
+{
+	struct pkt_pool *pool;
+	unsigned int i;
+
+	size = (size + PKT_ALIGN - 1) & ~(PKT_ALIGN - 1);
+
+	pool = xallocc(sizeof(struct pkt_pool));
+	pool->n = pool->nfree = n;
+	pool->mem_len = (size_t)n * size;
+	pool->mem = pkt_pool_mem(pool, huge);
+	if (pool->mem == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pool->pkts = xallocc(n * sizeof(struct pkt));
+	pool->free = xallocc(n * sizeof(struct pkt *));
+	for (i = 0; i < n; i++) {
+		pkt_init(&pool->pkts[i], pool->mem + (size_t)i * size, size);
+		pool->pkts[i].pool = pool;
+		/* handed out in address order */
+		pool->free[n - 1 - i] = &pool->pkts[i];
+	}
+	return pool;
+}
+
+void pkt_pool_free(struct pkt_pool *pool)
+{
+	if (pool == NULL)
+		return;
+#ifdef MAP_HUGETLB
+	if (pool->huge)
+		munmap(pool->mem, pool->mem_len);
+	else
+#endif
+		free(pool->mem);
+	free(pool->pkts);
+	free(pool->free);
+	free(pool);
+}
+
+int pkt_ring_init(struct pkt_ring *r, unsigned int size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+	memset(r, 0, sizeof(*r));
+	r->slot = calloc(n, sizeof(struct pkt *));
+	if (r->slot == NULL)
+		return -1;
+	r->mask = n - 1;
+	return 0;
+}
+
+void pkt_ring_free(struct pkt_ring *r)
+{
+	free(r->slot);
+	r->slot = NULL;
+}
@@ -0,0 +1,190 @@
+/* Packet buffers, buffer pools and descriptor rings
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PKTBUF_H__
+#define __PKTBUF_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct pkt_pool;
+struct esp_sa;
+
+/*
+ * Descriptor of one packet in its buffer. The packet is data[0..len),
+ * the bytes in front of it are headroom for headers still to be
+ * prepended, the ones behind it tailroom for trailers.
+ */
+struct pkt {
+	uint8_t *head; /* start of the buffer */
+	unsigned int size; /* of the buffer */
+	uint8_t *data;
+	unsigned int len;
+
+	/* ESP: where the ESP header starts in the packet, the fixed ESP
+	 * header plus IV that follows it */
+	unsigned int payload;
+	unsigned int var_header_size;
+	uint64_t seq; /* ESP sequence number, with the high bits of ESN */
+	struct esp_sa *sa; /* framed for, or arrived on */
+	int err; /* the crypto stage rejected the packet */
+
+	struct pkt_pool *pool; /* owner, NULL for buffers managed elsewhere */
+};
+
+static __inline__ unsigned int pkt_headroom(const struct pkt *p)
+{
+	return p->data - p->head;
+}
+
+static __inline__ unsigned int pkt_tailroom(const struct pkt *p)
+{
+	return p->size - pkt_headroom(p) - p->len;
+}
+
+/* Empty the packet, leaving headroom bytes in front of it */
+static __inline__ void pkt_reset(struct pkt *p, unsigned int headroom)
+{
+	p->data = p->head + headroom;
+	p->len = 0;
+	p->payload = 0;
+	p->var_header_size = 0;
+	p->err = 0;
+}
+
+/* Prepend n bytes, returns the new start of the packet */
+static __inline__ uint8_t *pkt_push(struct pkt *p, unsigned int n)
+{
+	p->data -= n;
+	p->len += n;
+	return p->data;
+}
+
+/* Strip n bytes from the front */
+static __inline__ void pkt_pull(struct pkt *p, unsigned int n)
+{
+	p->data += n;
+	p->len -= n;
+}
+
+/* Append n bytes, returns where they go */
+static __inline__ uint8_t *pkt_put(struct pkt *p, unsigned int n)
+{
+	uint8_t *tail = p->data + p->len;
+
+	p->len += n;
+	return tail;
+}
+
+/* Describe a buffer that is not from a pool */
+static __inline__ void pkt_init(struct pkt *p, uint8_t *buf, unsigned int size)
+{
+	memset(p, 0, sizeof(*p));
+	p->head = p->data = buf;
+	p->size = size;
+}
+
+/*
+ * A fixed number of equal sized buffers, allocated up front. Only the
+ * thread owning the pool takes buffers from it and returns them, other
+ * threads hand them back through a ring.
+ */
+struct pkt_pool {
+	struct pkt *pkts;
+	struct pkt **free;
+	unsigned int nfree;
+	unsigned int n;
+	uint8_t *mem;
+	size_t mem_len;
+	int huge; /* mem is backed by huge pages */
+};
+
+/* huge: try to put the buffers in huge pages */
+extern struct pkt_pool *pkt_pool_new(unsigned int n, unsigned int size, int huge);
+extern void pkt_pool_free(struct pkt_pool *pool);
+
+/* Take a buffer, with headroom bytes in front of the (empty) packet */
+static __inline__ struct pkt *pkt_alloc(struct pkt_pool *pool, unsigned int headroom)
+{
+	struct pkt *p;
+
+	if (pool->nfree == 0)
+		return NULL;
+	p = pool->free[--pool->nfree];
+	pkt_reset(p, headroom);
+	return p;
+}
+
+static __inline__ void pkt_free(struct pkt *p)
+{
+	if (p->pool)
+		p->pool->free[p->pool->nfree++] = p;
+}
+
+/*
+ * Single producer, single consumer ring of descriptors, passing packets
+ * from one stage of the data path to the next. The producer only writes
+ * tail, the consumer only head, so the two may run in different threads
+ * without a lock.
+ */
+struct pkt_ring {
+	struct pkt **slot;
+	unsigned int mask; /* size - 1, size a power of two */
+	unsigned int head __attribute__((aligned(64))); /* next to pop */
+	unsigned int tail __attribute__((aligned(64))); /* next to push */
+};
+
+extern int pkt_ring_init(struct pkt_ring *r, unsigned int size);
+extern void pkt_ring_free(struct pkt_ring *r);
+
+static __inline__ unsigned int pkt_ring_count(struct pkt_ring *r)
+{
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+static __inline__ int pkt_ring_full(struct pkt_ring *r)
+{
+	return pkt_ring_count(r) > r->mask;
+}
+
+/* Returns -1 if the ring is full */
+static __inline__ int pkt_ring_push(struct pkt_ring *r, struct pkt *p)
+{
+	unsigned int tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+		return -1;
+	r->slot[tail & r->mask] = p;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Returns NULL if the ring is empty */
+static __inline__ struct pkt *pkt_ring_pop(struct pkt_ring *r)
+{
+	unsigned int head = r->head;
+	struct pkt *p;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	p = r->slot[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+#endif
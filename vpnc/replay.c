@@ -0,0 +1,135 @@
+/* IPSec ESP anti-replay window
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sysdep.h"
+#include "replay.h"
+
+#define WORD_BITS 64
+#define ESN_WINDOW 32 /* nominal window of replay_esn() when there is none */
+
+void replay_init(struct replay_window *w, unsigned int size)
+{
+	unsigned int words = 1;
+
+	/*
+	 * One word more than the window needs: the word the top sequence
+	 * number lives in is only partly inside the window.
+	 */
+	while (words < (size + WORD_BITS - 1) / WORD_BITS + 1)
+		words <<= 1;
+
+	w->size = size;
+	w->mask = words - 1;
+	w->bits = calloc(words, sizeof(uint64_t));
+	if (w->bits == NULL)
+		error(1, errno, "malloc of replay window failed");
+	w->top = 0;
+}
+
+void replay_reset(struct replay_window *w)
+{
+	if (w->bits)
+		memset(w->bits, 0, (w->mask + 1) * sizeof(uint64_t));
+	w->top = 0;
+}
+
+void replay_free(struct replay_window *w)
+{
+	free(w->bits);
+	w->bits = NULL;
+}
+
+/*
+ * Returns 0 if a packet with this sequence number may be accepted,
+ * -1 if it is a replay or too old.
+ */
+int replay_check(const struct replay_window *w, uint64_t seq)
+{
+	unsigned int bit;
+
+	if (w->size == 0)
+		return 0;
+	if (seq == 0)
+		return -1;
+	if (seq > w->top)
+		return 0;
+	if (w->top - seq >= w->size)
+		return -1;
+
+	bit = seq & (WORD_BITS - 1);
+	if (w->bits[(seq / WORD_BITS) & w->mask] & ((uint64_t)1 << bit))
+		return -1;
+	return 0;
+}
+
+/*
+ * Mark seq as received, once the packet has been authenticated.
+ * seq must have passed replay_check().
+ */
+void replay_update(struct replay_window *w, uint64_t seq)
+{
+	uint64_t index, top_index, diff;
+
+	if (w->size == 0) {
+		/* replay_esn() still needs the top */
+		if (seq > w->top)
+			w->top = seq;
+		return;
+	}
+
+	index = seq / WORD_BITS;
+	if (seq > w->top) {
+		top_index = w->top / WORD_BITS;
+		diff = index - top_index;
+		if (diff > w->mask + 1)
+			diff = w->mask + 1;
+		/* clear the words the window slides over */
+		while (diff--)
+			w->bits[++top_index & w->mask] = 0;
+		w->top = seq;
+	}
+
+	w->bits[index & w->mask] |= (uint64_t)1 << (seq & (WORD_BITS - 1));
+}
+
+/*
+ * The full sequence number of a packet of an SA with extended sequence
+ * numbers, of which only the low 32 bits are sent: the high ones are
+ * those that put it closest to the window (RFC 4303, appendix A).
+ * Without a window the guess is made against one of ESN_WINDOW packets,
+ * so a packet that arrives a little late doesn't jump ahead 2^32.
+ */
+uint64_t replay_esn(const struct replay_window *w, uint32_t seq)
+{
+	uint32_t tl = (uint32_t)w->top, th = (uint32_t)(w->top >> 32);
+	uint32_t size = w->size ? w->size : ESN_WINDOW;
+
+	if (tl >= size - 1) {
+		/* the window lies within one subspace */
+		if (seq < tl - size + 1)
+			th++;
+	} else {
+		/* it spans two, the bottom is in the previous one */
+		if (seq >= tl - size + 1 && th > 0)
+			th--;
+	}
+	return (uint64_t)th << 32 | seq;
+}
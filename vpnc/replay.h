@@ -0,0 +1,42 @@
+/* IPSec ESP anti-replay window
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+/*
+ * Sliding window of RFC 4303, section 3.4.3, kept as a ring of 64 bit
+ * words (RFC 6479). Advancing the window clears whole words, so check
+ * and update are O(1) whatever the window size.
+ */
+struct replay_window {
+	uint64_t top; /* highest sequence number accepted so far */
+	uint32_t size; /* window size in packets, 0 disables the check */
+	uint32_t mask; /* number of words - 1 */
+	uint64_t *bits;
+};
+
+extern void replay_init(struct replay_window *w, unsigned int size);
+extern void replay_reset(struct replay_window *w);
+extern void replay_free(struct replay_window *w);
+extern int replay_check(const struct replay_window *w, uint64_t seq);
+extern void replay_update(struct replay_window *w, uint64_t seq);
+extern uint64_t replay_esn(const struct replay_window *w, uint32_t seq);
+
+#endif
@@ -28,40 +28,48 @@
 #include <stdlib.h>
 
 const supported_algo_t supp_dh_group[] = {
-	{"nopfs", 0, 0, 0, 0},
-	{"dh1", OAKLEY_GRP_1, IKE_GROUP_MODP_768,  IKE_GROUP_MODP_768,  0},
-	{"dh2", OAKLEY_GRP_2, IKE_GROUP_MODP_1024, IKE_GROUP_MODP_1024, 0},
-	{"dh5", OAKLEY_GRP_5, IKE_GROUP_MODP_1536, IKE_GROUP_MODP_1536, 0},
-	/*{ "dh7", OAKLEY_GRP_7, IKE_GROUP_EC2N_163K, IKE_GROUP_EC2N_163K, 0 } note: code missing */
-	{NULL, 0, 0, 0, 0}
+	{"nopfs", 0, 0, 0, 0, 0},
+	{"dh1", OAKLEY_GRP_1, IKE_GROUP_MODP_768,  IKE_GROUP_MODP_768,  0, 0},
+	{"dh2", OAKLEY_GRP_2, IKE_GROUP_MODP_1024, IKE_GROUP_MODP_1024, 0, 0},
+	{"dh5", OAKLEY_GRP_5, IKE_GROUP_MODP_1536, IKE_GROUP_MODP_1536, 0, 0},
+	/*{ "dh7", OAKLEY_GRP_7, IKE_GROUP_EC2N_163K, IKE_GROUP_EC2N_163K, 0, 0 } note: code missing */
+	{NULL, 0, 0, 0, 0, 0}
 };
 
 const supported_algo_t supp_hash[] = {
-	{"md5", GCRY_MD_MD5, IKE_HASH_MD5, IPSEC_AUTH_HMAC_MD5, 0},
-	{"sha1", GCRY_MD_SHA1, IKE_HASH_SHA, IPSEC_AUTH_HMAC_SHA, 0},
-	{NULL, 0, 0, 0, 0}
+	{"md5", GCRY_MD_MD5, IKE_HASH_MD5, IPSEC_AUTH_HMAC_MD5, 0, 0},
+	{"sha1", GCRY_MD_SHA1, IKE_HASH_SHA, IPSEC_AUTH_HMAC_SHA, 0, 0},
+	/* last entries are proposed first, SHA-256 has SHA-NI */
+	{"sha512", GCRY_MD_SHA512, IKE_HASH_SHA2_512, IPSEC_AUTH_HMAC_SHA2_512, 0, 0},
+	{"sha384", GCRY_MD_SHA384, IKE_HASH_SHA2_384, IPSEC_AUTH_HMAC_SHA2_384, 0, 0},
+	{"sha256", GCRY_MD_SHA256, IKE_HASH_SHA2_256, IPSEC_AUTH_HMAC_SHA2_256, 0, 0},
+	{NULL, 0, 0, 0, 0, 0}
 };
 
 const supported_algo_t supp_crypt[] = {
-	{"null", GCRY_CIPHER_NONE, IKE_ENC_NO_CBC, ISAKMP_IPSEC_ESP_NULL, 0},
-	{"des", GCRY_CIPHER_DES, IKE_ENC_DES_CBC, ISAKMP_IPSEC_ESP_DES, 0},
-	{"3des", GCRY_CIPHER_3DES, IKE_ENC_3DES_CBC, ISAKMP_IPSEC_ESP_3DES, 0},
-	{"aes128", GCRY_CIPHER_AES128, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 128},
-	{"aes192", GCRY_CIPHER_AES192, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 192},
-	{"aes256", GCRY_CIPHER_AES256, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 256},
-	{NULL, 0, 0, 0, 0}
+	{"null", GCRY_CIPHER_NONE, IKE_ENC_NO_CBC, ISAKMP_IPSEC_ESP_NULL, 0, GCRY_CIPHER_MODE_NONE},
+	{"des", GCRY_CIPHER_DES, IKE_ENC_DES_CBC, ISAKMP_IPSEC_ESP_DES, 0, GCRY_CIPHER_MODE_CBC},
+	{"3des", GCRY_CIPHER_3DES, IKE_ENC_3DES_CBC, ISAKMP_IPSEC_ESP_3DES, 0, GCRY_CIPHER_MODE_CBC},
+	{"aes128", GCRY_CIPHER_AES128, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 128, GCRY_CIPHER_MODE_CBC},
+	{"aes192", GCRY_CIPHER_AES192, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 192, GCRY_CIPHER_MODE_CBC},
+	{"aes256", GCRY_CIPHER_AES256, IKE_ENC_AES_CBC, ISAKMP_IPSEC_ESP_AES, 256, GCRY_CIPHER_MODE_CBC},
+	/* ESP only, last entries are proposed first */
+	{"chacha20-poly1305", GCRY_CIPHER_CHACHA20, 0, ISAKMP_IPSEC_ESP_CHACHA20_POLY1305, 0, GCRY_CIPHER_MODE_POLY1305},
+	{"aes128-gcm", GCRY_CIPHER_AES128, 0, ISAKMP_IPSEC_ESP_AES_GCM_16, 128, GCRY_CIPHER_MODE_GCM},
+	{"aes256-gcm", GCRY_CIPHER_AES256, 0, ISAKMP_IPSEC_ESP_AES_GCM_16, 256, GCRY_CIPHER_MODE_GCM},
+	{NULL, 0, 0, 0, 0, 0}
 };
 
 const supported_algo_t supp_auth[] = {
-	{"psk", 0, IKE_AUTH_PRESHARED, 0, 0},
-	{"psk+xauth", 0, IKE_AUTH_XAUTHInitPreShared, 0, 0},
+	{"psk", 0, IKE_AUTH_PRESHARED, 0, 0, 0},
+	{"psk+xauth", 0, IKE_AUTH_XAUTHInitPreShared, 0, 0, 0},
 #if 0
-	{"cert(dsa)", 0, IKE_AUTH_RSA_SIG, 0, 0},
-	{"cert(rsasig)", 0, IKE_AUTH_DSS, 0, 0},
-	{"hybrid(dsa)", 0, IKE_AUTH_DSS, 0, 0},
+	{"cert(dsa)", 0, IKE_AUTH_RSA_SIG, 0, 0, 0},
+	{"cert(rsasig)", 0, IKE_AUTH_DSS, 0, 0, 0},
+	{"hybrid(dsa)", 0, IKE_AUTH_DSS, 0, 0, 0},
 #endif /* 0 */
-	{"hybrid(rsa)", 0, IKE_AUTH_HybridInitRSA, 0, 0},
-	{NULL, 0, 0, 0, 0}
+	{"hybrid(rsa)", 0, IKE_AUTH_HybridInitRSA, 0, 0, 0},
+	{NULL, 0, 0, 0, 0, 0}
 };
 
 const supported_algo_t *get_algo(enum algo_group what, enum supp_algo_key key, int id,
@@ -128,3 +136,29 @@ const supported_algo_t *get_dh_group_ipsec(int server_setting)
 
 	return get_algo(SUPP_ALGO_DH_GROUP, SUPP_ALGO_NAME, 0, pfs_setting, 0);
 }
+
+/*
+ * Whether libgcrypt uses AES instructions on this CPU. Without them
+ * ChaCha20-Poly1305 is several times faster than AES.
+ */
+int supp_have_aes_hw(void)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+	static const char *const aes_hw[] = {
+		":intel-aesni:", ":arm-aes:", ":ppc-vcrypto:", ":s390x-msa:", NULL
+	};
+	char *flags;
+	int i, found = 0;
+
+	flags = gcry_get_config(0, "hwflist");
+	if (flags == NULL)
+		return 1;
+	for (i = 0; aes_hw[i] != NULL; i++)
+		if (strstr(flags, aes_hw[i]) != NULL)
+			found = 1;
+	gcry_free(flags);
+	return found;
+#else
+	return 1;
+#endif
+}
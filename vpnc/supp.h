@@ -40,8 +40,13 @@ typedef struct {
 	const char *name;
 	int my_id, ike_sa_id, ipsec_sa_id;
 	int keylen;
+	int mode; /* cipher mode of SUPP_ALGO_CRYPT entries */
 } supported_algo_t;
 
+/* combined mode cipher, authenticates without a separate hash */
+#define SUPP_ALGO_IS_AEAD(a) ((a)->mode == GCRY_CIPHER_MODE_GCM || \
+	(a)->mode == GCRY_CIPHER_MODE_POLY1305)
+
 extern const supported_algo_t supp_dh_group[];
 extern const supported_algo_t supp_hash[];
 extern const supported_algo_t supp_crypt[];
@@ -50,5 +55,6 @@ extern const supported_algo_t supp_auth[];
 extern const supported_algo_t *get_algo(enum algo_group what, enum supp_algo_key key, int id, const char *name, int keylen);
 extern const supported_algo_t *get_dh_group_ike(void);
 extern const supported_algo_t *get_dh_group_ipsec(int server_setting);
+extern int supp_have_aes_hw(void);
 
 #endif
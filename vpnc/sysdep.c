@@ -431,7 +431,19 @@ int tun_open (char *dev, enum if_mode_enum mode)
 	return fd;
 }
 #elif defined(IFF_TUN)
-int tun_open(char *dev, enum if_mode_enum mode)
+#ifndef IFF_MULTI_QUEUE
+#define IFF_MULTI_QUEUE 0x0100
+#endif
+#ifndef IFF_VNET_HDR
+#define IFF_VNET_HDR 0x4000
+#endif
+#ifndef TUNSETOFFLOAD
+#define TUNSETOFFLOAD _IOW('T', 208, unsigned int)
+#define TUN_F_CSUM 0x01
+#define TUN_F_TSO4 0x02
+#endif
+
+static int tun_open_flags(char *dev, enum if_mode_enum mode, int flags)
 {
 	struct ifreq ifr;
 	int fd, err;
@@ -443,7 +455,7 @@ int tun_open(char *dev, enum if_mode_enum mode)
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = ((mode == IF_MODE_TUN) ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
+	ifr.ifr_flags = ((mode == IF_MODE_TUN) ? IFF_TUN : IFF_TAP) | IFF_NO_PI | flags;
 	if (*dev)
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 
@@ -454,6 +466,40 @@ int tun_open(char *dev, enum if_mode_enum mode)
 	strcpy(dev, ifr.ifr_name);
 	return fd;
 }
+
+int tun_open(char *dev, enum if_mode_enum mode)
+{
+	return tun_open_flags(dev, mode, 0);
+}
+
+/*
+ * Open a multi-queue device, one fd per queue. The first open
+ * creates the device, the others attach to it by name.
+ * With vnet_hdr, every packet is preceded by a struct virtio_net_hdr
+ * and the kernel may hand out unchecksummed TCP super-packets.
+ * Returns the number of queues opened, or -1.
+ */
+int tun_open_queues(char *dev, enum if_mode_enum mode, int *fds, int nqueues, int vnet_hdr)
+{
+	int i, flags = 0;
+
+	if (nqueues > 1)
+		flags |= IFF_MULTI_QUEUE;
+	if (vnet_hdr)
+		flags |= IFF_VNET_HDR;
+
+	for (i = 0; i < nqueues; i++) {
+		fds[i] = tun_open_flags(dev, mode, flags);
+		if (fds[i] < 0)
+			break;
+	}
+
+	/* offloads are per device, without them packets just come one by one */
+	if (i > 0 && vnet_hdr && ioctl(fds[0], TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4) == -1)
+		error(0, errno, "can't enable TCP segmentation offload on %s", dev);
+
+	return (i == 0) ? -1 : i;
+}
 #else
 int tun_open(char *dev, enum if_mode_enum mode)
 {
@@ -47,6 +47,22 @@ int tun_get_hwaddr(int fd, char *dev, uint8_t *hwaddr);
 #define HAVE_SETENV    1
 #endif
 
+/***************************************************************************/
+#if defined(__linux__)
+#define HAVE_MMSG 1
+#define HAVE_TUN_QUEUES 1
+#define HAVE_CRYPTO_THREADS 1
+#define HAVE_TUN_OFFLOAD 1
+#define HAVE_UDP_GSO 1
+#define HAVE_EPOLL 1
+#define HAVE_XFRM 1
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
 /***************************************************************************/
 #if defined(__NetBSD__)
 #define HAVE_SA_LEN 1
@@ -234,6 +250,9 @@ extern int setenv(const char *name, const char *value, int overwrite);
 #ifndef HAVE_UNSETENV
 extern int unsetenv(const char *name);
 #endif
+#ifdef HAVE_TUN_QUEUES
+extern int tun_open_queues(char *dev, enum if_mode_enum mode, int *fds, int nqueues, int vnet_hdr);
+#endif
 
 
 #endif
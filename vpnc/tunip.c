@@ -53,8 +53,10 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
@@ -68,17 +70,23 @@
 #endif
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <strings.h>
 #include <syslog.h>
 #include <time.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <poll.h>
 
-#ifdef __CYGWIN__
+#if defined(__CYGWIN__) || defined(__linux__)
 #include <pthread.h>
 #endif
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #if !defined(__sun__) && !defined(__SKYOS__)
 #include <err.h>
 #endif
@@ -87,495 +95,1041 @@
 #include "sysdep.h"
 #include "config.h"
 #include "vpnc.h"
+#include "isakmp-pkt.h"
 
 #include "tunip.h"
+#include "esp.h"
+#include "pktbuf.h"
+#include "cksum.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include "uring.h"
+#endif
+#ifdef HAVE_TUN_OFFLOAD
+#include "gso.h"
+#endif
+#ifdef HAVE_XFRM
+#include "xfrm.h"
+#endif
+#ifdef HAVE_UDP_GSO
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#define UDP_GSO_MAX_SEGS 64
+#define UDP_GSO_MAX_SIZE (65535 - 20 - 8) /* IPv4 and UDP header */
+#define UDP_GRO_SLOTS 8
+#define UDP_GRO_SLOT_SIZE (ETH_HLEN + 65536)
+#endif
 
 #ifndef MAX
 #define MAX(a,b)	((a)>(b)?(a):(b))
 #endif
 
+#ifndef MIN
+#define MIN(a,b)	((a)<(b)?(a):(b))
+#endif
+
 #ifndef FD_COPY
 #define FD_COPY(f, t)	((void)memcpy((t), (f), sizeof(*(f))))
 #endif
 
-/* A real ESP header (RFC 2406) */
-typedef struct esp_encap_header {
-	uint32_t spi; /* security parameters index */
-	uint32_t seq_id; /* sequence id (unimplemented) */
-	/* variable-length payload data + padding */
-	/* unsigned char next_header */
-	/* optional auth data */
-} __attribute__((packed)) esp_encap_header_t;
-
 struct encap_method {
 	int fixed_header_size;
 
-	int  (*recv)      (struct sa_block *s, unsigned char *buf, unsigned int bufsize);
-	void (*send_peer) (struct sa_block *s, unsigned char *buf, unsigned int bufsize);
-	int  (*recv_peer) (struct sa_block *s);
+	int  (*recv)      (struct sa_block *s, struct pkt *p, const struct sockaddr_in *from);
+	int  (*send_peer) (struct sa_block *s, struct pkt *p);
+	int  (*recv_peer) (struct sa_block *s, struct pkt *p);
 };
 
 /* Yuck! Global variables... */
 
 #define MAX_HEADER 72
 #define MAX_PACKET 4096
+#define MAX_TRAILER 64 /* ESP padding, pad length, next header and ICV */
+#define PKT_SIZE (MAX_HEADER + MAX_PACKET + MAX_TRAILER)
 int volatile do_kill;
-static uint8_t global_buffer_rx[MAX_HEADER + MAX_PACKET + ETH_HLEN];
-static uint8_t global_buffer_tx[MAX_HEADER + MAX_PACKET + ETH_HLEN];
 
 /*
- * in_cksum --
- *	Checksum routine for Internet Protocol family headers (C Version)
+ * Packets handled in one wakeup of the main loop. On their way to the
+ * peer they pass three stages: read from the tunnel device onto crypt,
+ * encapsulated onto send, sent by esp_batch_flush(). Packets from the
+ * peer are received into pkt[] and handled in place. All buffers come
+ * from the batch's pool, those read from the tunnel device have
+ * MAX_HEADER bytes of headroom in front of the IP packet.
  */
-static u_short in_cksum(u_short *addr, int len)
-{
-	register int nleft = len;
-	register u_short *w = addr;
-	register int sum = 0;
-	u_short answer = 0;
-
-	/*
-	 * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-	 * sequential 16 bit words to it, and at the end, fold back all the
-	 * carry bits from the top 16 bits into the lower 16 bits.
-	 */
-	while (nleft > 1) {
-		sum += *w++;
-		nleft -= 2;
-	}
-
-	/* mop up an odd byte, if necessary */
-	if (nleft == 1) {
-		*(u_char *) (&answer) = *(u_char *) w;
-		sum += answer;
-	}
+struct esp_batch {
+	unsigned int count; /* packets being sent (tx) or received (rx) */
+	unsigned int limit; /* current batch size, adapts to the load */
+	unsigned int max; /* upper bound for limit */
+	int to_dst; /* tx via raw socket, which is not connect()ed */
+	struct sockaddr_in dstaddr;
+	struct pkt_pool *pool;
+	struct pkt_ring crypt; /* tx: read, to be encapsulated */
+	struct pkt_ring send; /* tx: encapsulated, to be sent */
+	struct pkt *seal[MAX_BATCH]; /* tx: framed, to be sealed together */
+	unsigned int nseal;
+	struct pkt *pkt[MAX_BATCH];
+	unsigned int seg[MAX_BATCH]; /* rx: packet size within a UDP GRO train, 0 if none */
+	struct sockaddr_in from[MAX_BATCH];
+	unsigned int crypto_in, crypto_out; /* packets handed to and collected from the crypto workers */
+#ifdef HAVE_MMSG
+	struct mmsghdr msg[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+#endif
+#ifdef HAVE_UDP_GSO
+	int udp_gso; /* tx: equal sized packets go out as one UDP_SEGMENT train */
+	int udp_gro; /* rx: trains are received with UDP_GRO, the pool has train sized buffers */
+	struct pkt segs[MAX_BATCH]; /* rx: the packets of the trains */
+	unsigned int nsegs;
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} ctrl[MAX_BATCH];
+#endif
+	uint8_t *gso_buf; /* super-packets from or to a vnet header tun device */
+#ifdef HAVE_TUN_OFFLOAD
+	struct gro gro; /* rx: segments coalesced in gso_buf */
+#endif
+};
 
-	/* add back carry outs from top 16 bits to low 16 bits */
-	sum = (sum >> 16) + (sum & 0xffff); /* add hi 16 to low 16 */
-	sum += (sum >> 16); /* add carry */
-	answer = ~sum; /* truncate to 16 bits */
-	return (answer);
-}
+enum { ESP_TX, ESP_RX }; /* directions, the lanes of a crypto worker */
 
 /*
  * Decapsulate from a raw IP packet
  */
-static int encap_rawip_recv(struct sa_block *s, unsigned char *buf, unsigned int bufsize)
+static int encap_rawip_recv(struct sa_block *s, struct pkt *p, const struct sockaddr_in *from)
 {
-	ssize_t r;
-	struct ip *p = (struct ip *)buf;
-	struct sockaddr_in from;
-	socklen_t fromlen = sizeof(from);
+	struct ip *ip = (struct ip *)p->data;
+	ssize_t r = p->len;
 
-	r = recvfrom(s->esp_fd, buf, bufsize, 0, (struct sockaddr *)&from, &fromlen);
-	if (r == -1) {
-		logmsg(LOG_ERR, "recvfrom: %m");
+	if (from->sin_addr.s_addr != s->dst.s_addr) {
+		logmsg(LOG_ALERT, "packet from unknown host %s", inet_ntoa(from->sin_addr));
 		return -1;
 	}
-	if (from.sin_addr.s_addr != s->dst.s_addr) {
-		logmsg(LOG_ALERT, "packet from unknown host %s", inet_ntoa(from.sin_addr));
-		return -1;
-	}
-	if (r < (p->ip_hl << 2) + s->ipsec.em->fixed_header_size) {
-		logmsg(LOG_ALERT, "packet too short. got %zd, expected %d", r, (p->ip_hl << 2) + s->ipsec.em->fixed_header_size);
+	if (r < (ip->ip_hl << 2) + s->ipsec.em->fixed_header_size) {
+		logmsg(LOG_ALERT, "packet too short. got %zd, expected %d", r, (ip->ip_hl << 2) + s->ipsec.em->fixed_header_size);
 		return -1;
 	}
 
 #ifdef NEED_IPLEN_FIX
-	p->ip_len = r;
+	ip->ip_len = r;
 #else
-	p->ip_len = ntohs(r);
+	ip->ip_len = ntohs(r);
 #endif
 
-	s->ipsec.rx.buf = buf;
-	s->ipsec.rx.buflen = r;
-	s->ipsec.rx.bufpayload = (p->ip_hl << 2);
-	s->ipsec.rx.bufsize = bufsize;
+	p->payload = (ip->ip_hl << 2);
 	return r;
 }
 
 /*
  * Decapsulate from an UDP packet
  */
-static int encap_udp_recv(struct sa_block *s, unsigned char *buf, unsigned int bufsize)
+static int encap_udp_recv(struct sa_block *s, struct pkt *p,
+	const struct sockaddr_in *from __attribute__((unused)))
 {
-	ssize_t r;
-
-	r = recv(s->esp_fd, buf, bufsize, 0);
-	if (r == -1) {
-		logmsg(LOG_ERR, "recvfrom: %m");
-		return -1;
-	}
-	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD && r > 8) {
-		r -= 8;
-		memmove(buf, buf + 8, r);
-	}
-	if( r == 1 && *buf == 0xff )
+	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD && p->len > 8)
+		pkt_pull(p, 8);
+	if( p->len == 1 && *p->data == 0xff )
 	{
 		DEBUGTOP(1, printf("UDP NAT keepalive packet received\n"));
 		return -1;
 	}
-	if (r < s->ipsec.em->fixed_header_size) {
-		logmsg(LOG_ALERT, "packet too short from %s. got %zd, expected %d",
-			inet_ntoa(s->dst), r, s->ipsec.em->fixed_header_size);
+	if ((int)p->len < s->ipsec.em->fixed_header_size) {
+		logmsg(LOG_ALERT, "packet too short from %s. got %u, expected %d",
+			inet_ntoa(s->dst), p->len, s->ipsec.em->fixed_header_size);
 		return -1;
 	}
 
-	s->ipsec.rx.buf = buf;
-	s->ipsec.rx.buflen = r;
-	s->ipsec.rx.bufpayload = 0;
-	s->ipsec.rx.bufsize = bufsize;
-	return r;
+	p->payload = 0;
+	return p->len;
 }
 
-/*
- * Decapsulate packet
- */
-static int encap_any_decap(struct sa_block *s)
+/* Shared by all tx workers like the sequence number, see esp_next_seq() */
+static uint16_t esp_next_ip_id(struct sa_block *s)
 {
-	s->ipsec.rx.buflen -= s->ipsec.rx.bufpayload + s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size;
-	s->ipsec.rx.buf    += s->ipsec.rx.bufpayload + s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size;
-	if (s->ipsec.rx.buflen == 0)
-		return 0;
-	return 1;
+	if (s->ipsec.shared)
+		return __sync_fetch_and_add(&s->ipsec.shared->ipsec.ip_id, 1);
+	return s->ipsec.ip_id++;
+}
+
+static struct esp_batch *esp_batch_new(struct sa_block *s, unsigned int max)
+{
+	struct esp_batch *b;
+
+	b = xallocc(sizeof(struct esp_batch));
+	b->pool = pkt_pool_new(MAX_BATCH, PKT_SIZE, opt_hugepages);
+	if (b->pool == NULL || pkt_ring_init(&b->crypt, MAX_BATCH) == -1
+		|| pkt_ring_init(&b->send, MAX_BATCH) == -1)
+		error(1, errno, "allocating packet buffers");
+	b->max = max;
+	b->limit = 1;
+	b->dstaddr.sin_family = AF_INET;
+	b->dstaddr.sin_addr = s->dst;
+	b->dstaddr.sin_port = 0;
+#ifdef HAVE_TUN_OFFLOAD
+	if (s->tun_vnet_hdr) {
+		b->gso_buf = xallocc(sizeof(struct virtio_net_hdr) + GSO_MAX_PACKET);
+		b->gro.buf = b->gso_buf + sizeof(struct virtio_net_hdr);
+	}
+#endif
+	return b;
 }
 
+static void esp_batch_free(struct esp_batch *b)
+{
+	if (b == NULL)
+		return;
+	free(b->gso_buf);
+	pkt_ring_free(&b->crypt);
+	pkt_ring_free(&b->send);
+	pkt_pool_free(b->pool);
+	free(b);
+}
+
+#ifdef HAVE_UDP_GSO
 /*
- * Send decapsulated packet to tunnel device
+ * Let the kernel split and coalesce UDP encapsulated ESP packets.
+ * The io_uring path receives into packet sized buffers, so no GRO there.
  */
-static int tun_send_ip(struct sa_block *s)
+static void esp_batch_udp_offload(struct sa_block *s)
 {
-	int sent, len;
-	uint8_t *start;
+	struct esp_batch *rxb = s->ipsec.rxb;
+	struct pkt_pool *pool;
+	int v = 1;
+	socklen_t len = sizeof(v);
+
+	if (getsockopt(s->esp_fd, SOL_UDP, UDP_SEGMENT, &v, &len) == 0)
+		s->ipsec.txb->udp_gso = 1;
+
+	v = 1;
+	if (!opt_io_uring && (pool = pkt_pool_new(UDP_GRO_SLOTS, UDP_GRO_SLOT_SIZE, opt_hugepages)) != NULL) {
+		if (setsockopt(s->esp_fd, SOL_UDP, UDP_GRO, &v, sizeof(v)) == 0) {
+			pkt_pool_free(rxb->pool);
+			rxb->pool = pool;
+			rxb->udp_gro = 1;
+			rxb->max = MIN(rxb->max, UDP_GRO_SLOTS);
+			rxb->limit = MIN(rxb->limit, rxb->max);
+		} else
+			pkt_pool_free(pool);
+	}
+	DEBUG(2, printf("UDP segmentation offload %s, receive offload %s\n",
+		s->ipsec.txb->udp_gso ? "on" : "off", rxb->udp_gro ? "on" : "off"));
+}
 
-	start = s->ipsec.rx.buf;
-	len   = s->ipsec.rx.buflen;
+/* Packet size within a received UDP GRO train, 0 for a single packet */
+static unsigned int esp_batch_gro_seg(struct msghdr *msg, unsigned int len)
+{
+	struct cmsghdr *cm;
+	int seg;
 
-	if (opt_if_mode == IF_MODE_TAP) {
-#ifndef __sun__
-		/*
-		 * Add ethernet header before s->ipsec.rx.buf where
-		 * at least ETH_HLEN bytes should be available.
-		 */
-		struct ether_header *eth_hdr = (struct ether_header *) (s->ipsec.rx.buf - ETH_HLEN);
+	for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+			return (seg > 0 && (unsigned int)seg < len) ? (unsigned int)seg : 0;
+		}
+	}
+	return 0;
+}
 
-		memcpy(eth_hdr->ether_dhost, s->tun_hwaddr, ETH_ALEN);
-		memcpy(eth_hdr->ether_shost, s->tun_hwaddr, ETH_ALEN);
+/*
+ * Send the queued packets as trains of equal sized packets, each train
+ * a single UDP_SEGMENT message (its last packet may be shorter).
+ * Returns the number of packets handed to the kernel, the rest is
+ * left to the plain path.
+ */
+static unsigned int esp_batch_flush_gso(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	struct msghdr *msg;
+	struct cmsghdr *cm;
+	unsigned int first[MAX_BATCH];
+	unsigned int i, j, m, k, total;
+	uint16_t segsize;
+	int sent;
+
+	for (i = 0, m = 0; i < b->count; i = j, m++) {
+		total = b->pkt[i]->len;
+		for (j = i + 1; j < b->count && j - i < UDP_GSO_MAX_SEGS
+			&& b->pkt[j]->len <= b->pkt[i]->len && total + b->pkt[j]->len <= UDP_GSO_MAX_SIZE; j++) {
+			total += b->pkt[j]->len;
+			if (b->pkt[j]->len < b->pkt[i]->len) {
+				j++;
+				break;
+			}
+		}
 
-		/* Use a different MAC as source */
-		eth_hdr->ether_shost[0] ^= 0x80; /* toggle some visible bit */
-		eth_hdr->ether_type = htons(ETHERTYPE_IP);
+		for (k = i; k < j; k++) {
+			b->iov[k].iov_base = b->pkt[k]->data;
+			b->iov[k].iov_len = b->pkt[k]->len;
+		}
+		msg = &b->msg[m].msg_hdr;
+		memset(msg, 0, sizeof(struct msghdr));
+		msg->msg_iov = &b->iov[i];
+		msg->msg_iovlen = j - i;
+		if (j - i > 1) {
+			msg->msg_control = b->ctrl[m].buf;
+			msg->msg_controllen = CMSG_SPACE(sizeof(segsize));
+			cm = CMSG_FIRSTHDR(msg);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(segsize));
+			segsize = b->pkt[i]->len;
+			memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+		}
+		first[m] = i;
+	}
 
-		start = (uint8_t *) eth_hdr;
-		len += ETH_HLEN;
-#endif
+	for (k = 0; k < m; k += sent) {
+		sent = sendmmsg(s->esp_fd, b->msg + k, m - k, 0);
+		if (sent == -1) {
+			if (errno == EIO) {
+				/* no checksum offload on the route, no software fallback either */
+				logmsg(LOG_WARNING, "UDP segmentation offload not usable, disabled");
+				b->udp_gso = 0;
+			}
+			return first[k];
+		}
 	}
+	return b->count;
+}
+#endif
 
-	sent = tun_write(s->tun_fd, start, len);
-	if (sent != len)
-		logmsg(LOG_ERR, "truncated in: %d -> %d\n", len, sent);
-	hex_dump("Tx pkt", start, len, NULL);
-	return 1;
+/*
+ * Room to keep in front of packets received from the peer, for what
+ * tun_frame_ip() puts in front of them
+ */
+static unsigned int tun_headroom(struct sa_block *s)
+{
+	if (opt_if_mode == IF_MODE_TAP)
+		return ETH_HLEN;
+#ifdef HAVE_TUN_OFFLOAD
+	if (s->tun_vnet_hdr)
+		return sizeof(struct virtio_net_hdr);
+#else
+	(void)s;
+#endif
+	return 0;
+}
+
+/*
+ * Adapt the batch size to the load: grow it while batches fill up and
+ * shrink it again once traffic calms down, so that a single packet
+ * is never held back waiting for others.
+ */
+static void esp_batch_adapt(struct esp_batch *b, unsigned int handled)
+{
+	if (handled >= b->limit)
+		b->limit = MIN(b->limit * 2, b->max);
+	else if (handled < b->limit / 2)
+		b->limit = MAX(b->limit / 2, 1);
 }
 
 /*
- * Compute HMAC for an arbitrary stream of bytes
+ * Queue an encapsulated packet for the peer, esp_batch_flush() sends it.
+ * There is always room: the ring holds as many packets as the pool.
  */
-static int hmac_compute(int md_algo,
-	const unsigned char *data, unsigned int data_size,
-	unsigned char *digest, unsigned char do_store,
-	const unsigned char *secret, unsigned short secret_size)
+static void esp_batch_queue(struct sa_block *s, struct pkt *p, int to_dst)
 {
-	gcry_md_hd_t md_ctx;
+	struct esp_batch *b = s->ipsec.txb;
 	int ret;
-	unsigned char *hmac_digest;
-	unsigned int hmac_len;
 
-	/* See RFC 2104 */
-	gcry_md_open(&md_ctx, md_algo, GCRY_MD_FLAG_HMAC);
-	assert(md_ctx != NULL);
-	ret = gcry_md_setkey(md_ctx, secret, secret_size);
+	b->to_dst = to_dst;
+	ret = pkt_ring_push(&b->send, p);
 	assert(ret == 0);
-	gcry_md_write(md_ctx, data, data_size);
-	gcry_md_final(md_ctx);
-	hmac_digest = gcry_md_read(md_ctx, 0);
-	hmac_len = 12; /*gcry_md_get_algo_dlen(md_algo); see RFC .. only use 96 bit */
-
-	if (do_store) {
-		memcpy(digest, hmac_digest, hmac_len);
-		ret = 0;
-	} else
-		ret = memcmp(digest, hmac_digest, hmac_len);
-
-	gcry_md_close(md_ctx);
-	return ret;
 }
 
 /*
- * Encapsulate a packet in ESP
+ * Send all queued packets to the peer, with a single syscall if possible
  */
-static void encap_esp_encapsulate(struct sa_block *s)
+static void esp_batch_flush(struct sa_block *s)
 {
-	esp_encap_header_t *eh;
-	unsigned char *iv, *cleartext;
-	size_t i, padding, pad_blksz;
-	unsigned int cleartextlen;
+	struct esp_batch *b = s->ipsec.txb;
+	struct pkt *p;
+	unsigned int i, start = 0;
+#ifdef HAVE_MMSG
+	int sent, j;
+#endif
+
+	while (b->count < MAX_BATCH && (p = pkt_ring_pop(&b->send)) != NULL)
+		b->pkt[b->count++] = p;
 
-	/*
-	 * Add padding as necessary
-	 *
-	 * done: this should be checked, RFC 2406 section 2.4 is quite
-	 *      obscure on that point.
-	 * seems fine
-	 */
-	pad_blksz = s->ipsec.blk_len;
-	while (pad_blksz & 3) /* must be multiple of 4 */
-		pad_blksz <<= 1;
-	padding = pad_blksz - ((s->ipsec.tx.buflen + 2 - s->ipsec.tx.var_header_size - s->ipsec.tx.bufpayload) % pad_blksz);
-	DEBUG(3, printf("sending packet: len = %d, padding = %lu\n", s->ipsec.tx.buflen, (unsigned long)padding));
-	if (padding == pad_blksz)
-		padding = 0;
+#ifdef HAVE_MMSG
+#ifdef HAVE_UDP_GSO
+	if (b->udp_gso && !b->to_dst && b->count > 1)
+		start = esp_batch_flush_gso(s);
+#endif
 
-	for (i = 1; i <= padding; i++) {
-		s->ipsec.tx.buf[s->ipsec.tx.buflen] = i;
-		s->ipsec.tx.buflen++;
+	for (i = start; i < b->count; i++) {
+		b->iov[i].iov_base = b->pkt[i]->data;
+		b->iov[i].iov_len = b->pkt[i]->len;
+		memset(&b->msg[i].msg_hdr, 0, sizeof(struct msghdr));
+		b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msg[i].msg_hdr.msg_iovlen = 1;
+		if (b->to_dst) {
+			b->msg[i].msg_hdr.msg_name = &b->dstaddr;
+			b->msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
 	}
 
-	/* Add trailing padlen and next_header */
-	s->ipsec.tx.buf[s->ipsec.tx.buflen++] = padding;
-	s->ipsec.tx.buf[s->ipsec.tx.buflen++] = IPPROTO_IPIP;
+	for (i = start; i < b->count; i += sent) {
+		sent = sendmmsg(s->esp_fd, b->msg + i, b->count - i, 0);
+		if (sent == -1) {
+			logmsg(LOG_ERR, "esp sendmmsg: %m");
+			sent = 1; /* drop the failing packet, retry the rest */
+			continue;
+		}
+		for (j = i; j < (int)i + sent; j++)
+			if (b->msg[j].msg_len != b->pkt[j]->len)
+				logmsg(LOG_ALERT, "esp truncated out (%u out of %u)",
+					b->msg[j].msg_len, b->pkt[j]->len);
+	}
+#else
+	ssize_t sent;
 
-	cleartext = s->ipsec.tx.buf + s->ipsec.tx.var_header_size + s->ipsec.tx.bufpayload;
-	cleartextlen = s->ipsec.tx.buflen - s->ipsec.tx.var_header_size - s->ipsec.tx.bufpayload;
+	for (i = start; i < b->count; i++) {
+		sent = sendto(s->esp_fd, b->pkt[i]->data, b->pkt[i]->len, 0,
+			b->to_dst ? (struct sockaddr *)&b->dstaddr : NULL,
+			b->to_dst ? sizeof(struct sockaddr_in) : 0);
+		if (sent == -1) {
+			logmsg(LOG_ERR, "esp sendto: %m");
+			continue;
+		}
+		if (sent != b->pkt[i]->len)
+			logmsg(LOG_ALERT, "esp truncated out (%lld out of %u)",
+				(long long)sent, b->pkt[i]->len);
+	}
+#endif
+	for (i = 0; i < b->count; i++)
+		pkt_free(b->pkt[i]);
+	b->count = 0;
+}
 
-	eh = (esp_encap_header_t *) (s->ipsec.tx.buf + s->ipsec.tx.bufpayload);
-	eh->spi = s->ipsec.tx.spi;
-	eh->seq_id = htonl(s->ipsec.tx.seq_id++);
+/*
+ * Receive up to b->limit packets from the peer without blocking.
+ * Returns the number of packets received.
+ */
+static unsigned int esp_batch_recv(struct sa_block *s, struct esp_batch *b)
+{
+	unsigned int i, offset = tun_headroom(s);
+#ifdef HAVE_MMSG
+	int r;
+#endif
 
-	/* Copy initialization vector in packet */
-	iv = (unsigned char *)(eh + 1);
-	gcry_create_nonce(iv, s->ipsec.iv_len);
-	hex_dump("iv", iv, s->ipsec.iv_len, NULL);
+	/* the buffers stay with their slot */
+	for (i = 0; i < b->limit; i++) {
+		if (b->pkt[i] == NULL)
+			b->pkt[i] = pkt_alloc(b->pool, offset);
+		else
+			pkt_reset(b->pkt[i], offset);
+	}
 
-	hex_dump("sending ESP packet (before crypt)", s->ipsec.tx.buf, s->ipsec.tx.buflen, NULL);
+#ifdef HAVE_MMSG
+	for (i = 0; i < b->limit; i++) {
+		b->iov[i].iov_len = pkt_tailroom(b->pkt[i]);
+		memset(&b->msg[i].msg_hdr, 0, sizeof(struct msghdr));
+#ifdef HAVE_UDP_GSO
+		if (b->udp_gro) {
+			b->msg[i].msg_hdr.msg_control = b->ctrl[i].buf;
+			b->msg[i].msg_hdr.msg_controllen = sizeof(b->ctrl[i].buf);
+		}
+#endif
+		b->iov[i].iov_base = b->pkt[i]->data;
+		b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+		b->msg[i].msg_hdr.msg_iovlen = 1;
+		b->msg[i].msg_hdr.msg_name = &b->from[i];
+		b->msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
 
-	if (s->ipsec.cry_algo) {
-		gcry_cipher_setiv(s->ipsec.tx.cry_ctx, iv, s->ipsec.iv_len);
-		gcry_cipher_encrypt(s->ipsec.tx.cry_ctx, cleartext, cleartextlen, NULL, 0);
+	r = recvmmsg(s->esp_fd, b->msg, b->limit, MSG_DONTWAIT, NULL);
+	if (r == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logmsg(LOG_ERR, "recvmmsg: %m");
+		return 0;
 	}
 
-	hex_dump("sending ESP packet (after crypt)", s->ipsec.tx.buf, s->ipsec.tx.buflen, NULL);
+	for (i = 0; i < (unsigned int)r; i++) {
+		b->pkt[i]->len = b->msg[i].msg_len;
+		b->seg[i] = 0;
+#ifdef HAVE_UDP_GSO
+		if (b->udp_gro)
+			b->seg[i] = esp_batch_gro_seg(&b->msg[i].msg_hdr, b->pkt[i]->len);
+#endif
+	}
+	return r;
+#else
+	ssize_t r;
+	socklen_t fromlen = sizeof(struct sockaddr_in);
 
-	/* Handle optional authentication field */
-	if (s->ipsec.md_algo) {
-		hmac_compute(s->ipsec.md_algo,
-			s->ipsec.tx.buf + s->ipsec.tx.bufpayload,
-			s->ipsec.tx.var_header_size + cleartextlen,
-			s->ipsec.tx.buf + s->ipsec.tx.bufpayload
-			+ s->ipsec.tx.var_header_size + cleartextlen,
-			1, s->ipsec.tx.key_md, s->ipsec.md_len);
-		s->ipsec.tx.buflen += 12; /*gcry_md_get_algo_dlen(md_algo); see RFC .. only use 96 bit */
-		hex_dump("sending ESP packet (after ah)", s->ipsec.tx.buf, s->ipsec.tx.buflen, NULL);
+	r = recvfrom(s->esp_fd, b->pkt[0]->data, pkt_tailroom(b->pkt[0]), 0,
+		(struct sockaddr *)&b->from[0], &fromlen);
+	if (r == -1) {
+		logmsg(LOG_ERR, "recvfrom: %m");
+		return 0;
 	}
+	b->pkt[0]->len = r;
+	b->seg[0] = 0;
+	return 1;
+#endif
 }
 
 /*
- * Encapsulate a packet in IP ESP and send to the peer.
- * "buf" should have exactly MAX_HEADER free bytes at its beginning
- * to account for encapsulation data (not counted in "size").
+ * Decapsulate packet
  */
-static void encap_esp_send_peer(struct sa_block *s, unsigned char *buf, unsigned int bufsize)
+static int encap_any_decap(struct sa_block *s, struct pkt *p)
 {
-	ssize_t sent;
-	struct ip *tip, ip;
-	struct sockaddr_in dstaddr;
-
-	buf += MAX_HEADER;
+	pkt_pull(p, p->payload + s->ipsec.em->fixed_header_size + p->var_header_size);
+	if (p->len == 0)
+		return 0;
+	return 1;
+}
 
-	/* Keep a pointer to the old IP header */
-	tip = (struct ip *)buf;
+/*
+ * Prepare the decapsulated packet for the tunnel device, adding an
+ * ethernet header in tap mode. Returns the frame length.
+ */
+static int tun_frame_ip(struct sa_block *s, struct pkt *p, uint8_t **frame)
+{
+	int len;
+	uint8_t *start;
 
-	s->ipsec.tx.buf = buf;
-	s->ipsec.tx.buflen = bufsize;
+	start = p->data;
+	len   = p->len;
 
-	/* Prepend our encapsulation header and new IP header */
-	s->ipsec.tx.var_header_size = (s->ipsec.em->fixed_header_size + s->ipsec.iv_len);
+	if (opt_if_mode == IF_MODE_TAP) {
+#ifndef __sun__
+		/*
+		 * Add ethernet header in the headroom, where
+		 * at least ETH_HLEN bytes should be available.
+		 */
+		struct ether_header *eth_hdr = (struct ether_header *) (p->data - ETH_HLEN);
 
-	s->ipsec.tx.buf -= sizeof(struct ip) + s->ipsec.tx.var_header_size;
-	s->ipsec.tx.buflen += sizeof(struct ip) + s->ipsec.tx.var_header_size;
+		memcpy(eth_hdr->ether_dhost, s->tun_hwaddr, ETH_ALEN);
+		memcpy(eth_hdr->ether_shost, s->tun_hwaddr, ETH_ALEN);
 
-	s->ipsec.tx.bufpayload = sizeof(struct ip);
+		/* Use a different MAC as source */
+		eth_hdr->ether_shost[0] ^= 0x80; /* toggle some visible bit */
+		eth_hdr->ether_type = htons(ETHERTYPE_IP);
 
-	/* Fill non-mutable fields */
-	ip.ip_v = IPVERSION;
-	ip.ip_hl = 5;
-	/*gcry_md_get_algo_dlen(md_algo); see RFC .. only use 96 bit */
-	ip.ip_id = htons(s->ipsec.ip_id++);
-	ip.ip_p = IPPROTO_ESP;
-	ip.ip_src = s->src;
-	ip.ip_dst = s->dst;
+		start = (uint8_t *) eth_hdr;
+		len += ETH_HLEN;
+#endif
+	}
+#ifdef HAVE_TUN_OFFLOAD
+	if (s->tun_vnet_hdr) {
+		/* a plain packet, checksums complete */
+		start -= sizeof(struct virtio_net_hdr);
+		len += sizeof(struct virtio_net_hdr);
+		memset(start, 0, sizeof(struct virtio_net_hdr));
+	}
+#endif
 
-	/* Fill mutable fields */
-	ip.ip_tos = (bufsize < sizeof(struct ip)) ? 0 : tip->ip_tos;
-	ip.ip_off = 0;
-	ip.ip_ttl = IPDEFTTL;
-	ip.ip_sum = 0;
+	*frame = start;
+	return len;
+}
 
-	encap_esp_encapsulate(s);
+/*
+ * Send decapsulated packet to tunnel device
+ */
+static int tun_send_ip(struct sa_block *s, struct pkt *p)
+{
+	int sent, len;
+	uint8_t *start;
 
-	ip.ip_len = s->ipsec.tx.buflen;
-#ifdef NEED_IPLEN_FIX
-	ip.ip_len = htons(ip.ip_len);
-#endif
-	ip.ip_sum = in_cksum((u_short *) s->ipsec.tx.buf, sizeof(struct ip));
+	len = tun_frame_ip(s, p, &start);
+	sent = tun_write(s->tun_fd, start, len);
+	if (sent != len)
+		logmsg(LOG_ERR, "truncated in: %d -> %d\n", len, sent);
+	hex_dump("Tx pkt", start, len, NULL);
+	return 1;
+}
 
-	memcpy(s->ipsec.tx.buf, &ip, sizeof ip);
+/*
+ * Write out the super-packet coalesced so far, if any
+ */
+static void tun_flush(struct sa_block *s)
+{
+#ifdef HAVE_TUN_OFFLOAD
+	struct esp_batch *b = s->ipsec.rxb;
+	int sent, len;
 
-	dstaddr.sin_family = AF_INET;
-	dstaddr.sin_addr = s->dst;
-	dstaddr.sin_port = 0;
-	sent = sendto(s->esp_fd, s->ipsec.tx.buf, s->ipsec.tx.buflen, 0, (struct sockaddr *)&dstaddr, sizeof(struct sockaddr_in));
-	if (sent == -1) {
-		logmsg(LOG_ERR, "esp sendto: %m");
+	if (b->gro.len == 0)
 		return;
-	}
-	if (sent != s->ipsec.tx.buflen)
-		logmsg(LOG_ALERT, "esp truncated out (%lld out of %d)", (long long)sent, s->ipsec.tx.buflen);
+
+	len = gro_finish(&b->gro, (struct virtio_net_hdr *)b->gso_buf)
+		+ sizeof(struct virtio_net_hdr);
+	sent = tun_write(s->tun_fd, b->gso_buf, len);
+	if (sent != len)
+		logmsg(LOG_ERR, "truncated in: %d -> %d\n", len, sent);
+	hex_dump("Tx pkt", b->gso_buf, len, NULL);
+#else
+	(void)s;
+#endif
 }
 
 /*
- * Encapsulate a packet in UDP ESP and send to the peer.
- * "buf" should have exactly MAX_HEADER free bytes at its beginning
- * to account for encapsulation data (not counted in "size").
+ * Send the decapsulated packet to the tunnel device. With vnet headers
+ * TCP segments of a flow received in one batch are coalesced into a
+ * super-packet first, handed to the kernel by tun_flush().
  */
-static void encap_udp_send_peer(struct sa_block *s, unsigned char *buf, unsigned int bufsize)
+static void tun_deliver(struct sa_block *s, struct pkt *p)
 {
-	ssize_t sent;
-
-	buf += MAX_HEADER;
-
-	s->ipsec.tx.buf = buf;
-	s->ipsec.tx.buflen = bufsize;
+#ifdef HAVE_TUN_OFFLOAD
+	struct gro *g = &s->ipsec.rxb->gro;
+	int r;
+
+	if (s->tun_vnet_hdr) {
+		r = gro_add(g, p->data, p->len);
+		if (r == GRO_NO && g->len) {
+			tun_flush(s);
+			r = gro_add(g, p->data, p->len);
+		}
+		if (r == GRO_FLUSH)
+			tun_flush(s);
+		if (r != GRO_NO)
+			return;
+	}
+#endif
+	tun_send_ip(s, p);
+}
 
-	/* Prepend our encapsulation header and new IP header */
-	s->ipsec.tx.var_header_size = (s->ipsec.em->fixed_header_size + s->ipsec.iv_len);
+/*
+ * SAs are swapped read-copy-update style. The main thread negotiates the
+ * keys and publishes them as a new set with a single pointer store; the
+ * data path threads pick the set up between batches and key contexts of
+ * their own for it. A replaced set is retired and freed once every
+ * thread has moved past it.
+ *
+ * Each data path thread other than the main one has a slot here with the
+ * epoch of the set it synced to last. It syncs only when it has no
+ * packets in flight, so nothing older is in use anymore. The crypto
+ * workers don't need one: they only use the SAs of the packets handed
+ * to them, which are in flight for the thread that did. 0: free slot.
+ */
+#define ESP_MAX_READERS (MAX_TUN_QUEUES + 1)
 
-	s->ipsec.tx.buf -= s->ipsec.tx.var_header_size;
-	s->ipsec.tx.buflen += s->ipsec.tx.var_header_size;
+static unsigned int esp_reader_epoch[ESP_MAX_READERS];
+static struct esp_sa_set *esp_retired; /* main thread only */
+static unsigned int esp_sa_ids;
 
-	s->ipsec.tx.bufpayload = 0;
+static struct esp_sa *esp_sa_new(struct sa_block *s, const struct ike_sa *n)
+{
+	size_t len = s->ipsec.key_len + s->ipsec.salt_len + s->ipsec.md_len;
+	struct esp_sa *sa;
+
+	sa = xallocc(sizeof(struct esp_sa));
+	sa->spi = n->spi;
+	sa->seq_id = 1;
+	sa->key = xallocc(len);
+	memcpy(sa->key, n->key, len);
+	sa->id = ++esp_sa_ids;
+	sa->refs = 1;
+	return sa;
+}
 
-	encap_esp_encapsulate(s);
+/* The outer IP header of packets sent on sa, all but the per packet fields */
+static void esp_sa_ip_template(struct sa_block *s, struct esp_sa *sa)
+{
+	struct ip *ip = &sa->ip;
+
+	memset(ip, 0, sizeof(struct ip));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = 5;
+	ip->ip_ttl = IPDEFTTL;
+	ip->ip_p = IPPROTO_ESP;
+	ip->ip_src = s->src;
+	ip->ip_dst = s->dst;
+	ip->ip_sum = in_cksum(ip, sizeof(struct ip));
+}
 
-	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD) {
-		s->ipsec.tx.buf -= 8;
-		s->ipsec.tx.buflen += 8;
-		memset(s->ipsec.tx.buf, 0, 8);
-	}
+/*
+ * CBC needs IVs the sender of the next packet can't predict (RFC 3602,
+ * 3). Pulling them from the random pool costs a lock and a pool mix
+ * per packet; encrypting the sequence number, which never repeats,
+ * under a key of our own is as good and a single block operation.
+ */
+static void esp_sa_iv_key(struct sa_block *s, struct esp_sa *sa)
+{
+	if (ESP_AEAD(s) || !s->ipsec.cry_algo || !s->ipsec.iv_len)
+		return;
+	assert(s->ipsec.iv_len == s->ipsec.blk_len && s->ipsec.iv_len <= 16);
+	sa->iv_key = xallocc(s->ipsec.key_len);
+	gcry_randomize(sa->iv_key, s->ipsec.key_len, GCRY_STRONG_RANDOM);
+}
 
-	sent = send(s->esp_fd, s->ipsec.tx.buf, s->ipsec.tx.buflen, 0);
-	if (sent == -1) {
-		logmsg(LOG_ERR, "udp sendto: %m");
+static void esp_sa_put(struct esp_sa *sa)
+{
+	if (sa == NULL || --sa->refs > 0)
 		return;
-	}
-	if (sent != s->ipsec.tx.buflen)
-		logmsg(LOG_ALERT, "udp truncated out (%lld out of %d)",
-			(long long)sent, s->ipsec.tx.buflen);
+	free(sa->iv_key);
+	free(sa->key);
+	free(sa);
 }
 
-static int encap_esp_recv_peer(struct sa_block *s)
+static void esp_sa_set_free(struct esp_sa_set *set)
 {
-	int len, i;
-	size_t blksz;
-	unsigned char padlen, next_header;
-	unsigned char *pad;
-	unsigned char *iv;
+	int i;
 
-	s->ipsec.rx.var_header_size = s->ipsec.iv_len;
-	iv = s->ipsec.rx.buf + s->ipsec.rx.bufpayload + s->ipsec.em->fixed_header_size;
+	esp_sa_put(set->tx);
+	for (i = 0; i < set->nrx; i++)
+		esp_sa_put(set->rx[i]);
+	free(set);
+}
 
-	len = s->ipsec.rx.buflen - s->ipsec.rx.bufpayload - s->ipsec.em->fixed_header_size - s->ipsec.rx.var_header_size;
+/* Add an inbound SA to a set under construction */
+static void esp_sa_set_add_rx(struct esp_sa_set *set, struct esp_sa *sa, time_t until)
+{
+	unsigned int h;
+
+	for (h = esp_spi_hash(sa->spi); set->rx_hash[h]; h = (h + 1) & (ESP_RX_HASH - 1))
+		;
+	set->rx[set->nrx] = sa;
+	set->rx_until[set->nrx] = until;
+	set->rx_hash[h] = ++set->nrx;
+	sa->refs++;
+}
 
-	if (len < 0) {
-		logmsg(LOG_ALERT, "Packet too short");
-		return -1;
+/*
+ * A new set with tx, rx as the current inbound SA and those of the
+ * current set whose grace period isn't over yet
+ */
+static struct esp_sa_set *esp_sa_set_new(struct sa_block *s, struct esp_sa *tx, struct esp_sa *rx,
+	time_t now)
+{
+	struct esp_sa_set *cur = s->ipsec.sas, *set;
+	int i;
+
+	set = xallocc(sizeof(struct esp_sa_set));
+	set->tx = tx;
+	tx->refs++;
+	esp_sa_set_add_rx(set, rx, 0);
+	for (i = 0; cur && i < cur->nrx && set->nrx < ESP_RX_SAS; i++) {
+		if (cur->rx[i] == rx)
+			continue;
+		if (i == 0 && opt_sa_grace)
+			esp_sa_set_add_rx(set, cur->rx[i], now + opt_sa_grace);
+		else if (i > 0 && now < cur->rx_until[i])
+			esp_sa_set_add_rx(set, cur->rx[i], cur->rx_until[i]);
 	}
+	return set;
+}
 
-	/* Handle optional authentication field */
-	if (s->ipsec.md_algo) {
-		len -= 12; /*gcry_md_get_algo_dlen(peer->local_sa->md_algo); */
-		s->ipsec.rx.buflen -= 12;
-		if (hmac_compute(s->ipsec.md_algo,
-				s->ipsec.rx.buf + s->ipsec.rx.bufpayload,
-				s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size + len,
-				s->ipsec.rx.buf + s->ipsec.rx.bufpayload
-				+ s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size + len,
-				0,
-				s->ipsec.rx.key_md,
-				s->ipsec.md_len) != 0) {
-			logmsg(LOG_ALERT, "HMAC mismatch in ESP mode");
-			return -1;
-		}
-	}
+/* Make set the one in use and retire the one it replaces */
+static void esp_sa_replace(struct sa_block *s, struct esp_sa_set *set)
+{
+	struct esp_sa_set *old = s->ipsec.sas;
 
-	blksz = s->ipsec.blk_len;
-	if (s->ipsec.cry_algo && ((len % blksz) != 0)) {
-		logmsg(LOG_ALERT,
-			"payload len %d not a multiple of algorithm block size %lu", len,
-			(unsigned long)blksz);
-		return -1;
+	set->epoch = old ? old->epoch + 1 : 1;
+	__atomic_store_n(&s->ipsec.sas, set, __ATOMIC_RELEASE);
+	if (old) {
+		old->next = esp_retired;
+		esp_retired = old;
 	}
+}
 
-	hex_dump("receiving ESP packet (before decrypt)",
-		&s->ipsec.rx.buf[s->ipsec.rx.bufpayload + s->ipsec.em->fixed_header_size +
-			 s->ipsec.rx.var_header_size], len, NULL);
-
-	if (s->ipsec.cry_algo) {
-		unsigned char *data;
+/*
+ * Put the keys just negotiated in s->ipsec.rx and tx into use. The inbound
+ * SA they replace stays valid for opt_sa_grace seconds, for the packets
+ * the peer sent before it switched over. Main thread only.
+ */
+void esp_sa_publish(struct sa_block *s)
+{
+	static int chosen;
+	struct esp_sa *tx, *rx;
+	struct esp_sa_set *set;
 
-		data = (s->ipsec.rx.buf + s->ipsec.rx.bufpayload
-			+ s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size);
-		gcry_cipher_setiv(s->ipsec.rx.cry_ctx, iv, s->ipsec.iv_len);
-		gcry_cipher_decrypt(s->ipsec.rx.cry_ctx, data, len, NULL, 0);
+	if (!chosen) {
+		esp_provider_choose(s);
+		chosen = 1;
 	}
+	tx = esp_sa_new(s, &s->ipsec.tx);
+	esp_sa_ip_template(s, tx);
+	esp_sa_iv_key(s, tx);
+	rx = esp_sa_new(s, &s->ipsec.rx);
+	set = esp_sa_set_new(s, tx, rx, time(NULL));
+	esp_sa_put(tx);
+	esp_sa_put(rx);
+	esp_sa_replace(s, set);
+
+	hex_dump("rx.key_cry", rx->key, s->ipsec.key_len, NULL);
+	hex_dump("rx.key_md", rx->key + s->ipsec.key_len + s->ipsec.salt_len, s->ipsec.md_len, NULL);
+	hex_dump("tx.key_cry", tx->key, s->ipsec.key_len, NULL);
+	hex_dump("tx.key_md", tx->key + s->ipsec.key_len + s->ipsec.salt_len, s->ipsec.md_len, NULL);
+
+#ifdef HAVE_XFRM
+	if (s->ipsec.kernel && xfrm_update(s) == -1)
+		logmsg(LOG_ERR, "can't install the new SAs in the kernel: %m");
+#endif
+}
 
-	hex_dump("receiving ESP packet (after decrypt)",
-		&s->ipsec.rx.buf[s->ipsec.rx.bufpayload + s->ipsec.em->fixed_header_size +
-			s->ipsec.rx.var_header_size], len, NULL);
-
-	padlen = s->ipsec.rx.buf[s->ipsec.rx.bufpayload
-		+ s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size + len - 2];
-	next_header = s->ipsec.rx.buf[s->ipsec.rx.bufpayload
-		+ s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size + len - 1];
+/* Stop accepting replaced inbound SAs once their grace period is over */
+static void esp_sa_expire(struct sa_block *s)
+{
+	struct esp_sa_set *cur = s->ipsec.sas;
+	time_t now;
+	int i;
 
-	if (padlen + 2 > len) {
-		logmsg(LOG_ALERT, "Inconsistent padlen");
-		return -1;
-	}
-	if (next_header != IPPROTO_IPIP) {
-		logmsg(LOG_ALERT, "Inconsistent next_header %d", next_header);
-		return -1;
-	}
-	DEBUG(3, printf("pad len: %d, next_header: %d\n", padlen, next_header));
+	if (cur->nrx == 1)
+		return;
+	now = time(NULL);
+	for (i = 1; i < cur->nrx; i++)
+		if (now >= cur->rx_until[i])
+			break;
+	if (i == cur->nrx)
+		return;
 
-	len -= padlen + 2;
-	s->ipsec.rx.buflen -= padlen + 2;
+	esp_sa_replace(s, esp_sa_set_new(s, cur->tx, cur->rx[0], now));
+	DEBUG(2, printf("inbound SA %#08x expired\n", ntohl(cur->rx[i]->spi)));
+}
 
-	/* Check padding */
-	pad = s->ipsec.rx.buf + s->ipsec.rx.bufpayload
-		+ s->ipsec.em->fixed_header_size + s->ipsec.rx.var_header_size + len;
-	for (i = 1; i <= padlen; i++) {
-		if (*pad != i) {
-			logmsg(LOG_ALERT, "Bad padding");
-			return -1;
-		}
-		pad++;
+/* Free the retired sets no thread can be using anymore */
+static void esp_sa_reclaim(void)
+{
+	struct esp_sa_set **pp, *set;
+	unsigned int oldest = UINT_MAX, epoch;
+	int i;
+
+	for (i = 0; i < ESP_MAX_READERS; i++) {
+		epoch = __atomic_load_n(&esp_reader_epoch[i], __ATOMIC_ACQUIRE);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+	for (pp = &esp_retired; (set = *pp) != NULL;) {
+		if (set->epoch < oldest) {
+			*pp = set->next;
+			esp_sa_set_free(set);
+		} else
+			pp = &set->next;
 	}
-
-	return 0;
 }
 
-static void encap_esp_new(struct encap_method *encap)
+static void esp_ctx_sync(struct sa_block *s, struct esp_ctx *ctx, struct esp_sa *sa, int rx)
+{
+	if (ctx->id == (sa ? sa->id : 0))
+		return;
+	esp_ctx_setkey(s, ctx, sa);
+	if (rx)
+		replay_reset(&ctx->replay);
+}
+
+/*
+ * The inbound SAs keep their contexts and replay windows when they move
+ * to another place in the set, the ones new to this thread get the
+ * contexts of those that are gone.
+ */
+static void esp_sa_sync_rx(struct sa_block *s, struct esp_sa_set *set)
+{
+	struct esp_ctx old[ESP_RX_SAS];
+	int taken[ESP_RX_SAS], placed[ESP_RX_SAS];
+	int i, j;
+
+	memcpy(old, s->ipsec.rx_ctx, sizeof(old));
+	memset(taken, 0, sizeof(taken));
+	memset(placed, 0, sizeof(placed));
+	for (i = 0; i < set->nrx; i++)
+		for (j = 0; j < ESP_RX_SAS; j++)
+			if (!taken[j] && old[j].id == set->rx[i]->id) {
+				s->ipsec.rx_ctx[i] = old[j];
+				taken[j] = placed[i] = 1;
+				break;
+			}
+	for (i = 0, j = 0; i < ESP_RX_SAS; i++) {
+		if (placed[i])
+			continue;
+		while (taken[j])
+			j++;
+		s->ipsec.rx_ctx[i] = old[j];
+		taken[j] = 1;
+		esp_ctx_sync(s, &s->ipsec.rx_ctx[i], i < set->nrx ? set->rx[i] : NULL, 1);
+	}
+}
+
+/*
+ * Key the contexts of this thread for the set published last. Called
+ * between batches, when the thread has no packets in flight, which lets
+ * the sets it used before go.
+ */
+static void esp_sa_sync(struct sa_block *s)
+{
+	struct sa_block *owner = s->ipsec.shared ? s->ipsec.shared : s;
+	struct esp_sa_set *set;
+
+	if (owner == s)
+		esp_sa_expire(s);
+	set = __atomic_load_n(&owner->ipsec.sas, __ATOMIC_ACQUIRE);
+
+	if (set != s->ipsec.set) {
+		/* the copies count per SA, the main thread is reset by the rekey */
+		if (set->tx->id != s->ipsec.tx_ctx.id && owner != s)
+			s->ipsec.life.tx = 0;
+		if (set->rx[0]->id != s->ipsec.rx_ctx[0].id && owner != s)
+			s->ipsec.life.rx = 0;
+		esp_ctx_sync(s, &s->ipsec.tx_ctx, set->tx, 0);
+		esp_sa_sync_rx(s, set);
+		s->ipsec.set = set;
+	}
+
+	if (owner != s)
+		__atomic_store_n(&esp_reader_epoch[s->ipsec.reader], set->epoch, __ATOMIC_RELEASE);
+	else if (esp_retired)
+		esp_sa_reclaim();
+}
+
+/*
+ * Give a data path thread contexts of its own. s may be a copy of the
+ * main thread's sa_block, whose contexts are left alone.
+ */
+static void esp_sa_attach(struct sa_block *s)
+{
+	int i;
+
+	memset(&s->ipsec.tx_ctx, 0, sizeof(struct esp_ctx));
+	memset(s->ipsec.rx_ctx, 0, sizeof(s->ipsec.rx_ctx));
+	for (i = 0; i < ESP_RX_SAS; i++)
+		replay_init(&s->ipsec.rx_ctx[i].replay, opt_replay_window);
+	s->ipsec.set = NULL;
+	s->ipsec.reader = -1;
+
+	if (s->ipsec.shared) {
+		for (i = 0; i < ESP_MAX_READERS && esp_reader_epoch[i]; i++)
+			;
+		assert(i < ESP_MAX_READERS);
+		s->ipsec.reader = i;
+		esp_reader_epoch[i] = s->ipsec.shared->ipsec.sas->epoch;
+	}
+	esp_sa_sync(s);
+}
+
+/* Once the thread is gone */
+static void esp_sa_detach(struct sa_block *s)
+{
+	int i;
+
+	esp_ctx_setkey(s, &s->ipsec.tx_ctx, NULL);
+	for (i = 0; i < ESP_RX_SAS; i++) {
+		esp_ctx_setkey(s, &s->ipsec.rx_ctx[i], NULL);
+		replay_free(&s->ipsec.rx_ctx[i].replay);
+	}
+	if (s->ipsec.reader >= 0)
+		__atomic_store_n(&esp_reader_epoch[s->ipsec.reader], 0, __ATOMIC_RELEASE);
+}
+
+/* When the tunnel goes down, with all threads gone */
+static void esp_sa_free_all(struct sa_block *s)
+{
+	struct esp_sa_set *set;
+
+	esp_sa_detach(s);
+	while ((set = esp_retired) != NULL) {
+		esp_retired = set->next;
+		esp_sa_set_free(set);
+	}
+	esp_sa_set_free(s->ipsec.sas);
+	s->ipsec.sas = NULL;
+}
+
+#ifdef HAVE_CRYPTO_THREADS
+static void esp_crypto_submit(struct sa_block *s, struct esp_batch *b, int lane, struct pkt *p);
+#endif
+
+/* Seal the packets esp_batch_seal() put aside and queue them for the peer */
+static void esp_batch_seal_all(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	unsigned int i;
+
+	encap_esp_seal_batch(s, &s->ipsec.tx_ctx, b->seal, b->nseal);
+	for (i = 0; i < b->nseal; i++)
+		esp_batch_queue(s, b->seal[i], b->to_dst);
+	b->nseal = 0;
+}
+
+/*
+ * Seal a framed packet on a crypto worker, or put it aside to be sealed
+ * here with the rest of the batch, then queue it for the peer
+ */
+static void esp_batch_seal(struct sa_block *s, struct pkt *p, int to_dst)
+{
+	struct esp_batch *b = s->ipsec.txb;
+
+#ifdef HAVE_CRYPTO_THREADS
+	if (s->ipsec.crypto) {
+		b->to_dst = to_dst;
+		esp_crypto_submit(s, b, ESP_TX, p);
+		return;
+	}
+#endif
+	if (b->nseal == MAX_BATCH)
+		esp_batch_seal_all(s);
+	b->to_dst = to_dst;
+	b->seal[b->nseal++] = p;
+}
+
+/*
+ * Encapsulate a packet in IP ESP and send to the peer.
+ * "p" should have MAX_HEADER bytes of headroom for the encapsulation
+ * data and MAX_TRAILER bytes of tailroom for the ESP trailer.
+ */
+static int encap_esp_send_peer(struct sa_block *s, struct pkt *p)
+{
+	uint16_t len;
+	uint8_t tos;
+
+	/* Keep the TOS of the old IP header */
+	tos = (p->len < sizeof(struct ip)) ? 0 : ((struct ip *)p->data)->ip_tos;
+
+	/* Prepend our encapsulation header and new IP header */
+	p->var_header_size = (s->ipsec.em->fixed_header_size + s->ipsec.iv_len);
+	pkt_push(p, sizeof(struct ip) + p->var_header_size);
+	p->payload = sizeof(struct ip);
+
+	if (encap_esp_frame(s, p) == -1)
+		return -1;
+
+	/* The rest is in the template of the SA */
+	len = p->len + esp_icv_len(s);
+#ifdef NEED_IPLEN_FIX
+	len = htons(len);
+#endif
+	ip_template_fill((struct ip *)p->data, &p->sa->ip, tos, len, htons(esp_next_ip_id(s)));
+
+	esp_batch_seal(s, p, 1);
+	return 0;
+}
+
+/*
+ * Encapsulate a packet in UDP ESP and send to the peer.
+ * "p" should have MAX_HEADER bytes of headroom for the encapsulation
+ * data and MAX_TRAILER bytes of tailroom for the ESP trailer.
+ */
+static int encap_udp_send_peer(struct sa_block *s, struct pkt *p)
+{
+	/* Prepend our encapsulation header */
+	p->var_header_size = (s->ipsec.em->fixed_header_size + s->ipsec.iv_len);
+	pkt_push(p, p->var_header_size);
+	p->payload = 0;
+
+	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD) {
+		memset(pkt_push(p, 8), 0, 8);
+		p->payload = 8;
+	}
+
+	if (encap_esp_frame(s, p) == -1)
+		return -1;
+	esp_batch_seal(s, p, 0);
+	return 0;
+}
+
+static void encap_esp_new(struct encap_method *encap)
 {
 	encap->recv = encap_rawip_recv;
 	encap->send_peer = encap_esp_send_peer;
@@ -591,6 +1145,270 @@ static void encap_udp_new(struct encap_method *encap)
 	encap->fixed_header_size = sizeof(esp_encap_header_t);
 }
 
+/*
+ * Account a packet from the peer once encap_esp_open() accepted it and
+ * strip it down to the inner packet. Returns 1 if there is one for the
+ * tunnel device.
+ */
+static int esp_recv_done(struct sa_block *s, struct pkt *p)
+{
+	struct replay_window *replay = &esp_rx_ctx(s, p)->replay;
+
+	/* a copy of the packet may have been opened in the meantime */
+	if (replay_check(replay, p->seq) != 0) {
+		logmsg(LOG_DEBUG, "replayed or too old packet, seq %llu", (unsigned long long)p->seq);
+		return 0;
+	}
+	replay_update(replay, p->seq);
+
+	if (encap_any_decap(s, p) == 0) {
+		logmsg(LOG_DEBUG, "received update probe from peer");
+		return 0;
+	}
+	s->ipsec.life.rx += p->len;
+	return 1;
+}
+
+#ifdef HAVE_CRYPTO_THREADS
+/*
+ * Crypto workers. The main loop frames the packets, numbers them and
+ * checks them against the replay window, then hands them to the
+ * workers round robin, which seal or open them with contexts of their
+ * own for the SA of each packet. The results are collected in the same round robin
+ * order, so the packets leave in the order they came in and the replay
+ * window and the batch are only ever touched by the main loop.
+ *
+ * Every worker has a pair of rings per direction: the main loop is the
+ * only producer of in and the only consumer of out. A worker is woken
+ * once per batch and signals done once it has worked off its rings.
+ */
+struct esp_crypto_lane {
+	struct pkt_ring in, out;
+};
+
+#define ESP_CRYPTO_CTX 4 /* tx and rx, each across a rekey */
+
+struct esp_crypto_worker {
+	struct sa_block sa; /* for the algorithms */
+	struct esp_ctx ctx[ESP_CRYPTO_CTX]; /* keyed for the SAs seen last */
+	unsigned int next_ctx;
+	struct esp_crypto_lane lane[2]; /* ESP_TX, ESP_RX */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	int stop;
+	pthread_t tid;
+};
+
+struct esp_crypto {
+	struct esp_crypto_worker *w;
+	int n;
+};
+
+/* The worker's contexts for an SA, keyed for it if they aren't yet */
+static struct esp_ctx *esp_crypto_ctx(struct esp_crypto_worker *w, struct esp_sa *sa)
+{
+	struct esp_ctx *ctx;
+	int i;
+
+	for (i = 0; i < ESP_CRYPTO_CTX; i++)
+		if (w->ctx[i].id == sa->id)
+			return &w->ctx[i];
+	ctx = &w->ctx[w->next_ctx++ % ESP_CRYPTO_CTX];
+	esp_ctx_setkey(&w->sa, ctx, sa);
+	return ctx;
+}
+
+static int esp_crypto_idle(struct esp_crypto_worker *w)
+{
+	return pkt_ring_count(&w->lane[ESP_TX].in) == 0
+		&& pkt_ring_count(&w->lane[ESP_RX].in) == 0;
+}
+
+static void *esp_crypto_thread(void *arg)
+{
+	struct esp_crypto_worker *w = (struct esp_crypto_worker *) arg;
+	struct sa_block *s = &w->sa;
+	struct pkt *p, *tx[MAX_BATCH];
+	unsigned int i, j, n;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->stop) {
+		if (esp_crypto_idle(w)) {
+			pthread_cond_wait(&w->work, &w->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		/* sealed in runs of packets of the same SA */
+		do {
+			for (n = 0; n < MAX_BATCH && (p = pkt_ring_pop(&w->lane[ESP_TX].in)) != NULL; n++)
+				tx[n] = p;
+			for (i = 0; i < n; i = j) {
+				for (j = i + 1; j < n && tx[j]->sa == tx[i]->sa; j++)
+					;
+				encap_esp_seal_batch(s, esp_crypto_ctx(w, tx[i]->sa), tx + i, j - i);
+			}
+			for (i = 0; i < n; i++)
+				pkt_ring_push(&w->lane[ESP_TX].out, tx[i]);
+		} while (n == MAX_BATCH);
+		while ((p = pkt_ring_pop(&w->lane[ESP_RX].in)) != NULL) {
+			p->err = encap_esp_open(s, esp_crypto_ctx(w, p->sa), p);
+			pkt_ring_push(&w->lane[ESP_RX].out, p);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * Hand a packet to the next worker. There is always room: a batch has
+ * at most 2 * MAX_BATCH packets in flight, see process_socket().
+ */
+static void esp_crypto_submit(struct sa_block *s, struct esp_batch *b, int lane, struct pkt *p)
+{
+	struct esp_crypto *c = s->ipsec.crypto;
+	int ret;
+
+	ret = pkt_ring_push(&c->w[b->crypto_in++ % c->n].lane[lane].in, p);
+	assert(ret == 0);
+}
+
+/*
+ * Wake the workers and collect the packets of the batch in the order
+ * they were submitted: queue them for the peer (tx) or deliver them to
+ * the tunnel device (rx).
+ */
+static void esp_crypto_finish(struct sa_block *s, struct esp_batch *b, int lane)
+{
+	struct esp_crypto *c = s->ipsec.crypto;
+	struct esp_crypto_worker *w;
+	struct pkt *p;
+	int i;
+
+	if (c == NULL || b->crypto_in == 0)
+		return;
+
+	for (i = 0; i < c->n && (unsigned int)i < b->crypto_in; i++) {
+		pthread_mutex_lock(&c->w[i].lock);
+		pthread_cond_signal(&c->w[i].work);
+		pthread_mutex_unlock(&c->w[i].lock);
+	}
+
+	for (; b->crypto_out < b->crypto_in; b->crypto_out++) {
+		w = &c->w[b->crypto_out % c->n];
+		while ((p = pkt_ring_pop(&w->lane[lane].out)) == NULL) {
+			pthread_mutex_lock(&w->lock);
+			if (pkt_ring_count(&w->lane[lane].out) == 0)
+				pthread_cond_wait(&w->done, &w->lock);
+			pthread_mutex_unlock(&w->lock);
+		}
+
+		if (lane == ESP_TX)
+			esp_batch_queue(s, p, b->to_dst);
+		else if (p->err == 0 && esp_recv_done(s, p))
+			tun_deliver(s, p);
+	}
+	b->crypto_in = b->crypto_out = 0;
+}
+
+static int esp_crypto_start(struct sa_block *s)
+{
+	struct esp_crypto *c;
+	sigset_t all, old;
+	int i;
+
+	if (opt_crypto_threads == 0)
+		return 0;
+
+	c = xallocc(sizeof(struct esp_crypto));
+	c->w = xallocc(opt_crypto_threads * sizeof(struct esp_crypto_worker));
+
+	/* signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < opt_crypto_threads; i++) {
+		struct esp_crypto_worker *w = &c->w[i];
+
+		memcpy(&w->sa, s, sizeof(struct sa_block));
+		if (pkt_ring_init(&w->lane[ESP_TX].in, 2 * MAX_BATCH) == -1
+			|| pkt_ring_init(&w->lane[ESP_TX].out, 2 * MAX_BATCH) == -1
+			|| pkt_ring_init(&w->lane[ESP_RX].in, 2 * MAX_BATCH) == -1
+			|| pkt_ring_init(&w->lane[ESP_RX].out, 2 * MAX_BATCH) == -1)
+			error(1, errno, "allocating crypto rings");
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->work, NULL);
+		pthread_cond_init(&w->done, NULL);
+
+		if (pthread_create(&w->tid, NULL, esp_crypto_thread, w)) {
+			logmsg(LOG_ERR, "can't create crypto worker: %m");
+			break;
+		}
+	}
+	c->n = i;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (c->n == 0) {
+		free(c->w);
+		free(c);
+		return 0;
+	}
+	s->ipsec.crypto = c;
+	logmsg(LOG_INFO, "%d crypto workers started", c->n);
+	return 1;
+}
+
+static void esp_crypto_stop(struct sa_block *s)
+{
+	struct esp_crypto *c = s->ipsec.crypto;
+	int i, j, lane;
+
+	if (c == NULL)
+		return;
+
+	for (i = 0; i < c->n; i++) {
+		struct esp_crypto_worker *w = &c->w[i];
+
+		pthread_mutex_lock(&w->lock);
+		w->stop = 1;
+		pthread_cond_signal(&w->work);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->tid, NULL);
+
+		for (j = 0; j < ESP_CRYPTO_CTX; j++)
+			esp_ctx_setkey(&w->sa, &w->ctx[j], NULL);
+		for (lane = ESP_TX; lane <= ESP_RX; lane++) {
+			pkt_ring_free(&w->lane[lane].in);
+			pkt_ring_free(&w->lane[lane].out);
+		}
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->work);
+		pthread_cond_destroy(&w->done);
+	}
+	free(c->w);
+	free(c);
+	s->ipsec.crypto = NULL;
+}
+#else
+static void esp_crypto_finish(struct sa_block *s __attribute__((unused)),
+	struct esp_batch *b __attribute__((unused)), int lane __attribute__((unused)))
+{
+}
+
+static int esp_crypto_start(struct sa_block *s __attribute__((unused)))
+{
+	return 0;
+}
+
+static void esp_crypto_stop(struct sa_block *s __attribute__((unused)))
+{
+}
+#endif
+
 /*
  * Process ARP
  * Return 1 if packet has been processed, 0 otherwise
@@ -661,90 +1479,633 @@ static int process_non_ip(uint8_t *frame)
 	return 0;
 }
 
-static void process_tun(struct sa_block *s)
+/*
+ * Prepare p for a packet from the tunnel device, so that the IP packet
+ * starts MAX_HEADER bytes into the buffer. Returns the room for it.
+ */
+static int tun_frame_reset(struct pkt *p)
 {
-	int pack;
-	int size = MAX_PACKET;
-	uint8_t *start = global_buffer_rx + MAX_HEADER;
+	if (opt_if_mode == IF_MODE_TAP) {
+		pkt_reset(p, MAX_HEADER - ETH_HLEN);
+		return MAX_PACKET + ETH_HLEN;
+	}
+	pkt_reset(p, MAX_HEADER);
+	return MAX_PACKET;
+}
+
+/*
+ * Encapsulate a packet read from the tunnel device and queue it for
+ * the peer, unless it is handled locally or dropped.
+ * Returns 1 if it was queued, 0 if p can be reused.
+ */
+static int process_tun_frame(struct sa_block *s, struct pkt *p)
+{
+	hex_dump("Rx pkt", p->data, p->len, NULL);
 
 	if (opt_if_mode == IF_MODE_TAP) {
-		/* Make sure IP packet starts at buf + MAX_HEADER */
-		start -= ETH_HLEN;
-		size += ETH_HLEN;
+		if (process_arp(s, p->data)) {
+			return 0;
+		}
+		if (process_non_ip(p->data)) {
+			return 0;
+		}
+		pkt_pull(p, ETH_HLEN);
 	}
 
-	/* Receive a packet from the tunnel interface */
-	pack = tun_read(s->tun_fd, start, size);
+	/* Don't access the contents of the buffer other than byte aligned.
+	 * 12: Offset of ip source address in ip header,
+	 *  4: Length of IP address */
+	if (!memcmp(p->data + 12, &s->dst.s_addr, 4)) {
+		logmsg(LOG_ALERT, "routing loop to %s",
+			inet_ntoa(s->dst));
+		return 0;
+	}
+
+	/* Encapsulate and send to the other end of the tunnel */
+	s->ipsec.life.tx += p->len;
+	if (s->ipsec.em->send_peer(s, p) == -1)
+		return 0;
+	return 1;
+}
 
-	hex_dump("Rx pkt", start, pack, NULL);
+/*
+ * Encapsulate everything read so far and send it, which also returns
+ * the buffers to the pool.
+ */
+static void esp_batch_drain(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	struct pkt *p;
 
-	if (opt_if_mode == IF_MODE_TAP) {
-		if (process_arp(s, start)) {
-			return;
+	while ((p = pkt_ring_pop(&b->crypt)) != NULL) {
+		if (!process_tun_frame(s, p))
+			pkt_free(p);
+	}
+	esp_batch_seal_all(s);
+	esp_crypto_finish(s, b, ESP_TX);
+	esp_batch_flush(s);
+}
+
+#ifdef HAVE_TUN_OFFLOAD
+/*
+ * Read a packet with its vnet header. Super-packets are read into
+ * p and on into gso_buf, then split up into buffers of their own;
+ * plain packets stay where they are.
+ * Returns -1 if nothing could be read.
+ */
+static int process_tun_gso(struct sa_block *s, struct pkt *p)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	struct virtio_net_hdr vh;
+	struct gso_iter it;
+	struct iovec iov[3];
+	ssize_t pack;
+
+	pkt_reset(p, MAX_HEADER);
+	iov[0].iov_base = &vh;
+	iov[0].iov_len = sizeof(vh);
+	iov[1].iov_base = p->data;
+	iov[1].iov_len = MAX_PACKET;
+	iov[2].iov_base = b->gso_buf + MAX_PACKET;
+	iov[2].iov_len = GSO_MAX_PACKET - MAX_PACKET;
+
+	pack = readv(s->tun_fd, iov, 3);
+	if (pack == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logmsg(LOG_ERR, "read: %m");
+		pkt_free(p);
+		return -1;
+	}
+	pack -= sizeof(vh);
+	if (pack <= 0) {
+		pkt_free(p);
+		return 0;
+	}
+
+	if (pack <= MAX_PACKET && vh.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (gso_csum(p->data, pack, &vh) == -1) {
+			logmsg(LOG_ALERT, "bad checksum offset from tunnel device");
+			pkt_free(p);
+			return 0;
 		}
-		if (process_non_ip(start)) {
-			return;
+		p->len = pack;
+		pkt_ring_push(&b->crypt, p); /* as big as the pool */
+		return 0;
+	}
+
+	memcpy(b->gso_buf, p->data, MAX_PACKET);
+	pkt_free(p);
+	if (gso_start(&it, b->gso_buf, pack, &vh, MAX_PACKET) == -1) {
+		logmsg(LOG_ALERT, "can't segment %zd byte packet from tunnel device (gso type %d)",
+			pack, vh.gso_type);
+		return 0;
+	}
+	for (;;) {
+		if (b->pool->nfree == 0)
+			esp_batch_drain(s);
+		p = pkt_alloc(b->pool, MAX_HEADER);
+		p->len = gso_next(&it, p->data);
+		if (p->len == 0) {
+			pkt_free(p);
+			break;
 		}
-		pack -= ETH_HLEN;
+		pkt_ring_push(&b->crypt, p); /* as big as the pool */
 	}
+	return 0;
+}
+#endif
+
+/*
+ * Read one packet from the tunnel device and queue it for encapsulation.
+ * Returns -1 if nothing could be read.
+ */
+static int process_tun_packet(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	struct pkt *p;
+	int pack, size;
 
+	if (b->pool->nfree == 0)
+		esp_batch_drain(s);
+	p = pkt_alloc(b->pool, 0);
+
+#ifdef HAVE_TUN_OFFLOAD
+	if (s->tun_vnet_hdr)
+		return process_tun_gso(s, p);
+#endif
+
+	/* Receive a packet from the tunnel interface */
+	size = tun_frame_reset(p);
+	pack = tun_read(s->tun_fd, p->data, size);
 	if (pack == -1) {
-		logmsg(LOG_ERR, "read: %m");
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logmsg(LOG_ERR, "read: %m");
+		pkt_free(p);
+		return -1;
+	}
+
+	p->len = pack;
+	pkt_ring_push(&b->crypt, p); /* as big as the pool */
+	return 0;
+}
+
+/*
+ * Handle one batch of packets from the tunnel device: read them all,
+ * then encapsulate them all, then send them all.
+ * Returns 1 if there may be more waiting.
+ */
+static int process_tun(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.txb;
+	unsigned int n, limit = b->limit;
+
+	for (n = 0; n < limit; n++) {
+		if (process_tun_packet(s) == -1)
+			break;
+	}
+
+	esp_batch_drain(s);
+	esp_batch_adapt(b, n);
+	return n == limit;
+}
+
+/*
+ * Handle one packet from the peer. Returns 1 if p now holds
+ * a decapsulated packet for the tunnel device.
+ */
+static int process_socket_packet(struct sa_block *s, struct pkt *p,
+	const struct sockaddr_in *from)
+{
+	esp_encap_header_t *eh;
+	struct esp_ctx *ctx;
+
+	if (s->ipsec.em->recv(s, p, from) == -1)
+		return 0;
+
+	eh = (esp_encap_header_t *) (p->data + p->payload);
+	if (eh->spi == 0) {
+		if (s->ipsec.shared) {
+			/* the receiver thread, IKE is up to the main thread */
+			if (send(s->ipsec.ike_relay, p->data + p->payload + 4,
+					p->len - p->payload - 4, MSG_DONTWAIT) == -1)
+				logmsg(LOG_ERR, "ike relay: %m");
+			return 0;
+		}
+		process_late_ike(s, p->data + p->payload + 4 /* SPI-size */,
+			p->len - p->payload - 4);
+		return 0;
+	} else if ((ctx = esp_rx_lookup(s, eh->spi)) == NULL) {
+		logmsg(LOG_NOTICE, "unknown spi %#08x from peer", ntohl(eh->spi));
+		return 0;
+	} else if (ntohl(eh->spi) < 256) {
+		syslog(LOG_NOTICE, "illegal spi %d from peer - continuing", ntohl(eh->spi));
+	}
+	p->sa = ctx->sa;
+
+	if (s->ipsec.em->recv_peer(s, p) != 0)
+		return 0;
+
+#ifdef HAVE_CRYPTO_THREADS
+	if (s->ipsec.crypto) {
+		/* delivered by esp_crypto_finish() */
+		esp_crypto_submit(s, s->ipsec.rxb, ESP_RX, p);
+		return 0;
+	}
+#endif
+	/* Check auth digest and/or decrypt */
+	if (encap_esp_open(s, ctx, p) != 0)
+		return 0;
+	return esp_recv_done(s, p);
+}
+
+/*
+ * Receive and handle one batch of packets from the peer.
+ * Returns 1 if there may be more waiting.
+ */
+static int process_socket(struct sa_block *s)
+{
+	struct esp_batch *b = s->ipsec.rxb;
+	unsigned int i, n, limit = b->limit;
+#ifdef HAVE_UDP_GSO
+	unsigned int off, len;
+	struct pkt *seg;
+#endif
+
+	n = esp_batch_recv(s, b);
+	for (i = 0; i < n; i++) {
+#ifdef HAVE_UDP_GSO
+		/* a UDP GRO train is split back into its packets */
+		for (off = 0; b->seg[i] && off < b->pkt[i]->len; off += len) {
+			if (b->nsegs == MAX_BATCH) {
+				/* the descriptors may still be with the crypto workers */
+				esp_crypto_finish(s, b, ESP_RX);
+				b->nsegs = 0;
+			}
+			len = MIN(b->seg[i], b->pkt[i]->len - off);
+			seg = &b->segs[b->nsegs++];
+			*seg = *b->pkt[i];
+			seg->data += off;
+			seg->len = len;
+			if (process_socket_packet(s, seg, &b->from[i]))
+				tun_deliver(s, seg);
+		}
+		if (b->seg[i])
+			continue;
+#endif
+		if (process_socket_packet(s, b->pkt[i], &b->from[i]))
+			tun_deliver(s, b->pkt[i]); /* to the tunnel interface */
+	}
+	esp_crypto_finish(s, b, ESP_RX);
+#ifdef HAVE_UDP_GSO
+	b->nsegs = 0;
+#endif
+	tun_flush(s);
+
+	esp_batch_adapt(b, n);
+	return n == limit;
+}
+
+/*
+ * Handle one packet on the IKE socket, if it is separate from the ESP one,
+ * or relayed by the receiver thread (fd).
+ * Returns 1 if there may be more waiting.
+ */
+static int process_ike(struct sa_block *s, int fd)
+{
+	uint8_t buf[MAX_HEADER + MAX_PACKET];
+	ssize_t len;
+
+	DEBUG(3,printf("received something on ike fd..\n"));
+	len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			logmsg(LOG_ERR, "recv: %m");
+		return 0;
+	}
+	process_late_ike(s, buf, len);
+	return 1;
+}
+
+static void send_nat_keepalive(struct sa_block *s)
+{
+	/* non-esp marker, nat keepalive payload (0xFF) */
+	static const uint8_t keepalive_v2[5] = { 0x00, 0x00, 0x00, 0x00, 0xFF };
+	static const uint8_t keepalive_v1[1] = { 0xFF };
+	const uint8_t *keepalive;
+	size_t keepalive_size;
+
+	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD) {
+		keepalive = keepalive_v1;
+		keepalive_size = sizeof(keepalive_v1);
+	} else { /* active_mode is either RFC or CISCO_UDP */
+		keepalive = keepalive_v2;
+		keepalive_size = sizeof(keepalive_v2);
+	}
+
+	if (send(s->esp_fd, keepalive, keepalive_size, 0) == -1) {
+		logmsg(LOG_ERR, "keepalive sendto: %m");
+	}
+}
+
+#ifdef HAVE_TUN_QUEUES
+/*
+ * With a multi-queue tunnel device every queue gets its own worker.
+ * A worker reads packets from its queue, encrypts them with contexts
+ * of its own and sends them to the peer. The main thread keeps
+ * handling the packets from the peer and IKE. In duplex mode a single
+ * worker reads the only queue.
+ */
+struct esp_worker {
+	struct sa_block sa; /* private copy, tx direction only */
+	pthread_t tid;
+};
+
+static struct esp_worker *esp_workers;
+static int esp_nworkers;
+
+static void *esp_worker_thread(void *arg)
+{
+	struct esp_worker *w = (struct esp_worker *) arg;
+	struct sa_block *s = &w->sa;
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = s->tun_fd;
+	pfd.events = POLLIN;
+
+	while (!do_kill) {
+		/* wake up regularly to notice do_kill */
+		n = poll(&pfd, 1, 1000);
+		esp_sa_sync(s);
+		if (n <= 0)
+			continue;
+		process_tun(s);
+	}
+	return NULL;
+}
+
+/* Pin worker n to the n-th CPU we are allowed to run on */
+static void esp_worker_pin(struct esp_worker *w, int n)
+{
+	cpu_set_t allowed, cpus;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0)
 		return;
+	n %= CPU_COUNT(&allowed);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+			break;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (pthread_setaffinity_np(w->tid, sizeof(cpus), &cpus) != 0)
+		logmsg(LOG_WARNING, "can't pin tunnel queue worker to cpu %d", cpu);
+	else
+		DEBUG(2, printf("tunnel queue worker %d on cpu %d\n", (int)(w - esp_workers), cpu));
+}
+
+static int esp_workers_start(struct sa_block *s, int *fds, int n)
+{
+	sigset_t all, old;
+	int i;
+
+	esp_workers = xallocc(n * sizeof(struct esp_worker));
+
+	/* signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < n; i++) {
+		struct esp_worker *w = &esp_workers[i];
+
+		memcpy(&w->sa, s, sizeof(struct sa_block));
+		w->sa.ipsec.shared = s;
+		w->sa.tun_fd = fds[i];
+		w->sa.ipsec.rxb = NULL;
+		if (n > 1)
+			w->sa.ipsec.crypto = NULL; /* the queues spread the crypto already */
+		w->sa.ipsec.txb = esp_batch_new(s, opt_batch);
+#ifdef HAVE_UDP_GSO
+		w->sa.ipsec.txb->udp_gso = s->ipsec.txb->udp_gso;
+#endif
+		if (opt_batch > 1 && fcntl(w->sa.tun_fd, F_SETFL, fcntl(w->sa.tun_fd, F_GETFL) | O_NONBLOCK) == -1)
+			w->sa.ipsec.txb->max = 1;
+		esp_sa_attach(&w->sa);
+
+		if (pthread_create(&w->tid, NULL, esp_worker_thread, w)) {
+			logmsg(LOG_ERR, "can't create tunnel queue worker: %m");
+			esp_sa_detach(&w->sa);
+			esp_batch_free(w->sa.ipsec.txb);
+			break;
+		}
+		esp_worker_pin(w, i);
+	}
+	esp_nworkers = i;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (esp_nworkers == 0) {
+		free(esp_workers);
+		esp_workers = NULL;
+		return 0;
+	}
+	logmsg(LOG_INFO, "%d tunnel queue workers started", esp_nworkers);
+	return 1;
+}
+
+static void esp_workers_stop(void)
+{
+	int i;
+
+	for (i = 0; i < esp_nworkers; i++) {
+		struct esp_worker *w = &esp_workers[i];
+
+		pthread_join(w->tid, NULL);
+		esp_sa_detach(&w->sa);
+		esp_batch_free(w->sa.ipsec.txb);
 	}
+	free(esp_workers);
+	esp_workers = NULL;
+	esp_nworkers = 0;
+}
+
+/* sum of the per-worker counters, they are reset by the workers after a rekey */
+static uint64_t esp_life_tx(struct sa_block *s)
+{
+	uint64_t tx = s->ipsec.life.tx;
+	int i;
+
+	for (i = 0; i < esp_nworkers; i++)
+		tx += esp_workers[i].sa.ipsec.life.tx;
+	return tx;
+}
+
+/*
+ * In duplex mode the receiver thread handles the packets from the peer
+ * with contexts and replay windows of its own, while a worker reads the
+ * tunnel device. The main thread is left with IKE, DPD and the timers;
+ * IKE arriving on the ESP socket is passed on to it through a socket
+ * pair. The threads only share the published SAs.
+ */
+struct esp_receiver {
+	struct sa_block sa; /* private copy, rx direction only */
+	int relay[2]; /* main thread, receiver */
+	pthread_t tid;
+};
+
+static struct esp_receiver *esp_receiver;
+
+static void *esp_receiver_thread(void *arg)
+{
+	struct esp_receiver *r = (struct esp_receiver *) arg;
+	struct sa_block *s = &r->sa;
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = s->esp_fd;
+	pfd.events = POLLIN;
+
+	while (!do_kill) {
+		/* wake up regularly to notice do_kill */
+		n = poll(&pfd, 1, 1000);
+		esp_sa_sync(s);
+		if (n <= 0)
+			continue;
+		while (process_socket(s) && !do_kill)
+			esp_sa_sync(s);
+	}
+	return NULL;
+}
+
+/*
+ * Start the receiver thread, and a worker for the tunnel device unless
+ * there are queue workers already. Returns the socket the main thread
+ * gets IKE from instead of the ESP socket, -1 if not in duplex mode.
+ */
+static int esp_duplex_start(struct sa_block *s, int *tun_workers)
+{
+	struct esp_receiver *r;
+	sigset_t all, old;
+
+	if (!opt_duplex)
+		return -1;
+
+	r = xallocc(sizeof(struct esp_receiver));
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, r->relay) == -1) {
+		logmsg(LOG_ERR, "can't create ike relay, duplex mode disabled: %m");
+		free(r);
+		return -1;
+	}
+
+	memcpy(&r->sa, s, sizeof(struct sa_block));
+	r->sa.ipsec.shared = s;
+	r->sa.ipsec.ike_relay = r->relay[1];
+	esp_sa_attach(&r->sa);
+
+	/* signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&r->tid, NULL, esp_receiver_thread, r)) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		logmsg(LOG_ERR, "can't create receiver thread, duplex mode disabled: %m");
+		esp_sa_detach(&r->sa);
+		close(r->relay[0]);
+		close(r->relay[1]);
+		free(r);
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	esp_receiver = r;
+
+	if (!*tun_workers)
+		*tun_workers = esp_workers_start(s, &s->tun_fd, 1);
+	logmsg(LOG_INFO, "duplex mode: receiver thread started");
+	return r->relay[0];
+}
+
+static void esp_duplex_stop(void)
+{
+	struct esp_receiver *r = esp_receiver;
+
+	if (r == NULL)
+		return;
+
+	pthread_join(r->tid, NULL);
+	/* the receiver shares the rx batch with s, which frees it */
+	esp_sa_detach(&r->sa);
+	close(r->relay[0]);
+	close(r->relay[1]);
+	free(r);
+	esp_receiver = NULL;
+}
+
+static uint64_t esp_life_rx(struct sa_block *s)
+{
+	if (esp_receiver)
+		return esp_receiver->sa.ipsec.life.rx;
+	return s->ipsec.life.rx;
+}
+#else
+static int esp_workers_start(struct sa_block *s __attribute__((unused)),
+	int *fds __attribute__((unused)), int n __attribute__((unused)))
+{
+	return 0;
+}
+
+static void esp_workers_stop(void)
+{
+}
 
-	/* Don't access the contents of the buffer other than byte aligned.
-	 * 12: Offset of ip source address in ip header,
-	 *  4: Length of IP address */
-	if (!memcmp(global_buffer_rx + MAX_HEADER + 12, &s->dst.s_addr, 4)) {
-		logmsg(LOG_ALERT, "routing loop to %s",
-			inet_ntoa(s->dst));
-		return;
-	}
+static uint64_t esp_life_tx(struct sa_block *s)
+{
+	return s->ipsec.life.tx;
+}
 
-	/* Encapsulate and send to the other end of the tunnel */
-	s->ipsec.life.tx += pack;
-	s->ipsec.em->send_peer(s, global_buffer_rx, pack);
+static int esp_duplex_start(struct sa_block *s __attribute__((unused)),
+	int *tun_workers __attribute__((unused)))
+{
+	return -1;
 }
 
-static void process_socket(struct sa_block *s)
+static void esp_duplex_stop(void)
 {
-	/* Receive a packet from a socket */
-	int pack;
-	uint8_t *start = global_buffer_tx;
-	esp_encap_header_t *eh;
+}
 
-	if (opt_if_mode == IF_MODE_TAP) {
-		start += ETH_HLEN;
-	}
+static uint64_t esp_life_rx(struct sa_block *s)
+{
+	return s->ipsec.life.rx;
+}
+#endif
 
-	pack = s->ipsec.em->recv(s, start, MAX_HEADER + MAX_PACKET);
-	if (pack == -1)
-		return;
+#define REKEY_RETRY 10 /* seconds to wait for the answer to a rekey */
 
-	eh = (esp_encap_header_t *) (s->ipsec.rx.buf + s->ipsec.rx.bufpayload);
-	if (eh->spi == 0) {
-		process_late_ike(s, s->ipsec.rx.buf + s->ipsec.rx.bufpayload + 4 /* SPI-size */,
-			s->ipsec.rx.buflen - s->ipsec.rx.bufpayload - 4);
-		return;
-	} else if (eh->spi != s->ipsec.rx.spi) {
-		logmsg(LOG_NOTICE, "unknown spi %#08x from peer", ntohl(eh->spi));
-		return;
-	} else if (ntohl(eh->spi) < 256) {
-		syslog(LOG_NOTICE, "illegal spi %d from peer - continuing", ntohl(eh->spi));
-	}
+/* When opt_rekey_at percent of the lifetime in seconds is used up */
+static time_t esp_rekey_time(struct sa_block *s)
+{
+	return s->ipsec.life.start + (time_t)((uint64_t)s->ipsec.life.seconds * opt_rekey_at / 100);
+}
 
-	/* Check auth digest and/or decrypt */
-	if (s->ipsec.em->recv_peer(s) != 0)
-		return;
+/* Whether it is time to replace the SA, by age or by volume */
+static int esp_rekey_due(struct sa_block *s, time_t now)
+{
+	uint64_t limit = (uint64_t)s->ipsec.life.kbytes * 1024 * opt_rekey_at / 100;
 
-	if (encap_any_decap(s) == 0) {
-		logmsg(LOG_DEBUG, "received update probe from peer");
-	} else {
-		/* Send the decapsulated packet to the tunnel interface */
-		s->ipsec.life.rx += s->ipsec.rx.buflen;
-		tun_send_ip(s);
-	}
+#ifdef HAVE_XFRM
+	/* kernel SAs count themselves, with soft limits from the same numbers */
+	if (s->ipsec.kernel && xfrm_expired())
+		return 1;
+#endif
+	/* the sequence number must not cycle, even if rekeying is left to the peer */
+	if (!s->ipsec.esn && s->ipsec.sas &&
+		__atomic_load_n(&s->ipsec.sas->tx->seq_id, __ATOMIC_RELAXED) >= ESP_REKEY_SEQ)
+		return 1;
+	if (opt_rekey_at == 0)
+		return 0;
+	if (s->ipsec.life.seconds && now >= esp_rekey_time(s))
+		return 1;
+	/* the peer counts each direction against the limit */
+	return limit && MAX(esp_life_rx(s), esp_life_tx(s)) >= limit;
 }
 
 #if defined(__CYGWIN__)
@@ -759,35 +2120,24 @@ static void *tun_thread (void *arg)
 }
 #endif
 
-static void vpnc_main_loop(struct sa_block *s)
+static void main_loop_select(struct sa_block *s, int tun_workers, int ike_relay)
 {
 	fd_set rfds, refds;
 	int nfds=0;
+	int rx_fd = (ike_relay != -1) ? ike_relay : s->esp_fd;
 	int enable_keepalives;
 	int timed_mode;
-	ssize_t len;
 	struct timeval select_timeout;
 	struct timeval normal_timeout;
 	time_t next_ike_keepalive=0;
 	time_t next_ike_dpd=0;
+	time_t next_rekey=0;
+	time_t rekey_of=0; /* life.start of the SA being replaced */
+	int rekey_checks = opt_rekey_at || !s->ipsec.esn;
 #if defined(__CYGWIN__)
 	pthread_t tid;
 #endif
 
-	/* non-esp marker, nat keepalive payload (0xFF) */
-	uint8_t keepalive_v2[5] = { 0x00, 0x00, 0x00, 0x00, 0xFF };
-	uint8_t keepalive_v1[1] = { 0xFF };
-	uint8_t *keepalive;
-	size_t keepalive_size;
-
-	if (s->ipsec.natt_active_mode == NATT_ACTIVE_DRAFT_OLD) {
-		keepalive = keepalive_v1;
-		keepalive_size = sizeof(keepalive_v1);
-	} else { /* active_mode is either RFC or CISCO_UDP */
-		keepalive = keepalive_v2;
-		keepalive_size = sizeof(keepalive_v2);
-	}
-
 	/* send keepalives if UDP encapsulation is enabled */
 	enable_keepalives = (s->ipsec.encap_mode != IPSEC_ENCAP_TUNNEL);
 
@@ -797,12 +2147,14 @@ static void vpnc_main_loop(struct sa_block *s)
 	FD_ZERO(&rfds);
 
 #if !defined(__CYGWIN__)
-	FD_SET(s->tun_fd, &rfds);
-	nfds = MAX(nfds, s->tun_fd +1);
+	if (!tun_workers) {
+		FD_SET(s->tun_fd, &rfds);
+		nfds = MAX(nfds, s->tun_fd +1);
+	}
 #endif
 
-	FD_SET(s->esp_fd, &rfds);
-	nfds = MAX(nfds, s->esp_fd +1);
+	FD_SET(rx_fd, &rfds);
+	nfds = MAX(nfds, rx_fd +1);
 
 	if (s->ike_fd != s->esp_fd) {
 		FD_SET(s->ike_fd, &rfds);
@@ -838,18 +2190,31 @@ static void vpnc_main_loop(struct sa_block *s)
 		}
 	}
 
+	if (rekey_checks && normal_timeout.tv_sec > REKEY_RETRY) {
+		/* also wake up to check on the lifetime */
+		normal_timeout.tv_sec = REKEY_RETRY;
+		normal_timeout.tv_usec = 0;
+	}
+
 	select_timeout = normal_timeout;
 
 	while (!do_kill) {
 		int presult;
 
+		esp_sa_sync(s);
+		if (esp_rekey_due(s, time(NULL)) &&
+			(time(NULL) >= next_rekey || rekey_of != s->ipsec.life.start)) {
+			rekey_of = s->ipsec.life.start;
+			rekey_ipsec(s);
+			next_rekey = time(NULL) + REKEY_RETRY;
+		}
 		do {
 			struct timeval *tvp = NULL;
 			FD_COPY(&rfds, &refds);
-			if (s->ike.do_dpd || enable_keepalives)
+			if (s->ike.do_dpd || enable_keepalives || rekey_checks)
 				tvp = &select_timeout;
 			presult = select(nfds, &refds, NULL, NULL, tvp);
-			if (presult == 0 && (s->ike.do_dpd || enable_keepalives)) {
+			if (presult == 0 && (s->ike.do_dpd || enable_keepalives || rekey_checks)) {
 				/* reset to max timeout */
 				select_timeout = normal_timeout;
 				if (enable_keepalives) {
@@ -859,9 +2224,7 @@ static void vpnc_main_loop(struct sa_block *s)
 						keepalive_ike(s);
 					}
 					/* send nat keepalive packet */
-					if (send(s->esp_fd, keepalive, keepalive_size, 0) == -1) {
-						logmsg(LOG_ERR, "keepalive sendto: %m");
-					}
+					send_nat_keepalive(s);
 				}
 				if (s->ike.do_dpd) {
 					time_t now = time(NULL);
@@ -878,11 +2241,11 @@ static void vpnc_main_loop(struct sa_block *s)
 					}
 				}
 			}
-			DEBUG(2,printf("lifetime status: %ld of %u seconds used, %u|%u of %u kbytes used\n",
+			DEBUG(2,printf("lifetime status: %ld of %u seconds used, %llu|%llu of %u kbytes used\n",
 				time(NULL) - s->ipsec.life.start,
 				s->ipsec.life.seconds,
-				s->ipsec.life.rx/1024,
-				s->ipsec.life.tx/1024,
+				(unsigned long long)esp_life_rx(s)/1024,
+				(unsigned long long)esp_life_tx(s)/1024,
 				s->ipsec.life.kbytes));
 		} while ((presult == 0 || (presult == -1 && errno == EINTR)) && !do_kill);
 		if (presult == -1) {
@@ -891,19 +2254,20 @@ static void vpnc_main_loop(struct sa_block *s)
 		}
 
 #if !defined(__CYGWIN__)
-		if (FD_ISSET(s->tun_fd, &refds)) {
+		if (!tun_workers && FD_ISSET(s->tun_fd, &refds)) {
 			process_tun(s);
 		}
 #endif
 
-		if (FD_ISSET(s->esp_fd, &refds) ) {
-			process_socket(s);
+		if (FD_ISSET(rx_fd, &refds) ) {
+			if (ike_relay != -1)
+				process_ike(s, ike_relay);
+			else
+				process_socket(s);
 		}
 
 		if (s->ike_fd != s->esp_fd && FD_ISSET(s->ike_fd, &refds) ) {
-			DEBUG(3,printf("received something on ike fd..\n"));
-			len = recv(s->ike_fd, global_buffer_tx, MAX_HEADER + MAX_PACKET, 0);
-			process_late_ike(s, global_buffer_tx, len);
+			process_ike(s, s->ike_fd);
 		}
 
 		if (timed_mode) {
@@ -943,6 +2307,686 @@ static void vpnc_main_loop(struct sa_block *s)
 		}
 
 	}
+}
+
+#ifdef HAVE_EPOLL
+#define TIMER_NEVER INT64_MAX
+
+struct loop_timers {
+	int64_t ike_keepalive; /* deadlines in ms on CLOCK_MONOTONIC */
+	int64_t nat_keepalive;
+	int64_t dpd;
+	int64_t dpd_retry;
+	int64_t lifetime;
+	int64_t rekey;
+	int64_t rekey_retry;
+	time_t rekey_of; /* life.start of the SA being replaced */
+	uint64_t nat_tx; /* esp tx bytes at the last nat keepalive check */
+	time_t expired; /* life.start of the SA we already warned about */
+	int64_t grace; /* end of the grace period of a replaced kernel SA */
+};
+
+static int64_t mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Fire the timers that are due, returns the next deadline */
+static int64_t run_timers(struct sa_block *s, struct loop_timers *t)
+{
+	int64_t now = mono_ms(), next;
+	time_t wall = time(NULL);
+	uint64_t tx;
+
+	if (now >= t->ike_keepalive) {
+		keepalive_ike(s);
+		t->ike_keepalive = now + 9000;
+	}
+
+	if (now >= t->nat_keepalive) {
+		/* only needed when nothing else went out to keep the mapping */
+		tx = esp_life_tx(s);
+		if (tx == t->nat_tx)
+			send_nat_keepalive(s);
+		t->nat_tx = tx;
+		t->nat_keepalive = now + 9000;
+	}
+
+	if (s->ike.do_dpd) {
+		if (s->ike.dpd_seqno != s->ike.dpd_seqno_ack) {
+			/* dpd_ike spaces out the retransmits itself */
+			if (now >= t->dpd_retry) {
+				dpd_ike(s);
+				t->dpd_retry = now + 5000;
+				t->dpd = now + s->ike.dpd_idle * 1000;
+			}
+		} else if (now >= t->dpd) {
+			dpd_ike(s);
+			t->dpd_retry = now + 5000;
+			t->dpd = now + s->ike.dpd_idle * 1000;
+		}
+	}
+
+	t->lifetime = TIMER_NEVER;
+	if (s->ipsec.life.seconds && t->expired != s->ipsec.life.start) {
+		if (wall - s->ipsec.life.start >= (time_t)s->ipsec.life.seconds) {
+			logmsg(LOG_NOTICE, "IPSec SA lifetime of %u seconds expired, waiting for peer to rekey",
+				s->ipsec.life.seconds);
+			t->expired = s->ipsec.life.start;
+		} else
+			t->lifetime = now + (s->ipsec.life.start + s->ipsec.life.seconds - wall) * 1000;
+	}
+
+	t->rekey = TIMER_NEVER;
+	if (esp_rekey_due(s, wall)) {
+		if (now >= t->rekey_retry || t->rekey_of != s->ipsec.life.start) {
+			t->rekey_of = s->ipsec.life.start;
+			rekey_ipsec(s);
+			t->rekey_retry = now + REKEY_RETRY * 1000;
+		}
+		t->rekey = t->rekey_retry;
+	} else if (opt_rekey_at && s->ipsec.life.seconds)
+		t->rekey = now + (esp_rekey_time(s) - wall) * 1000;
+	if (opt_rekey_at && s->ipsec.life.kbytes && !s->ipsec.kernel) /* the volume is polled */
+		t->rekey = MIN(t->rekey, now + 1000);
+	if (!s->ipsec.esn && !s->ipsec.kernel) /* and so is the sequence number */
+		t->rekey = MIN(t->rekey, now + REKEY_RETRY * 1000);
+
+	t->grace = TIMER_NEVER;
+#ifdef HAVE_XFRM
+	if (s->ipsec.kernel) {
+		time_t until = xfrm_grace(s, wall);
+
+		if (until)
+			t->grace = now + (until - wall) * 1000;
+	}
+#endif
+
+	DEBUG(2,printf("lifetime status: %ld of %u seconds used, %llu|%llu of %u kbytes used\n",
+		wall - s->ipsec.life.start,
+		s->ipsec.life.seconds,
+		(unsigned long long)esp_life_rx(s)/1024,
+		(unsigned long long)esp_life_tx(s)/1024,
+		s->ipsec.life.kbytes));
+
+	next = MIN(t->ike_keepalive, t->nat_keepalive);
+	if (s->ike.do_dpd)
+		next = MIN(next, s->ike.dpd_seqno != s->ike.dpd_seqno_ack ? t->dpd_retry : t->dpd);
+	next = MIN(next, t->lifetime);
+	next = MIN(next, t->rekey);
+	next = MIN(next, t->grace);
+	return next;
+}
+
+static void arm_timer(int tfd, int64_t deadline)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (deadline != TIMER_NEVER) {
+		its.it_value.tv_sec = deadline / 1000;
+		its.it_value.tv_nsec = (deadline % 1000) * 1000000 + 1; /* zero would disarm */
+	}
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+		logmsg(LOG_ERR, "timerfd_settime: %m");
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Edge triggered event loop: a ready fd is worked off one batch at a time,
+ * in turn with the others, until it would block. All timers share a single
+ * timerfd armed for the nearest deadline, so idle tunnels only wake up when
+ * something is due. Returns -1 if it could not be set up.
+ */
+static int main_loop_epoll(struct sa_block *s, int tun_workers, int ike_relay)
+{
+	struct epoll_event ev[5];
+	struct loop_timers t;
+	int epfd, tfd, n, i;
+	int tun_ready = 0, esp_ready = 0, ike_ready = 0, relay_ready = 0;
+	int esp_fd = (ike_relay != -1) ? -1 : s->esp_fd;
+	int xfrm_fd = -1;
+	int64_t now;
+	uint64_t expirations;
+
+	/* with kernel ESP only IKE and keepalives are left to us */
+	if (s->ipsec.kernel)
+		tun_workers = 1;
+#ifdef HAVE_XFRM
+	if (s->ipsec.kernel)
+		xfrm_fd = xfrm_event_fd();
+#endif
+
+	if (!tun_workers && fcntl(s->tun_fd, F_SETFL, fcntl(s->tun_fd, F_GETFL) | O_NONBLOCK) == -1)
+		return -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1) {
+		close(epfd);
+		return -1;
+	}
+
+	/* in duplex mode the ESP socket belongs to the receiver thread */
+	if ((!tun_workers && epoll_add(epfd, s->tun_fd, EPOLLIN | EPOLLET) == -1)
+		|| (esp_fd != -1 && epoll_add(epfd, esp_fd, EPOLLIN | EPOLLET) == -1)
+		|| (s->ike_fd != s->esp_fd && epoll_add(epfd, s->ike_fd, EPOLLIN | EPOLLET) == -1)
+		|| (ike_relay != -1 && epoll_add(epfd, ike_relay, EPOLLIN | EPOLLET) == -1)
+		|| (xfrm_fd != -1 && epoll_add(epfd, xfrm_fd, EPOLLIN) == -1)
+		|| epoll_add(epfd, tfd, EPOLLIN) == -1) {
+		close(tfd);
+		close(epfd);
+		return -1;
+	}
+
+	/* everything enabled is due right away, sending the initial requests */
+	now = mono_ms();
+	memset(&t, 0, sizeof(t));
+	t.ike_keepalive = t.nat_keepalive = t.dpd = t.dpd_retry = TIMER_NEVER;
+	if (s->ipsec.encap_mode != IPSEC_ENCAP_TUNNEL) {
+		if (s->ike_fd != s->esp_fd)
+			t.ike_keepalive = now;
+		t.nat_keepalive = now;
+		t.nat_tx = esp_life_tx(s) - 1;
+	}
+	if (s->ike.do_dpd)
+		t.dpd = t.dpd_retry = now;
+	arm_timer(tfd, run_timers(s, &t));
+
+	while (!do_kill) {
+		esp_sa_sync(s);
+		n = epoll_wait(epfd, ev, sizeof(ev)/sizeof(ev[0]),
+			(tun_ready || esp_ready || ike_ready || relay_ready) ? 0 : -1);
+		if (n == -1) {
+			if (errno != EINTR)
+				logmsg(LOG_ERR, "epoll_wait: %m");
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == tfd) {
+				if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+					arm_timer(tfd, run_timers(s, &t));
+#ifdef HAVE_XFRM
+			} else if (ev[i].data.fd == xfrm_fd) {
+				/* a soft expire makes the rekey due */
+				xfrm_events();
+				arm_timer(tfd, run_timers(s, &t));
+#endif
+			} else if (ev[i].data.fd == esp_fd)
+				esp_ready = 1;
+			else if (ev[i].data.fd == s->ike_fd)
+				ike_ready = 1;
+			else if (ev[i].data.fd == ike_relay)
+				relay_ready = 1;
+			else
+				tun_ready = 1;
+		}
+
+		if (tun_ready)
+			tun_ready = process_tun(s);
+		if (esp_ready)
+			esp_ready = process_socket(s);
+		if (ike_ready) {
+			ike_ready = process_ike(s, s->ike_fd);
+			/* a rekey starts the grace period of the kernel SA it replaced */
+			if (s->ipsec.kernel)
+				arm_timer(tfd, run_timers(s, &t));
+		}
+		if (relay_ready)
+			relay_ready = process_ike(s, ike_relay);
+	}
+
+	close(tfd);
+	close(epfd);
+	return 0;
+}
+#endif
+
+#ifdef HAVE_URING
+/*
+ * io_uring data path. Every tx slot has either a read of the tunnel
+ * device or the send of its encrypted packet in flight, the ESP socket
+ * has one multishot receive posted which picks buffers from a provided
+ * buffer ring, and the decrypted packets are written to the tunnel
+ * device straight from those buffers. Both buffer areas are registered
+ * with the kernel. One io_uring_enter() submits all new requests and
+ * waits for the next completions.
+ */
+#define URING_TX_SLOTS MAX_BATCH
+#define URING_RX_BUFS 256 /* power of two */
+#define URING_TX_SIZE PKT_SIZE
+#define URING_RX_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) \
+	+ MAX_HEADER + MAX_PACKET)
+
+enum {
+	URING_TUN_READ,
+	URING_ESP_SEND,
+	URING_ESP_RECV,
+	URING_TUN_WRITE,
+	URING_POLL_TIMER,
+	URING_POLL_IKE
+};
+
+#define URING_DATA(op, idx) (((uint64_t)(op) << 32) | (idx))
+
+struct uring_loop {
+	struct uring u;
+	struct sa_block *s;
+	uint8_t *tx; /* URING_TX_SLOTS * URING_TX_SIZE, registered buffer 0 */
+	uint8_t *rx; /* URING_RX_BUFS * URING_RX_SIZE, registered buffer 1 */
+	struct pkt txp[URING_TX_SLOTS]; /* descriptors of the tx slots */
+	struct pkt rxp[URING_RX_BUFS]; /* and of the rx buffers */
+	unsigned int tx_len[URING_TX_SLOTS];
+	struct msghdr tx_msg[URING_TX_SLOTS];
+	struct iovec tx_iov[URING_TX_SLOTS];
+	unsigned int rx_len[URING_RX_BUFS];
+	struct msghdr rx_msg;
+	struct io_uring_sqe *last_send, *last_write; /* tails of the linked batches */
+	int recycled;
+	int tfd;
+	struct loop_timers t;
+};
+
+/* Get a submission entry, pushing the queued ones to the kernel if full */
+static struct io_uring_sqe *uring_loop_sqe(struct uring_loop *l)
+{
+	struct io_uring_sqe *sqe;
+
+	while ((sqe = uring_get_sqe(&l->u)) == NULL) {
+		uring_submit(&l->u, 0);
+		l->last_send = l->last_write = NULL;
+	}
+	return sqe;
+}
+
+static void uring_tun_read(struct uring_loop *l, unsigned int slot)
+{
+	struct io_uring_sqe *sqe = uring_loop_sqe(l);
+	int size;
+
+	size = tun_frame_reset(&l->txp[slot]);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = l->s->tun_fd;
+	sqe->addr = (unsigned long)l->txp[slot].data;
+	sqe->len = size;
+	sqe->off = (uint64_t)-1;
+	sqe->buf_index = 0;
+	sqe->user_data = URING_DATA(URING_TUN_READ, slot);
+}
+
+/*
+ * Send the packet queued by send_peer. Sends of one round are hard
+ * linked so they leave in the order they were read, a failing one
+ * does not cancel the rest.
+ */
+static void uring_esp_send(struct uring_loop *l, unsigned int slot)
+{
+	struct esp_batch *b = l->s->ipsec.txb;
+	struct io_uring_sqe *sqe = uring_loop_sqe(l);
+	struct pkt *p = pkt_ring_pop(&b->send);
+
+	l->tx_len[slot] = p->len;
+	if (b->to_dst) {
+		l->tx_iov[slot].iov_base = p->data;
+		l->tx_iov[slot].iov_len = p->len;
+		memset(&l->tx_msg[slot], 0, sizeof(struct msghdr));
+		l->tx_msg[slot].msg_name = &b->dstaddr;
+		l->tx_msg[slot].msg_namelen = sizeof(struct sockaddr_in);
+		l->tx_msg[slot].msg_iov = &l->tx_iov[slot];
+		l->tx_msg[slot].msg_iovlen = 1;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (unsigned long)&l->tx_msg[slot];
+		sqe->len = 1;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (unsigned long)p->data;
+		sqe->len = p->len;
+	}
+	sqe->fd = l->s->esp_fd;
+	sqe->user_data = URING_DATA(URING_ESP_SEND, slot);
+
+	if (l->last_send)
+		l->last_send->flags |= IOSQE_IO_HARDLINK;
+	l->last_send = sqe;
+}
+
+static void uring_esp_recv(struct uring_loop *l)
+{
+	struct io_uring_sqe *sqe = uring_loop_sqe(l);
+
+	memset(&l->rx_msg, 0, sizeof(struct msghdr));
+	l->rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = l->s->esp_fd;
+	sqe->addr = (unsigned long)&l->rx_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = URING_DATA(URING_ESP_RECV, 0);
+}
+
+/* Write the decapsulated packet in rx buffer bid, linked like the sends */
+static void uring_tun_write(struct uring_loop *l, unsigned int bid)
+{
+	struct io_uring_sqe *sqe = uring_loop_sqe(l);
+	uint8_t *start;
+
+	l->rx_len[bid] = tun_frame_ip(l->s, &l->rxp[bid], &start);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = l->s->tun_fd;
+	sqe->addr = (unsigned long)start;
+	sqe->len = l->rx_len[bid];
+	sqe->off = (uint64_t)-1;
+	sqe->buf_index = 1;
+	sqe->user_data = URING_DATA(URING_TUN_WRITE, bid);
+	hex_dump("Tx pkt", start, l->rx_len[bid], NULL);
+
+	if (l->last_write)
+		l->last_write->flags |= IOSQE_IO_HARDLINK;
+	l->last_write = sqe;
+}
+
+static void uring_poll(struct uring_loop *l, int fd, int op)
+{
+	struct io_uring_sqe *sqe = uring_loop_sqe(l);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_DATA(op, 0);
+}
+
+static void uring_rx_recycle(struct uring_loop *l, unsigned int bid)
+{
+	uring_buf_ring_add(&l->u, l->rx + bid * URING_RX_SIZE, URING_RX_SIZE, bid);
+	l->recycled = 1;
+}
+
+static void uring_handle_recv(struct uring_loop *l, struct io_uring_cqe *cqe)
+{
+	struct io_uring_recvmsg_out *out;
+	struct sockaddr_in from;
+	struct pkt *p;
+	unsigned int bid;
+	uint8_t *buf;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* ENOBUFS: all buffers are busy, rearm once some came back */
+		if (cqe->res < 0 && cqe->res != -ENOBUFS)
+			logmsg(LOG_ERR, "esp recvmsg: %s", strerror(-cqe->res));
+		uring_esp_recv(l);
+	}
+	if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = l->rx + bid * URING_RX_SIZE;
+	out = (struct io_uring_recvmsg_out *)buf;
+	if (out->flags & MSG_TRUNC || out->namelen > sizeof(struct sockaddr_in)) {
+		uring_rx_recycle(l, bid);
+		return;
+	}
+
+	memset(&from, 0, sizeof(from));
+	memcpy(&from, buf + sizeof(*out), out->namelen);
+
+	/* the recvmsg header in front leaves room for an ethernet header */
+	p = &l->rxp[bid];
+	pkt_reset(p, sizeof(*out) + sizeof(struct sockaddr_in) + out->controllen);
+	p->len = out->payloadlen;
+
+	if (process_socket_packet(l->s, p, &from))
+		uring_tun_write(l, bid);
+	else
+		uring_rx_recycle(l, bid);
+}
+
+static void uring_handle_cqe(struct uring_loop *l, struct io_uring_cqe *cqe)
+{
+	struct sa_block *s = l->s;
+	unsigned int idx = cqe->user_data & 0xffffffff;
+	uint64_t expirations;
+
+	switch (cqe->user_data >> 32) {
+	case URING_TUN_READ:
+		if (cqe->res < 0) {
+			if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+				logmsg(LOG_ERR, "read: %s", strerror(-cqe->res));
+				break; /* the slot stays idle */
+			}
+		} else {
+			l->txp[idx].len = cqe->res;
+			if (process_tun_frame(s, &l->txp[idx])) {
+				esp_batch_seal_all(s);
+				uring_esp_send(l, idx);
+				break;
+			}
+		}
+		uring_tun_read(l, idx);
+		break;
+	case URING_ESP_SEND:
+		if (cqe->res < 0)
+			logmsg(LOG_ERR, "esp send: %s", strerror(-cqe->res));
+		else if ((unsigned int)cqe->res != l->tx_len[idx])
+			logmsg(LOG_ALERT, "esp truncated out (%d out of %u)", cqe->res, l->tx_len[idx]);
+		uring_tun_read(l, idx);
+		break;
+	case URING_ESP_RECV:
+		uring_handle_recv(l, cqe);
+		break;
+	case URING_TUN_WRITE:
+		if (cqe->res < 0)
+			logmsg(LOG_ERR, "tun write: %s", strerror(-cqe->res));
+		else if ((unsigned int)cqe->res != l->rx_len[idx])
+			logmsg(LOG_ERR, "truncated in: %u -> %d\n", l->rx_len[idx], cqe->res);
+		uring_rx_recycle(l, idx);
+		break;
+	case URING_POLL_TIMER:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_poll(l, l->tfd, URING_POLL_TIMER);
+		if (read(l->tfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			arm_timer(l->tfd, run_timers(s, &l->t));
+		break;
+	case URING_POLL_IKE:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_poll(l, s->ike_fd, URING_POLL_IKE);
+		while (process_ike(s, s->ike_fd) && !do_kill)
+			;
+		break;
+	}
+}
+
+/*
+ * Set up the rings and buffers, returns -1 if the kernel lacks
+ * anything needed.
+ */
+static int uring_loop_init(struct uring_loop *l, struct sa_block *s)
+{
+	struct iovec iov[2];
+	unsigned int i;
+
+	memset(l, 0, sizeof(*l));
+	l->s = s;
+	if (uring_init(&l->u, 4 * URING_TX_SLOTS) == -1)
+		return -1;
+
+	l->tx = mmap(NULL, URING_TX_SLOTS * URING_TX_SIZE + URING_RX_BUFS * URING_RX_SIZE,
+		PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (l->tx == MAP_FAILED) {
+		uring_exit(&l->u);
+		return -1;
+	}
+	l->rx = l->tx + URING_TX_SLOTS * URING_TX_SIZE;
+
+	iov[0].iov_base = l->tx;
+	iov[0].iov_len = URING_TX_SLOTS * URING_TX_SIZE;
+	iov[1].iov_base = l->rx;
+	iov[1].iov_len = URING_RX_BUFS * URING_RX_SIZE;
+	if (uring_register_buffers(&l->u, iov, 2) == -1
+		|| uring_setup_buf_ring(&l->u, URING_RX_BUFS) == -1) {
+		uring_exit(&l->u);
+		munmap(l->tx, iov[0].iov_len + iov[1].iov_len);
+		return -1;
+	}
+
+	for (i = 0; i < URING_TX_SLOTS; i++)
+		pkt_init(&l->txp[i], l->tx + i * URING_TX_SIZE, URING_TX_SIZE);
+	for (i = 0; i < URING_RX_BUFS; i++) {
+		pkt_init(&l->rxp[i], l->rx + i * URING_RX_SIZE, URING_RX_SIZE);
+		uring_rx_recycle(l, i);
+	}
+	uring_buf_ring_publish(&l->u);
+	l->recycled = 0;
+	return 0;
+}
+
+static void uring_loop_exit(struct uring_loop *l)
+{
+	uring_exit(&l->u);
+	munmap(l->tx, URING_TX_SLOTS * URING_TX_SIZE + URING_RX_BUFS * URING_RX_SIZE);
+}
+
+static int main_loop_uring(struct sa_block *s, int tun_workers)
+{
+	struct uring_loop *l;
+	struct io_uring_cqe *cqe;
+	unsigned int i;
+	int64_t now;
+
+	/* a blocking fd lets io_uring wait for data instead of failing with EAGAIN */
+	if (!tun_workers && fcntl(s->tun_fd, F_SETFL, fcntl(s->tun_fd, F_GETFL) & ~O_NONBLOCK) == -1)
+		return -1;
+
+	l = xallocc(sizeof(struct uring_loop));
+	if (uring_loop_init(l, s) == -1) {
+		free(l);
+		return -1;
+	}
+	l->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (l->tfd == -1) {
+		uring_loop_exit(l);
+		free(l);
+		return -1;
+	}
+
+	if (!tun_workers)
+		for (i = 0; i < URING_TX_SLOTS; i++)
+			uring_tun_read(l, i);
+	uring_esp_recv(l);
+	uring_poll(l, l->tfd, URING_POLL_TIMER);
+	if (s->ike_fd != s->esp_fd)
+		uring_poll(l, s->ike_fd, URING_POLL_IKE);
+
+	/* everything enabled is due right away, sending the initial requests */
+	now = mono_ms();
+	l->t.ike_keepalive = l->t.nat_keepalive = l->t.dpd = l->t.dpd_retry = TIMER_NEVER;
+	if (s->ipsec.encap_mode != IPSEC_ENCAP_TUNNEL) {
+		if (s->ike_fd != s->esp_fd)
+			l->t.ike_keepalive = now;
+		l->t.nat_keepalive = now;
+		l->t.nat_tx = esp_life_tx(s) - 1;
+	}
+	if (s->ike.do_dpd)
+		l->t.dpd = l->t.dpd_retry = now;
+	arm_timer(l->tfd, run_timers(s, &l->t));
+
+	while (!do_kill) {
+		esp_sa_sync(s);
+		if (uring_submit(&l->u, 1) == -1 && errno != EINTR) {
+			logmsg(LOG_ERR, "io_uring_enter: %m");
+			break;
+		}
+		l->last_send = l->last_write = NULL;
+
+		while ((cqe = uring_peek_cqe(&l->u)) != NULL) {
+			uring_handle_cqe(l, cqe);
+			uring_cqe_seen(&l->u);
+		}
+		if (l->recycled) {
+			uring_buf_ring_publish(&l->u);
+			l->recycled = 0;
+		}
+	}
+
+	close(l->tfd);
+	uring_loop_exit(l);
+	free(l);
+	return 0;
+}
+#endif
+
+static void vpnc_main_loop(struct sa_block *s)
+{
+	int tun_workers, ike_relay;
+
+#ifdef HAVE_XFRM
+	if (s->ipsec.kernel) {
+		if (main_loop_epoll(s, 0, -1) == -1)
+			logmsg(LOG_ERR, "epoll setup failed: %m");
+		goto done;
+	}
+#endif
+
+#if !defined(__CYGWIN__)
+	/* batches drain the tunnel device until it would block */
+	if (opt_batch > 1 && fcntl(s->tun_fd, F_SETFL, fcntl(s->tun_fd, F_GETFL) | O_NONBLOCK) == -1) {
+		logmsg(LOG_WARNING, "can't make tunnel device non-blocking, batching disabled: %m");
+		s->ipsec.txb->max = 1;
+	}
+#else
+	/* the tun thread reads blocking */
+	s->ipsec.txb->max = 1;
+#endif
+
+	/* with a multi-queue device the workers read the tunnel */
+	tun_workers = s->tun_queues > 1 && esp_workers_start(s, s->tun_queue_fd, s->tun_queues);
+
+#ifdef HAVE_URING
+	if (opt_io_uring && !opt_duplex) {
+		if (main_loop_uring(s, tun_workers) == 0)
+			goto done;
+		logmsg(LOG_WARNING, "io_uring setup failed, falling back to epoll: %m");
+	}
+#endif
+	/* the batches of the loops below are sealed and opened by the workers */
+	esp_crypto_start(s);
+
+	/* threads of their own for both directions, the loop keeps IKE */
+	ike_relay = esp_duplex_start(s, &tun_workers);
+
+#ifdef HAVE_EPOLL
+	if (main_loop_epoll(s, tun_workers, ike_relay) == -1) {
+		logmsg(LOG_WARNING, "epoll setup failed, falling back to select: %m");
+		main_loop_select(s, tun_workers, ike_relay);
+	}
+#else
+	main_loop_select(s, tun_workers, ike_relay);
+#endif
+
+#if defined(HAVE_URING) || defined(HAVE_XFRM)
+done:
+#endif
+	/* the crypto workers go last, the others may wait for them */
+	esp_duplex_stop();
+	esp_workers_stop();
+	esp_crypto_stop(s);
 
 	switch (do_kill) {
 		case -2:
@@ -1000,35 +3044,28 @@ void vpnc_doit(struct sa_block *s)
 	}
 	s->ipsec.em = &meth;
 
-	s->ipsec.rx.key_cry = s->ipsec.rx.key;
-	hex_dump("rx.key_cry", s->ipsec.rx.key_cry, s->ipsec.key_len, NULL);
-
-	s->ipsec.rx.key_md = s->ipsec.rx.key + s->ipsec.key_len;
-	hex_dump("rx.key_md", s->ipsec.rx.key_md, s->ipsec.md_len, NULL);
-
-	if (s->ipsec.cry_algo) {
-		gcry_cipher_open(&s->ipsec.rx.cry_ctx, s->ipsec.cry_algo, GCRY_CIPHER_MODE_CBC, 0);
-		gcry_cipher_setkey(s->ipsec.rx.cry_ctx, s->ipsec.rx.key_cry, s->ipsec.key_len);
-	} else {
-		s->ipsec.rx.cry_ctx = NULL;
-	}
-
-	s->ipsec.tx.key_cry = s->ipsec.tx.key;
-	hex_dump("tx.key_cry", s->ipsec.tx.key_cry, s->ipsec.key_len, NULL);
+	esp_sa_publish(s);
+	esp_sa_attach(s);
 
-	s->ipsec.tx.key_md = s->ipsec.tx.key + s->ipsec.key_len;
-	hex_dump("tx.key_md", s->ipsec.tx.key_md, s->ipsec.md_len, NULL);
-
-	if (s->ipsec.cry_algo) {
-		gcry_cipher_open(&s->ipsec.tx.cry_ctx, s->ipsec.cry_algo, GCRY_CIPHER_MODE_CBC, 0);
-		gcry_cipher_setkey(s->ipsec.tx.cry_ctx, s->ipsec.tx.key_cry, s->ipsec.key_len);
-	} else {
-		s->ipsec.tx.cry_ctx = NULL;
+#ifdef HAVE_XFRM
+	if (opt_kernel_ipsec) {
+		if (xfrm_start(s) == 0)
+			s->ipsec.kernel = 1;
+		else
+			logmsg(LOG_WARNING, "can't hand ESP to the kernel, staying in userspace: %m");
 	}
+#endif
 
 	DEBUG(2, printf("remote -> local spi: %#08x\n", ntohl(s->ipsec.rx.spi)));
 	DEBUG(2, printf("local -> remote spi: %#08x\n", ntohl(s->ipsec.tx.spi)));
 
+	s->ipsec.txb = esp_batch_new(s, opt_batch);
+	s->ipsec.rxb = esp_batch_new(s, opt_batch);
+#ifdef HAVE_UDP_GSO
+	if (s->ipsec.encap_mode != IPSEC_ENCAP_TUNNEL && opt_udp_offload)
+		esp_batch_udp_offload(s);
+#endif
+
 	do_kill = 0;
 
 	sigaction(SIGHUP, NULL, &act);
@@ -1067,6 +3104,17 @@ void vpnc_doit(struct sa_block *s)
 
 	vpnc_main_loop(s);
 
+#ifdef HAVE_XFRM
+	if (s->ipsec.kernel) {
+		xfrm_stop(s);
+		s->ipsec.kernel = 0;
+	}
+#endif
+	esp_batch_free(s->ipsec.txb);
+	esp_batch_free(s->ipsec.rxb);
+	s->ipsec.txb = s->ipsec.rxb = NULL;
+	esp_sa_free_all(s);
+
 	if (pidfile)
 		unlink(pidfile); /* ignore errors */
 }
@@ -22,34 +22,81 @@
 #define __TUNIP_H__
 
 #include "isakmp.h"
+#include "replay.h"
 
 #include <time.h>
 #include <net/if.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
 
 struct lifetime {
 	time_t   start;
 	uint32_t seconds;
 	uint32_t kbytes;
-	uint32_t rx;
-	uint32_t tx;
+	uint64_t rx;
+	uint64_t tx;
 };
 
+/* One direction of the IPsec SA as negotiated by the main thread */
 struct ike_sa {
 	uint32_t spi;
-	uint32_t seq_id; /* for replay protection (not implemented) */
+	uint8_t *key; /* keymat: key_cry, salt, key_md */
+};
 
+/*
+ * One direction of an IPsec SA as the data path sees it. Never changed
+ * once published, except for the sequence counter: a rekey builds new
+ * ones next to the old, esp_sa_publish() swaps them in and the old ones
+ * are freed once no thread can still be using them.
+ */
+struct esp_sa {
+	uint32_t spi;
+	uint64_t seq_id; /* tx: next sequence number to send */
 	uint8_t *key;
-	uint8_t *key_cry;
-	gcry_cipher_hd_t cry_ctx;
-	uint8_t *key_md;
+	uint8_t *iv_key; /* tx, CBC: IVs are the sequence numbers encrypted under it */
+	unsigned int id; /* unique, unlike the address */
+	unsigned int refs; /* sets holding it, main thread only */
+	struct ip ip; /* tx: outer header for IP ESP, ip_len, ip_id and ip_tos 0 */
+};
 
-	/* Description of the packet being processed */
-	unsigned char *buf;
-	unsigned int bufsize, bufpayload, var_header_size;
-	int buflen;
+#define ESP_REKEY_SEQ 0xf0000000u /* without ESN, rekey by this sequence number */
+
+#define ESP_RX_SAS 4 /* inbound SAs accepted at the same time */
+#define ESP_RX_HASH 16 /* slots of the SPI table, a power of two */
+
+/* The SAs in use, published as a whole through s->ipsec.sas */
+struct esp_sa_set {
+	struct esp_sa *tx;
+	/* the current inbound SA first, then the ones it replaced */
+	struct esp_sa *rx[ESP_RX_SAS];
+	time_t rx_until[ESP_RX_SAS]; /* end of their grace period */
+	int nrx;
+	uint8_t rx_hash[ESP_RX_HASH]; /* by SPI: 1 + index into rx, 0 if empty */
+	unsigned int epoch;
+	struct esp_sa_set *next; /* retired, waiting to be freed */
+};
+
+/* The contexts a thread keeps for one esp_sa */
+struct esp_ctx {
+	struct esp_sa *sa; /* keyed for, NULL if none */
+	unsigned int id; /* of sa */
+	struct replay_window replay; /* rx only */
+	uint8_t salt[4]; /* implicit part of the AEAD nonce */
+	gcry_cipher_hd_t cry_ctx;
+	gcry_cipher_hd_t iv_ctx; /* ECB, keyed with sa->iv_key */
+	struct aes_mb_key *mb; /* tx, AES-CBC with AES-NI: the expanded key */
+	struct esp_ossl *ossl; /* OpenSSL's contexts (OPENSSL_ESP) */
+	gcry_md_hd_t md_ctx; /* keyed once, reset per packet */
+	const struct esp_provider *prov; /* keyed the contexts above, NULL if none */
 };
 
 struct encap_method; /* private to tunip.c */
+struct esp_batch; /* private to tunip.c */
+struct esp_crypto; /* private to tunip.c */
+struct aes_mb_key; /* aes-mb.h */
+struct esp_ossl; /* esp-openssl.h */
+struct esp_provider; /* private to esp.c */
 
 enum natt_active_mode_enum{
 	NATT_ACTIVE_NONE,
@@ -62,6 +109,9 @@ struct sa_block {
 	const char *pidfile;
 
 	int tun_fd; /* fd to host via tun/tap */
+	int tun_queue_fd[MAX_TUN_QUEUES]; /* multi-queue device, [0] == tun_fd */
+	int tun_queues;
+	int tun_vnet_hdr; /* packets on tun_fd carry a struct virtio_net_hdr */
 	char tun_name[IFNAMSIZ];
 	uint8_t tun_hwaddr[ETH_ALEN];
 
@@ -110,20 +160,32 @@ struct sa_block {
 	struct in_addr our_address;
 	struct {
 		int do_pfs;
-		int cry_algo, md_algo;
-		size_t key_len, md_len;
+		int cry_algo, cry_mode, md_algo;
+		size_t key_len, salt_len, md_len;
 		size_t blk_len, iv_len;
+		size_t icv_len; /* truncated HMAC or AEAD tag */
+		int esn; /* 64 bit sequence numbers (RFC 4304) */
 		uint16_t encap_mode;
 		uint16_t peer_udpencap_port;
 		enum natt_active_mode_enum natt_active_mode;
 		struct lifetime life;
-		struct ike_sa rx, tx;
+		struct ike_sa rx, tx; /* being negotiated */
+		struct esp_sa_set *sas; /* published, see esp_sa_publish() */
+		struct esp_ctx tx_ctx, rx_ctx[ESP_RX_SAS]; /* this thread's, as in sas */
+		struct esp_sa_set *set; /* the contexts are keyed for */
+		int reader; /* slot in esp_reader_epoch[], -1 for the main thread */
 		struct encap_method *em;
+		struct esp_batch *txb, *rxb;
+		struct esp_crypto *crypto; /* crypto workers, NULL: crypto inline */
+		struct sa_block *shared; /* worker copies: owner of sas and ip_id */
+		int ike_relay; /* receiver thread copy: IKE from the ESP socket goes here */
 		uint16_t ip_id;
+		int kernel; /* SAs installed in the kernel, which carries ESP (xfrm.c) */
 	} ipsec;
 };
 
 extern int volatile do_kill;
 extern void vpnc_doit(struct sa_block *s);
+extern void esp_sa_publish(struct sa_block *s);
 
 #endif
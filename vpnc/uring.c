@@ -0,0 +1,228 @@
+/* Minimal io_uring interface, without liburing
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/*
+ * The rings are shared with the kernel: tails we publish need release
+ * semantics, heads and tails the kernel publishes need acquire.
+ */
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+	unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Set up a ring with room for at least "entries" submissions.
+ * Only kernels with a single issuer ring (6.0 and later) are accepted,
+ * they also have the multishot receive and provided buffer rings
+ * used by the data path. Returns -1 with errno set on failure.
+ */
+int uring_init(struct uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	size_t cq_size;
+	void *ring;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd == -1)
+		return -1;
+	u->features = p.features;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		close(u->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > u->ring_size)
+		u->ring_size = cq_size;
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		close(u->fd);
+		return -1;
+	}
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		munmap(ring, u->ring_size);
+		close(u->fd);
+		return -1;
+	}
+
+	u->ring = ring;
+	u->sq_head = (unsigned int *)((char *)ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)ring + p.sq_off.tail);
+	u->sq_array = (unsigned int *)((char *)ring + p.sq_off.array);
+	u->sq_mask = *(unsigned int *)((char *)ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+
+	u->cq_head = (unsigned int *)((char *)ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)((char *)ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)ring + p.cq_off.cqes);
+	return 0;
+}
+
+void uring_exit(struct uring *u)
+{
+	if (u->br)
+		munmap(u->br, (u->br_mask + 1) * sizeof(struct io_uring_buf));
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->fd);
+	u->fd = -1;
+}
+
+/*
+ * Get a cleared submission entry, or NULL if the queue is full.
+ * Entries are passed to the kernel by the next uring_submit().
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (u->sq_local_tail - load_acquire(u->sq_head) >= u->sq_entries)
+		return NULL;
+	idx = u->sq_local_tail & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for at least wait_nr completions,
+ * all in one syscall. Returns -1 with errno set on failure.
+ */
+int uring_submit(struct uring *u, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int ret;
+
+	to_submit = u->sq_local_tail - *u->sq_tail;
+	store_release(u->sq_tail, u->sq_local_tail);
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(u->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret == -1 && errno == EINTR && wait_nr == 0);
+	return ret == -1 ? -1 : 0;
+}
+
+/* Next completion, or NULL if there is none */
+struct io_uring_cqe *uring_peek_cqe(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+
+	if (head == load_acquire(u->cq_tail))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *u)
+{
+	store_release(u->cq_head, *u->cq_head + 1);
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int n)
+{
+	return sys_io_uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, n) == -1 ? -1 : 0;
+}
+
+/*
+ * Set up the ring of buffers the kernel picks from for multishot
+ * receives (buffer group 0). entries must be a power of two.
+ */
+int uring_setup_buf_ring(struct uring *u, unsigned int entries)
+{
+	struct io_uring_buf_reg reg;
+	size_t size = entries * sizeof(struct io_uring_buf);
+	void *br;
+
+	br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (br == MAP_FAILED)
+		return -1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)br;
+	reg.ring_entries = entries;
+	reg.bgid = 0;
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		munmap(br, size);
+		return -1;
+	}
+
+	u->br = br;
+	u->br_mask = entries - 1;
+	u->br_tail = 0;
+	return 0;
+}
+
+/* Hand a buffer (back) to the kernel, visible after uring_buf_ring_publish() */
+void uring_buf_ring_add(struct uring *u, void *addr, unsigned int len, uint16_t bid)
+{
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & u->br_mask];
+
+	buf->addr = (unsigned long)addr;
+	buf->len = len;
+	buf->bid = bid;
+	u->br_tail++;
+}
+
+void uring_buf_ring_publish(struct uring *u)
+{
+	store_release(&u->br->tail, u->br_tail);
+}
+
+#endif
@@ -0,0 +1,65 @@
+/* Minimal io_uring interface, without liburing
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "sysdep.h"
+
+#ifdef HAVE_URING
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned int features;
+
+	/* submission queue */
+	unsigned int *sq_head, *sq_tail, *sq_array;
+	unsigned int sq_mask, sq_entries;
+	unsigned int sq_local_tail; /* sqes handed out, not yet published */
+	struct io_uring_sqe *sqes;
+
+	/* completion queue */
+	unsigned int *cq_head, *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring; /* one mapping for both queues */
+	size_t ring_size, sqes_size;
+
+	/* provided buffer ring, group 0 */
+	struct io_uring_buf_ring *br;
+	unsigned int br_mask;
+	uint16_t br_tail;
+};
+
+extern int uring_init(struct uring *u, unsigned int entries);
+extern void uring_exit(struct uring *u);
+extern struct io_uring_sqe *uring_get_sqe(struct uring *u);
+extern int uring_submit(struct uring *u, unsigned int wait_nr);
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+extern void uring_cqe_seen(struct uring *u);
+extern int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int n);
+extern int uring_setup_buf_ring(struct uring *u, unsigned int entries);
+extern void uring_buf_ring_add(struct uring *u, void *addr, unsigned int len, uint16_t bid);
+extern void uring_buf_ring_publish(struct uring *u);
+
+#endif
+#endif
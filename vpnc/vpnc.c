@@ -37,6 +37,7 @@
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
+#include <syslog.h>
 
 #include <gcrypt.h>
 
@@ -48,6 +49,7 @@
 #include "dh.h"
 #include "vpnc.h"
 #include "tunip.h"
+#include "esp.h"
 #include "supp.h"
 
 #if defined(__CYGWIN__)
@@ -289,14 +291,6 @@ static void cleanup(struct sa_block *s) {
 		free(s->ipsec.tx.key);
 		s->ipsec.tx.key = NULL;
 	}
-	if (s->ipsec.rx.cry_ctx) {
-		gcry_cipher_close(s->ipsec.rx.cry_ctx);
-		s->ipsec.rx.cry_ctx = NULL;
-	}
-	if (s->ipsec.tx.cry_ctx) {
-		gcry_cipher_close(s->ipsec.tx.cry_ctx);
-		s->ipsec.tx.cry_ctx = NULL;
-	}
 }
 
 static void init_sockaddr(struct in_addr *dst, const char *hostname)
@@ -335,21 +329,55 @@ static void init_netaddr(struct in_addr *net, const char *string)
 
 static void setup_tunnel(struct sa_block *s)
 {
+	int i;
+#ifdef HAVE_TUN_QUEUES
+	int vnet_hdr;
+#endif
+
 	setenv("reason", "pre-init", 1);
 	system(config[CONFIG_SCRIPT]);
 
 	if (config[CONFIG_IF_NAME])
 		memcpy(s->tun_name, config[CONFIG_IF_NAME], strlen(config[CONFIG_IF_NAME]));
 
+#ifdef HAVE_TUN_QUEUES
+	vnet_hdr = 0;
+#ifdef HAVE_TUN_OFFLOAD
+	/* the io_uring path reads into packet sized buffers */
+	vnet_hdr = opt_tun_offload && opt_if_mode == IF_MODE_TUN && !opt_io_uring;
+#endif
+	if (opt_tun_queues > 1 || vnet_hdr) {
+		s->tun_queues = tun_open_queues(s->tun_name, opt_if_mode, s->tun_queue_fd, opt_tun_queues, vnet_hdr);
+		if (s->tun_queues == -1) {
+			logmsg(LOG_WARNING, "can't open multi-queue or offloading tunnel interface, using a plain one");
+			s->tun_queues = 0;
+		} else {
+			s->tun_vnet_hdr = vnet_hdr;
+			if (s->tun_queues < opt_tun_queues)
+				logmsg(LOG_WARNING, "only %d of %d tunnel queues available", s->tun_queues, opt_tun_queues);
+		}
+	}
+	if (s->tun_queues > 0)
+		s->tun_fd = s->tun_queue_fd[0];
+	else
+#else
+	if (opt_tun_queues > 1)
+		logmsg(LOG_WARNING, "multi-queue tunnel interface not supported on this platform");
+#endif
 	s->tun_fd = tun_open(s->tun_name, opt_if_mode);
 	DEBUG(2, printf("using interface %s\n", s->tun_name));
 	setenv("TUNDEV", s->tun_name, 1);
 
 	if (s->tun_fd == -1)
 		error(1, errno, "can't initialise tunnel interface");
+	if (s->tun_queues == 0) {
+		s->tun_queue_fd[0] = s->tun_fd;
+		s->tun_queues = 1;
+	}
 #ifdef FD_CLOEXEC
 	/* do not pass socket to vpnc-script, etc. */
-	fcntl(s->tun_fd, F_SETFD, FD_CLOEXEC);
+	for (i = 0; i < s->tun_queues; i++)
+		fcntl(s->tun_queue_fd[i], F_SETFD, FD_CLOEXEC);
 #endif
 
 	if (opt_if_mode == IF_MODE_TAP) {
@@ -398,6 +426,8 @@ static void close_tunnel(struct sa_block *s)
 {
 	setenv("reason", "disconnect", 1);
 	system(config[CONFIG_SCRIPT]);
+	while (--s->tun_queues > 0)
+		close(s->tun_queue_fd[s->tun_queues]);
 	tun_close(s->tun_fd, s->tun_name);
 }
 
@@ -818,29 +848,32 @@ void dpd_ike(struct sa_block *s)
 	}
 }
 
+static void send_delete_esp(struct sa_block *s, uint32_t rx_spi, uint32_t tx_spi)
+{
+	struct isakmp_payload *d_ipsec;
+	uint8_t del_msgid;
+
+	gcry_create_nonce((uint8_t *) & del_msgid, sizeof(del_msgid));
+	d_ipsec = new_isakmp_payload(ISAKMP_PAYLOAD_D);
+	d_ipsec->u.d.doi = ISAKMP_DOI_IPSEC;
+	d_ipsec->u.d.protocol = ISAKMP_IPSEC_PROTO_IPSEC_ESP;
+	d_ipsec->u.d.spi_length = 4;
+	d_ipsec->u.d.num_spi = 2;
+	d_ipsec->u.d.spi = xallocc(2 * sizeof(uint8_t *));
+	d_ipsec->u.d.spi[0] = xallocc(d_ipsec->u.d.spi_length);
+	memcpy(d_ipsec->u.d.spi[0], &rx_spi, 4);
+	d_ipsec->u.d.spi[1] = xallocc(d_ipsec->u.d.spi_length);
+	memcpy(d_ipsec->u.d.spi[1], &tx_spi, 4);
+	sendrecv_phase2(s, d_ipsec, ISAKMP_EXCHANGE_INFORMATIONAL,
+		del_msgid, 1, NULL, 0, NULL, 0);
+}
+
 static void send_delete_ipsec(struct sa_block *s)
 {
 	/* 2007-08-31 JKU/ZID: Sonicwall doesn't like the chained
 	 * request but wants them split. Cisco does fine with it. */
 	DEBUGTOP(2, printf("S7.10 send ipsec termination message\n"));
-	{
-		struct isakmp_payload *d_ipsec;
-		uint8_t del_msgid;
-
-		gcry_create_nonce((uint8_t *) & del_msgid, sizeof(del_msgid));
-		d_ipsec = new_isakmp_payload(ISAKMP_PAYLOAD_D);
-		d_ipsec->u.d.doi = ISAKMP_DOI_IPSEC;
-		d_ipsec->u.d.protocol = ISAKMP_IPSEC_PROTO_IPSEC_ESP;
-		d_ipsec->u.d.spi_length = 4;
-		d_ipsec->u.d.num_spi = 2;
-		d_ipsec->u.d.spi = xallocc(2 * sizeof(uint8_t *));
-		d_ipsec->u.d.spi[0] = xallocc(d_ipsec->u.d.spi_length);
-		memcpy(d_ipsec->u.d.spi[0], &s->ipsec.rx.spi, 4);
-		d_ipsec->u.d.spi[1] = xallocc(d_ipsec->u.d.spi_length);
-		memcpy(d_ipsec->u.d.spi[1], &s->ipsec.tx.spi, 4);
-		sendrecv_phase2(s, d_ipsec, ISAKMP_EXCHANGE_INFORMATIONAL,
-			del_msgid, 1, NULL, 0, NULL, 0);
-	}
+	send_delete_esp(s, s->ipsec.rx.spi, s->ipsec.tx.spi);
 }
 
 static void send_delete_isakmp(struct sa_block *s)
@@ -896,7 +929,7 @@ static uint8_t *gen_keymat(struct sa_block *s,
 	int blksz;
 	int cnt;
 
-	blksz = s->ipsec.md_len + s->ipsec.key_len;
+	blksz = s->ipsec.md_len + s->ipsec.key_len + s->ipsec.salt_len;
 	cnt = (blksz + s->ike.md_len - 1) / s->ike.md_len;
 	block = xallocc(cnt * s->ike.md_len);
 	DEBUG(3, printf("generating %d bytes keymat (cnt=%d)\n", blksz, cnt));
@@ -1176,6 +1209,9 @@ static struct isakmp_payload *make_our_sa_ike(void)
 				continue;
 		}
 		for (crypt = 0; supp_crypt[crypt].name != NULL; crypt++) {
+			/* no combined mode ciphers in IKEv1 phase 1 */
+			if (SUPP_ALGO_IS_AEAD(&supp_crypt[crypt]))
+				continue;
 			keylen = supp_crypt[crypt].keylen;
 			for (hash = 0; supp_hash[hash].name != NULL; hash++) {
 				tn = t;
@@ -2536,72 +2572,133 @@ static struct isakmp_attribute *make_transform_ipsec(struct sa_block *s, int dh_
 
 	if (dh_group)
 		a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_GROUP_DESC, dh_group, a);
-	a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_AUTH_ALG, hash, a);
+	if (hash)
+		a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_AUTH_ALG, hash, a);
 	a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_ENCAP_MODE, s->ipsec.encap_mode, a);
 	if (keylen != 0)
 		a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_KEY_LENGTH, keylen, a);
+	if (opt_esn)
+		a = new_isakmp_attribute_16(ISAKMP_IPSEC_ATTRIB_ESN, ISAKMP_IPSEC_ESN_64, a);
 
 	return a;
 }
 
-static struct isakmp_payload *make_our_sa_ipsec(struct sa_block *s)
+/* prepend the proposals for cipher supp_crypt[crypt] to p, for our inbound SPI rx_spi */
+static struct isakmp_payload *make_proposals_ipsec(struct sa_block *s,
+	struct isakmp_payload *p, int dh_grp, unsigned int crypt, uint32_t rx_spi)
+{
+	struct isakmp_payload *pn;
+	struct isakmp_attribute *a;
+	unsigned int hash, keylen;
+	int aead;
+
+	keylen = supp_crypt[crypt].keylen;
+	aead = SUPP_ALGO_IS_AEAD(&supp_crypt[crypt]);
+	for (hash = 0; supp_hash[hash].name != NULL; hash++) {
+		/* combined mode ciphers are proposed once, without AUTH_ALG */
+		if (aead && hash != 0)
+			break;
+		pn = p;
+		p = new_isakmp_payload(ISAKMP_PAYLOAD_P);
+		p->u.p.spi_size = 4;
+		p->u.p.spi = xallocc(4);
+		/* The sadb_sa_spi field is already in network order.  */
+		memcpy(p->u.p.spi, &rx_spi, 4);
+		p->u.p.prot_id = ISAKMP_IPSEC_PROTO_IPSEC_ESP;
+		p->u.p.transforms = new_isakmp_payload(ISAKMP_PAYLOAD_T);
+		p->u.p.transforms->u.t.id = supp_crypt[crypt].ipsec_sa_id;
+		a = make_transform_ipsec(s, dh_grp, aead ? 0 : supp_hash[hash].ipsec_sa_id, keylen);
+		p->u.p.transforms->u.t.attributes = a;
+		p->next = pn;
+	}
+	return p;
+}
+
+static struct isakmp_payload *make_our_sa_ipsec(struct sa_block *s, uint32_t rx_spi)
 {
 	struct isakmp_payload *r;
 	struct isakmp_payload *p = NULL, *pn;
-	struct isakmp_attribute *a;
 	int dh_grp = get_dh_group_ipsec(s->ipsec.do_pfs)->ipsec_sa_id;
-	unsigned int crypt, hash, keylen;
-	int i;
+	unsigned int crypt;
+	int i, chacha = -1, aes_hw = supp_have_aes_hw();
 
 	r = new_isakmp_payload(ISAKMP_PAYLOAD_SA);
 	r->u.sa.doi = ISAKMP_DOI_IPSEC;
 	r->u.sa.situation = ISAKMP_IPSEC_SIT_IDENTITY_ONLY;
 	for (crypt = 0; supp_crypt[crypt].name != NULL; crypt++) {
-		keylen = supp_crypt[crypt].keylen;
-		for (hash = 0; supp_hash[hash].name != NULL; hash++) {
-			pn = p;
-			p = new_isakmp_payload(ISAKMP_PAYLOAD_P);
-			p->u.p.spi_size = 4;
-			p->u.p.spi = xallocc(4);
-			/* The sadb_sa_spi field is already in network order.  */
-			memcpy(p->u.p.spi, &s->ipsec.rx.spi, 4);
-			p->u.p.prot_id = ISAKMP_IPSEC_PROTO_IPSEC_ESP;
-			p->u.p.transforms = new_isakmp_payload(ISAKMP_PAYLOAD_T);
-			p->u.p.transforms->u.t.id = supp_crypt[crypt].ipsec_sa_id;
-			a = make_transform_ipsec(s, dh_grp, supp_hash[hash].ipsec_sa_id, keylen);
-			p->u.p.transforms->u.t.attributes = a;
-			p->next = pn;
+		/* without AES instructions ChaCha20 goes to the front */
+		if (!aes_hw && supp_crypt[crypt].mode == GCRY_CIPHER_MODE_POLY1305) {
+			chacha = crypt;
+			continue;
 		}
+		p = make_proposals_ipsec(s, p, dh_grp, crypt, rx_spi);
 	}
+	if (chacha != -1)
+		p = make_proposals_ipsec(s, p, dh_grp, chacha, rx_spi);
 	for (i = 0, pn = p; pn; pn = pn->next)
 		pn->u.p.number = i++;
 	r->u.sa.proposals = p;
 	return r;
 }
 
-static void do_phase2_qm(struct sa_block *s)
+/*
+ * Check the algorithms of a phase 2 proposal. Combined mode ciphers
+ * (RFC 4106, RFC 7634) authenticate the packet themselves and come
+ * without AUTH_ALG.
+ */
+static int check_ipsec_algos(int seen_enc, int seen_keylen, int seen_auth)
 {
-	struct isakmp_payload *rp, *us, *ke = NULL, *them, *nonce_r = NULL;
-	struct isakmp_packet *r;
-	struct group *dh_grp = NULL;
-	uint32_t msgid;
-	int reject;
-	uint8_t nonce_i[20], *dh_public = NULL;
+	const supported_algo_t *crypt;
+
+	crypt = get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc, NULL, seen_keylen);
+	if (crypt == NULL)
+		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
+	if (SUPP_ALGO_IS_AEAD(crypt))
+		return seen_auth ? ISAKMP_N_BAD_PROPOSAL_SYNTAX : 0;
+	if (!seen_auth || get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0) == NULL)
+		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
+	return 0;
+}
+
+/* A quick mode exchange we started */
+struct qm_exchange {
+	uint32_t msgid; /* 0 if there is none in flight */
+	uint32_t spi; /* our inbound SPI for the new SA */
+	uint8_t nonce_i[20];
+	struct group *dh_grp;
+	uint8_t *dh_public;
+	int rekey; /* replaces the SA in use, whose algorithms it must keep */
+};
+
+static void qm_free(struct qm_exchange *q)
+{
+	if (q->dh_grp)
+		group_free(q->dh_grp);
+	free(q->dh_public);
+	q->dh_grp = NULL;
+	q->dh_public = NULL;
+	q->msgid = 0;
+}
+
+static void qm_start(struct sa_block *s, struct qm_exchange *q, int sendonly)
+{
+	struct isakmp_payload *rp, *us, *them;
 
 	DEBUGTOP(2, printf("S7.1 QM_packet1\n"));
 	/* Set up the Diffie-Hellman stuff.  */
 	if (get_dh_group_ipsec(s->ipsec.do_pfs)->my_id) {
-		dh_grp = group_get(get_dh_group_ipsec(s->ipsec.do_pfs)->my_id);
-		DEBUG(3, printf("len = %d\n", dh_getlen(dh_grp)));
-		dh_public = xallocc(dh_getlen(dh_grp));
-		dh_create_exchange(dh_grp, dh_public);
-		hex_dump("dh_public", dh_public, dh_getlen(dh_grp), NULL);
+		q->dh_grp = group_get(get_dh_group_ipsec(s->ipsec.do_pfs)->my_id);
+		DEBUG(3, printf("len = %d\n", dh_getlen(q->dh_grp)));
+		q->dh_public = xallocc(dh_getlen(q->dh_grp));
+		dh_create_exchange(q->dh_grp, q->dh_public);
+		hex_dump("dh_public", q->dh_public, dh_getlen(q->dh_grp), NULL);
 	}
 
-	gcry_create_nonce((uint8_t *) & s->ipsec.rx.spi, sizeof(s->ipsec.rx.spi));
-	rp = make_our_sa_ipsec(s); /* FIXME: LEAK: allocated memory never freed */
-	gcry_create_nonce((uint8_t *) nonce_i, sizeof(nonce_i));
-	rp->next = new_isakmp_data_payload(ISAKMP_PAYLOAD_NONCE, nonce_i, sizeof(nonce_i));
+	/* s->ipsec.rx keeps the SA in use until qm_finish() */
+	gcry_create_nonce((uint8_t *) & q->spi, sizeof(q->spi));
+	rp = make_our_sa_ipsec(s, q->spi); /* FIXME: LEAK: allocated memory never freed */
+	gcry_create_nonce((uint8_t *) q->nonce_i, sizeof(q->nonce_i));
+	rp->next = new_isakmp_data_payload(ISAKMP_PAYLOAD_NONCE, q->nonce_i, sizeof(q->nonce_i));
 
 	us = new_isakmp_payload(ISAKMP_PAYLOAD_ID);
 	us->u.id.type = ISAKMP_IPSEC_ID_IPV4_ADDR;
@@ -2615,52 +2712,60 @@ static void do_phase2_qm(struct sa_block *s)
 	init_netaddr((struct in_addr *)them->u.id.data,
 		     config[CONFIG_IPSEC_TARGET_NETWORK]);
 	us->next = them;
-	s->ipsec.life.start = time(NULL);
 
-	if (!dh_grp) {
+	if (!q->dh_grp) {
 		rp->next->next = us;
 	} else {
 		rp->next->next = new_isakmp_data_payload(ISAKMP_PAYLOAD_KE,
-			dh_public, dh_getlen(dh_grp));
+			q->dh_public, dh_getlen(q->dh_grp));
 		rp->next->next->next = us;
 	}
 
-	gcry_create_nonce((uint8_t *) & msgid, sizeof(msgid));
-	if (msgid == 0)
-		msgid = 1;
+	gcry_create_nonce((uint8_t *) & q->msgid, sizeof(q->msgid));
+	if (q->msgid == 0)
+		q->msgid = 1;
 
 	DEBUGTOP(2, printf("S7.2 QM_packet2 send_receive\n"));
 	sendrecv_phase2(s, rp, ISAKMP_EXCHANGE_IKE_QUICK,
-		msgid, 0, 0, 0, 0, 0);
-
-	DEBUGTOP(2, printf("S7.3 QM_packet2 validate type\n"));
-	reject = do_phase2_notice_check(s, &r, nonce_i, sizeof(nonce_i)); /* FIXME: LEAK */
+		q->msgid, sendonly, 0, 0, 0, 0);
+}
 
+static int qm_check_reply(struct qm_exchange *q, struct isakmp_packet *r)
+{
 	/* Check the transaction type & message ID are OK.  */
-	if (reject == 0 && r->message_id != msgid)
-		reject = ISAKMP_N_INVALID_MESSAGE_ID;
+	if (r->message_id != q->msgid)
+		return ISAKMP_N_INVALID_MESSAGE_ID;
 
-	if (reject == 0 && r->exchange_type != ISAKMP_EXCHANGE_IKE_QUICK)
-		reject = ISAKMP_N_INVALID_EXCHANGE_TYPE;
+	if (r->exchange_type != ISAKMP_EXCHANGE_IKE_QUICK)
+		return ISAKMP_N_INVALID_EXCHANGE_TYPE;
 
 	/* The SA payload must be second.  */
-	if (reject == 0 && r->payload->next->type != ISAKMP_PAYLOAD_SA)
-		reject = ISAKMP_N_INVALID_PAYLOAD_TYPE;
+	if (r->payload->next->type != ISAKMP_PAYLOAD_SA)
+		return ISAKMP_N_INVALID_PAYLOAD_TYPE;
 
-	DEBUGTOP(2, printf("S7.5 QM_packet2 check reject offer\n"));
-	if (reject != 0)
-		phase2_fatal(s, "quick mode response rejected: %s(%d)\n"
-			"this means the concentrator did not like what we had to offer.\n"
-			"Possible reasons are:\n"
-			"  * concentrator configured to require a firewall\n"
-			"     this locks out even Cisco clients on any platform except windows\n"
-			"     which is an obvious security improvement. There is no workaround (yet).\n"
-			"  * concentrator configured to require IP compression\n"
-			"     this is not yet supported by vpnc.\n"
-			"     Note: the Cisco Concentrator Documentation recommends against using\n"
-			"     compression, except on low-bandwith (read: ISDN) links, because it\n"
-			"     uses much CPU-resources on the concentrator\n",
-			reject);
+	return 0;
+}
+
+/* A rekey can't change the algorithms under the data path */
+static int same_ipsec_algos(struct sa_block *s, int seen_enc, int seen_keylen, int seen_auth)
+{
+	const supported_algo_t *crypt;
+
+	crypt = get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc, NULL, seen_keylen);
+	return s->ipsec.cry_algo == crypt->my_id && s->ipsec.cry_mode == crypt->mode &&
+		s->ipsec.md_algo == (seen_auth ? get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0)->my_id : 0);
+}
+
+/*
+ * Process the proposal the peer selected, send the final packet and
+ * derive the keys of the new SA into s->ipsec.rx and tx
+ */
+static int qm_finish(struct sa_block *s, struct qm_exchange *q, struct isakmp_packet *r)
+{
+	struct isakmp_payload *rp, *ke = NULL, *nonce_r = NULL;
+	struct group *dh_grp = q->dh_grp;
+	uint32_t tx_spi = 0;
+	int reject = 0;
 
 	DEBUGTOP(2, printf("S7.6 QM_packet2 check and process proposal\n"));
 	for (rp = r->payload->next; rp && reject == 0; rp = rp->next)
@@ -2687,8 +2792,9 @@ static void do_phase2_qm(struct sa_block *s)
 					= rp->u.sa.proposals->u.p.transforms->u.t.attributes;
 				int seen_enc = rp->u.sa.proposals->u.p.transforms->u.t.id;
 				int seen_auth = 0, seen_encap = 0, seen_group = 0, seen_keylen = 0;
+				int seen_esn = 0;
 
-				memcpy(&s->ipsec.tx.spi, rp->u.sa.proposals->u.p.spi, 4);
+				memcpy(&tx_spi, rp->u.sa.proposals->u.p.spi, 4);
 
 				for (; a && reject == 0; a = a->next)
 					switch (a->type) {
@@ -2720,6 +2826,13 @@ static void do_phase2_qm(struct sa_block *s)
 						else
 							reject = ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 						break;
+					case ISAKMP_IPSEC_ATTRIB_ESN:
+						if (opt_esn && a->af == isakmp_attr_16 &&
+							a->u.attr_16 == ISAKMP_IPSEC_ESN_64)
+							seen_esn = 1;
+						else
+							reject = ISAKMP_N_ATTRIBUTES_NOT_SUPPORTED;
+						break;
 					case ISAKMP_IPSEC_ATTRIB_SA_LIFE_TYPE:
 						/* lifetime duration MUST follow lifetype attribute */
 						if (a->next->type == ISAKMP_IPSEC_ATTRIB_SA_LIFE_DURATION) {
@@ -2734,42 +2847,21 @@ static void do_phase2_qm(struct sa_block *s)
 						reject = ISAKMP_N_ATTRIBUTES_NOT_SUPPORTED;
 						break;
 					}
-				if (reject == 0 && (!seen_auth || !seen_encap ||
-						(dh_grp && !seen_group)))
+				if (reject == 0 && (!seen_encap || (dh_grp && !seen_group)))
 					reject = ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 
-				if (reject == 0
-					&& get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA, seen_auth,
-						NULL, 0) == NULL)
-					reject = ISAKMP_N_BAD_PROPOSAL_SYNTAX;
-				if (reject == 0
-					&& get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc,
-						NULL, seen_keylen) == NULL)
+				if (reject == 0)
+					reject = check_ipsec_algos(seen_enc, seen_keylen, seen_auth);
+				if (reject == 0 && q->rekey &&
+					(!same_ipsec_algos(s, seen_enc, seen_keylen, seen_auth) ||
+						seen_esn != s->ipsec.esn))
 					reject = ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 
 				if (reject == 0) {
-					s->ipsec.cry_algo =
-						get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA,
-						seen_enc, NULL, seen_keylen)->my_id;
-					s->ipsec.md_algo =
-						get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA,
-						seen_auth, NULL, 0)->my_id;
-					if (s->ipsec.cry_algo) {
-						gcry_cipher_algo_info(s->ipsec.cry_algo, GCRYCTL_GET_KEYLEN, NULL, &(s->ipsec.key_len));
-						gcry_cipher_algo_info(s->ipsec.cry_algo, GCRYCTL_GET_BLKLEN, NULL, &(s->ipsec.blk_len));
-						s->ipsec.iv_len = s->ipsec.blk_len;
-					} else {
-						s->ipsec.key_len = 0;
-						s->ipsec.iv_len = 0;
-						s->ipsec.blk_len = 8; /* seems to be this without encryption... */
-					}
-					s->ipsec.md_len = gcry_md_get_algo_dlen(s->ipsec.md_algo);
-					DEBUG(1, printf("IPSEC SA selected %s-%s\n",
-							get_algo(SUPP_ALGO_CRYPT,
-								SUPP_ALGO_IPSEC_SA, seen_enc, NULL,
-								seen_keylen)->name,
-							get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA,
-								seen_auth, NULL, 0)->name));
+					esp_set_algos(s, seen_enc, seen_keylen, seen_auth);
+					s->ipsec.esn = seen_esn;
+					DEBUG(1, printf("IPSEC SA %s extended sequence numbers\n",
+							seen_esn ? "with" : "without"));
 					if (s->ipsec.cry_algo == GCRY_CIPHER_DES && !opt_1des) {
 						error(1, 0, "peer selected (single) DES as \"encrytion\" method.\n"
 							"This algorithm is considered too weak today\n"
@@ -2817,11 +2909,11 @@ static void do_phase2_qm(struct sa_block *s)
 	if (reject == 0 && dh_grp && (ke == NULL || ke->u.ke.length != dh_getlen(dh_grp)))
 		reject = ISAKMP_N_INVALID_KEY_INFORMATION;
 	if (reject != 0)
-		phase2_fatal(s, "quick mode response rejected [2]: %s(%d)", reject);
+		return reject;
 
 	/* send final packet */
 	sendrecv_phase2(s, NULL, ISAKMP_EXCHANGE_IKE_QUICK,
-		msgid, 1, nonce_i, sizeof(nonce_i),
+		q->msgid, 1, q->nonce_i, sizeof(q->nonce_i),
 		nonce_r->u.nonce.data, nonce_r->u.nonce.length);
 
 	DEBUGTOP(2, printf("S7.7 QM_packet3 sent\n"));
@@ -2837,18 +2929,22 @@ static void do_phase2_qm(struct sa_block *s)
 			hex_dump("dh_shared_secret", dh_shared_secret, dh_getlen(dh_grp), NULL);
 		}
 
+		free(s->ipsec.rx.key);
+		free(s->ipsec.tx.key);
+
+		/* only now the SPIs of the SA in use are replaced */
+		s->ipsec.rx.spi = q->spi;
+		s->ipsec.tx.spi = tx_spi;
 		s->ipsec.rx.key = gen_keymat(s, ISAKMP_IPSEC_PROTO_IPSEC_ESP, s->ipsec.rx.spi,
 			dh_shared_secret, dh_grp ? dh_getlen(dh_grp) : 0,
-			nonce_i, sizeof(nonce_i), nonce_r->u.nonce.data, nonce_r->u.nonce.length);
+			q->nonce_i, sizeof(q->nonce_i), nonce_r->u.nonce.data, nonce_r->u.nonce.length);
 
 		s->ipsec.tx.key = gen_keymat(s, ISAKMP_IPSEC_PROTO_IPSEC_ESP, s->ipsec.tx.spi,
 			dh_shared_secret, dh_grp ? dh_getlen(dh_grp) : 0,
-			nonce_i, sizeof(nonce_i), nonce_r->u.nonce.data, nonce_r->u.nonce.length);
+			q->nonce_i, sizeof(q->nonce_i), nonce_r->u.nonce.data, nonce_r->u.nonce.length);
 
-		if (dh_grp)
-			group_free(dh_grp);
 		free(dh_shared_secret);
-		free_isakmp_packet(r);
+		s->ipsec.life.start = time(NULL);
 
 		if (s->esp_fd == 0) {
 			if ((opt_natt_mode == NATT_CISCO_UDP) && s->ipsec.peer_udpencap_port) {
@@ -2875,18 +2971,52 @@ static void do_phase2_qm(struct sa_block *s)
 #endif
 			}
 		}
-
-		s->ipsec.rx.seq_id = s->ipsec.tx.seq_id = 1;
 	}
-	free(dh_public);
+	return 0;
 }
 
+static void do_phase2_qm(struct sa_block *s)
+{
+	struct qm_exchange q;
+	struct isakmp_packet *r;
+	int reject;
+
+	memset(&q, 0, sizeof(q));
+	qm_start(s, &q, 0);
+
+	DEBUGTOP(2, printf("S7.3 QM_packet2 validate type\n"));
+	reject = do_phase2_notice_check(s, &r, q.nonce_i, sizeof(q.nonce_i)); /* FIXME: LEAK */
+	if (reject == 0)
+		reject = qm_check_reply(&q, r);
+
+	DEBUGTOP(2, printf("S7.5 QM_packet2 check reject offer\n"));
+	if (reject != 0)
+		phase2_fatal(s, "quick mode response rejected: %s(%d)\n"
+			"this means the concentrator did not like what we had to offer.\n"
+			"Possible reasons are:\n"
+			"  * concentrator configured to require a firewall\n"
+			"     this locks out even Cisco clients on any platform except windows\n"
+			"     which is an obvious security improvement. There is no workaround (yet).\n"
+			"  * concentrator configured to require IP compression\n"
+			"     this is not yet supported by vpnc.\n"
+			"     Note: the Cisco Concentrator Documentation recommends against using\n"
+			"     compression, except on low-bandwith (read: ISDN) links, because it\n"
+			"     uses much CPU-resources on the concentrator\n",
+			reject);
+
+	reject = qm_finish(s, &q, r);
+	if (reject != 0)
+		phase2_fatal(s, "quick mode response rejected [2]: %s(%d)", reject);
+	free_isakmp_packet(r);
+	qm_free(&q);
+}
 static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 {
 	struct isakmp_payload *rp, *ke = NULL, *nonce_i = NULL;
 	struct isakmp_attribute *a;
 	int seen_enc;
 	int seen_auth = 0, seen_encap = 0, seen_group = 0, seen_keylen = 0;
+	int seen_esn = 0;
 	int nonce_i_copy_len;
 	struct group *dh_grp = NULL;
 	uint8_t nonce_r[20], *dh_public = NULL, *nonce_i_copy = NULL;
@@ -2952,6 +3082,12 @@ static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 			else
 				return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 			break;
+		case ISAKMP_IPSEC_ATTRIB_ESN:
+			if (a->af == isakmp_attr_16 && a->u.attr_16 == ISAKMP_IPSEC_ESN_64)
+				seen_esn = 1;
+			else
+				return ISAKMP_N_ATTRIBUTES_NOT_SUPPORTED;
+			break;
 		case ISAKMP_IPSEC_ATTRIB_SA_LIFE_TYPE:
 			/* lifetime duration MUST follow lifetype attribute */
 			if (a->next->type == ISAKMP_IPSEC_ATTRIB_SA_LIFE_DURATION) {
@@ -2966,14 +3102,13 @@ static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 			return ISAKMP_N_ATTRIBUTES_NOT_SUPPORTED;
 			break;
 		}
-	if (!seen_auth || !seen_encap || (dh_grp && !seen_group))
+	if (!seen_encap || (dh_grp && !seen_group))
 		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 
 	/* FIXME: Current code has a limitation that will cause problems if
 	 * different algorithms are negotiated during re-keying
 	 */
-	if ((get_algo(SUPP_ALGO_HASH, SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0) == NULL) ||
-	    (get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc, NULL, seen_keylen) == NULL)) {
+	if (check_ipsec_algos(seen_enc, seen_keylen, seen_auth) != 0) {
 		printf("\nFIXME: vpnc doesn't support change of algorightms during rekeying\n");
 		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 	}
@@ -2981,7 +3116,11 @@ static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 	/* we don't want to change ciphers during rekeying */
 	if (s->ipsec.cry_algo != get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc,  NULL, seen_keylen)->my_id)
 		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
-	if (s->ipsec.md_algo  != get_algo(SUPP_ALGO_HASH,  SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0)->my_id)
+	if (s->ipsec.cry_mode != get_algo(SUPP_ALGO_CRYPT, SUPP_ALGO_IPSEC_SA, seen_enc,  NULL, seen_keylen)->mode)
+		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
+	if (s->ipsec.md_algo  != (seen_auth ? get_algo(SUPP_ALGO_HASH,  SUPP_ALGO_IPSEC_SA, seen_auth, NULL, 0)->my_id : 0))
+		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
+	if (s->ipsec.esn != seen_esn)
 		return ISAKMP_N_BAD_PROPOSAL_SYNTAX;
 
 	for (rp = rp->next; rp; rp = rp->next)
@@ -3025,25 +3164,14 @@ static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 		dh_shared_secret, dh_grp ? dh_getlen(dh_grp) : 0,
 		nonce_i->u.nonce.data, nonce_i->u.nonce.length, nonce_r, sizeof(nonce_r));
 
-	s->ipsec.rx.key_cry = s->ipsec.rx.key;
-	s->ipsec.rx.key_md  = s->ipsec.rx.key + s->ipsec.key_len;
-	s->ipsec.tx.key_cry = s->ipsec.tx.key;
-	s->ipsec.tx.key_md  = s->ipsec.tx.key + s->ipsec.key_len;
-
 	nonce_i_copy_len = nonce_i->u.nonce.length;
 	nonce_i_copy = xallocc(nonce_i_copy_len);
 	memcpy(nonce_i_copy, nonce_i->u.nonce.data, nonce_i_copy_len);
 
-	s->ipsec.rx.seq_id = s->ipsec.tx.seq_id = 1;
 	s->ipsec.life.start = time(NULL);
 	s->ipsec.life.tx = 0;
 	s->ipsec.life.rx = 0;
 
-	if (s->ipsec.cry_algo) {
-		gcry_cipher_setkey(s->ipsec.rx.cry_ctx, s->ipsec.rx.key_cry, s->ipsec.key_len);
-		gcry_cipher_setkey(s->ipsec.tx.cry_ctx, s->ipsec.tx.key_cry, s->ipsec.key_len);
-	}
-
 	/* use request as template and just exchange some values */
 	/* this overwrites data in nonce_i, ke! */
 	rp = r->payload->next;
@@ -3065,15 +3193,76 @@ static int do_rekey(struct sa_block *s, struct isakmp_packet *r)
 			break;
 		}
 
+	/*
+	 * Don't wait for the answer, we don't care about it and the data path
+	 * would stall meanwhile. The peer starts using the new SAs once it
+	 * has our reply, the old inbound one stays valid for a while.
+	 */
 	sendrecv_phase2(s, r->payload->next, ISAKMP_EXCHANGE_IKE_QUICK,
-		r->message_id, 0, nonce_i_copy, nonce_i_copy_len, 0,0);
-	unpack_verify_phase2(s, r_packet, r_length, &r, NULL, 0);
+		r->message_id, 1, nonce_i_copy, nonce_i_copy_len, 0,0);
 	free(nonce_i_copy);
-	/* don't care about answer ... */
 
+	esp_sa_publish(s);
 	return 0;
 }
 
+/*
+ * Rekeying we start ourselves, before the SA runs out. The quick mode
+ * exchange runs next to the data path: the answer comes in through
+ * process_late_ike() and the old SA stays in use until the new one is
+ * in place, only then we ask the peer to delete it.
+ */
+static struct qm_exchange rekey_qm;
+static uint32_t rekey_rx_spi, rekey_tx_spi; /* of the SA being replaced */
+
+static void rekey_ipsec_abort(void)
+{
+	qm_free(&rekey_qm);
+}
+
+/* Start over if the previous attempt is still unanswered */
+void rekey_ipsec(struct sa_block *s)
+{
+	if (rekey_qm.msgid) {
+		DEBUG(2, printf("no answer to rekey %#08x, starting over\n", rekey_qm.msgid));
+		rekey_ipsec_abort();
+	}
+	logmsg(LOG_INFO, "rekeying IPSec SA");
+	rekey_rx_spi = s->ipsec.rx.spi;
+	rekey_tx_spi = s->ipsec.tx.spi;
+	rekey_qm.rekey = 1;
+	qm_start(s, &rekey_qm, 1);
+}
+
+static void rekey_ipsec_reply(struct sa_block *s, uint8_t *r_packet, ssize_t r_length)
+{
+	struct isakmp_packet *r;
+	int reject;
+
+	reject = unpack_verify_phase2(s, r_packet, r_length, &r,
+		rekey_qm.nonce_i, sizeof(rekey_qm.nonce_i));
+	if (reject == 0 && r->payload->next == NULL)
+		reject = ISAKMP_N_INVALID_PAYLOAD_TYPE;
+	if (reject == 0)
+		reject = qm_check_reply(&rekey_qm, r);
+	if (reject == 0)
+		reject = qm_finish(s, &rekey_qm, r);
+	if (r)
+		free_isakmp_packet(r);
+	if (reject != 0) {
+		logmsg(LOG_WARNING, "IPSec rekey rejected: %s(%d)",
+			val_to_string(reject, isakmp_notify_enum_array), reject);
+		rekey_ipsec_abort();
+		return;
+	}
+	qm_free(&rekey_qm);
+
+	s->ipsec.life.tx = 0;
+	s->ipsec.life.rx = 0;
+	esp_sa_publish(s);
+	send_delete_esp(s, rekey_rx_spi, rekey_tx_spi);
+}
+
 void process_late_ike(struct sa_block *s, uint8_t *r_packet, ssize_t r_length)
 {
 	int reject;
@@ -3081,6 +3270,16 @@ void process_late_ike(struct sa_block *s, uint8_t *r_packet, ssize_t r_length)
 	struct isakmp_payload *rp;
 
 	DEBUG(2,printf("got late ike packet: %zd bytes\n", r_length));
+	if (rekey_qm.msgid && r_length >= ISAKMP_PAYLOAD_O) {
+		uint32_t msgid;
+
+		memcpy(&msgid, r_packet + ISAKMP_MESSAGE_ID_O, 4);
+		if (ntohl(msgid) == rekey_qm.msgid) {
+			rekey_ipsec_reply(s, r_packet, r_length);
+			return;
+		}
+	}
+
 	/* we should ignore resent packets here.
 	 * unpack_verify_phase2 will fail to decode them probably */
 	reject = unpack_verify_phase2(s, r_packet, r_length, &r, NULL, 0);
@@ -3106,6 +3305,10 @@ void process_late_ike(struct sa_block *s, uint8_t *r_packet, ssize_t r_length)
 	/* do we get an SA proposal for rekeying? */
 	if (r->exchange_type == ISAKMP_EXCHANGE_IKE_QUICK &&
 		r->payload->next->type == ISAKMP_PAYLOAD_SA) {
+		if (rekey_qm.msgid) {
+			DEBUG(2, printf("peer rekeys first, dropping ours\n"));
+			rekey_ipsec_abort();
+		}
 		reject = do_rekey(s, r);
 		DEBUG(3, printf("do_rekey returned: %d\n", reject));
 		/* FIXME: LEAK but will create segfault for double free */
@@ -3166,7 +3369,10 @@ void process_late_ike(struct sa_block *s, uint8_t *r_packet, ssize_t r_length)
 
 			if (rp->u.d.num_spi >= 1 && memcmp(rp->u.d.spi[0], &s->ipsec.tx.spi, 4) == 0) {
 				free_isakmp_packet(r);
+				if (rekey_qm.msgid)
+					rekey_ipsec_abort();
 				do_phase2_qm(s);
+				esp_sa_publish(s);
 				return;
 			} else {
 				DEBUG(2, printf("got isakmp delete with bogus spi (expected %d, received %d), ignoring...\n", s->ipsec.tx.spi, *(rp->u.d.spi[0]) ));
@@ -3249,7 +3455,8 @@ int main(int argc, char **argv)
 	DEBUGTOP(2, printf("S7.9 main loop (receive and transmit ipsec packets)\n"));
 	vpnc_doit(s);
 
-	/* Tear down phase 2 and 1 tunnels */
+	/* Tear down phase 2 and 1 tunnels, a rekey still unanswered is dropped */
+	rekey_ipsec_abort();
 	send_delete_ipsec(s);
 	send_delete_isakmp(s);
 
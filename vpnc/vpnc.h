@@ -26,6 +26,7 @@
 void process_late_ike(struct sa_block *s, uint8_t *r_packet, ssize_t r_length);
 void keepalive_ike(struct sa_block *s);
 void dpd_ike(struct sa_block *s);
+void rekey_ipsec(struct sa_block *s);
 void print_vid(const unsigned char *vid, uint16_t len);
 
 #endif
@@ -0,0 +1,591 @@
+/* In-kernel ESP via the Linux XFRM netlink interface
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "xfrm.h"
+
+#ifdef HAVE_XFRM
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/xfrm.h>
+
+#include <gcrypt.h>
+#include "config.h"
+#include "isakmp.h"
+#include "tunip.h"
+
+#ifndef UDP_ENCAP
+#define UDP_ENCAP 100
+#endif
+#ifndef UDP_ENCAP_ESPINUDP
+#define UDP_ENCAP_ESPINUDP 2
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#define XFRM_MSG_SIZE 1024
+
+struct xfrm_msg {
+	struct nlmsghdr n;
+	uint8_t buf[XFRM_MSG_SIZE];
+};
+
+static struct {
+	int fd; /* NETLINK_XFRM */
+	int ev_fd; /* the same, subscribed to XFRMNLGRP_EXPIRE */
+	uint32_t seq;
+	uint32_t reqid; /* ties our policies to our SAs */
+	struct in_addr net; /* target network of the policies */
+	int plen;
+	uint16_t encap; /* UDP_ENCAP_* on the ESP socket, 0 for raw ESP */
+	uint16_t sport, dport; /* network order */
+	uint32_t rx_spi, tx_spi; /* installed pair, 0 if none */
+	int expired; /* the pair reached a soft limit */
+	struct {
+		uint32_t spi;
+		time_t until;
+	} old_rx[ESP_RX_SAS - 1]; /* replaced inbound SAs, oldest first */
+	int nold_rx;
+} xfrm = { .fd = -1, .ev_fd = -1 };
+
+static void xfrm_msg_init(struct xfrm_msg *m, uint16_t type, uint16_t flags)
+{
+	memset(m, 0, sizeof(*m));
+	m->n.nlmsg_len = NLMSG_LENGTH(0);
+	m->n.nlmsg_type = type;
+	m->n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+}
+
+/* Reserve room for len bytes at the end of the message, zeroed */
+static void *xfrm_put(struct xfrm_msg *m, size_t len)
+{
+	void *p = (uint8_t *)&m->n + NLMSG_ALIGN(m->n.nlmsg_len);
+
+	m->n.nlmsg_len = NLMSG_ALIGN(m->n.nlmsg_len) + len;
+	return p;
+}
+
+static void *xfrm_attr(struct xfrm_msg *m, uint16_t type, size_t len)
+{
+	struct nlattr *a = xfrm_put(m, NLA_HDRLEN + len);
+
+	a->nla_type = type;
+	a->nla_len = NLA_HDRLEN + len;
+	return (uint8_t *)a + NLA_HDRLEN;
+}
+
+/* Send a request and wait for its acknowledgement */
+static int xfrm_talk(struct xfrm_msg *m)
+{
+	struct sockaddr_nl nl;
+	union {
+		struct nlmsghdr n;
+		uint8_t buf[4096];
+	} r;
+	struct nlmsghdr *h;
+	struct nlmsgerr *e;
+	ssize_t len;
+
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	m->n.nlmsg_seq = ++xfrm.seq;
+	if (sendto(xfrm.fd, &m->n, m->n.nlmsg_len, 0, (struct sockaddr *)&nl, sizeof(nl)) == -1)
+		return -1;
+
+	for (;;) {
+		len = recv(xfrm.fd, &r, sizeof(r), 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (h = &r.n; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_seq != xfrm.seq || h->nlmsg_type != NLMSG_ERROR)
+				continue;
+			e = NLMSG_DATA(h);
+			if (e->error == 0)
+				return 0;
+			errno = -e->error;
+			return -1;
+		}
+	}
+}
+
+static void xfrm_algo(struct xfrm_msg *m, uint16_t type, const char *name,
+	const uint8_t *key, size_t key_len, size_t icv_len)
+{
+	struct xfrm_algo *a;
+	struct xfrm_algo_auth *aa;
+	struct xfrm_algo_aead *ae;
+
+	switch (type) {
+	case XFRMA_ALG_AEAD:
+		ae = xfrm_attr(m, type, sizeof(*ae) + key_len);
+		strcpy(ae->alg_name, name);
+		ae->alg_key_len = key_len * 8;
+		ae->alg_icv_len = icv_len * 8;
+		memcpy(ae->alg_key, key, key_len);
+		break;
+	case XFRMA_ALG_AUTH_TRUNC:
+		aa = xfrm_attr(m, type, sizeof(*aa) + key_len);
+		strcpy(aa->alg_name, name);
+		aa->alg_key_len = key_len * 8;
+		aa->alg_trunc_len = icv_len * 8;
+		memcpy(aa->alg_key, key, key_len);
+		break;
+	default:
+		a = xfrm_attr(m, type, sizeof(*a) + key_len);
+		strcpy(a->alg_name, name);
+		a->alg_key_len = key_len * 8;
+		memcpy(a->alg_key, key, key_len);
+		break;
+	}
+}
+
+/* The kernel names of the negotiated algorithms */
+static int xfrm_algos(struct sa_block *s, struct xfrm_msg *m, struct ike_sa *sa)
+{
+	const char *cry, *md;
+
+	switch (s->ipsec.cry_mode) {
+	case GCRY_CIPHER_MODE_GCM:
+		/* the salt follows the key in the keymat, as the kernel wants it */
+		xfrm_algo(m, XFRMA_ALG_AEAD, "rfc4106(gcm(aes))",
+			sa->key, s->ipsec.key_len + s->ipsec.salt_len, s->ipsec.icv_len);
+		return 0;
+	case GCRY_CIPHER_MODE_POLY1305:
+		xfrm_algo(m, XFRMA_ALG_AEAD, "rfc7539esp(chacha20,poly1305)",
+			sa->key, s->ipsec.key_len + s->ipsec.salt_len, s->ipsec.icv_len);
+		return 0;
+	}
+
+	switch (s->ipsec.cry_algo) {
+	case GCRY_CIPHER_NONE:
+		cry = "ecb(cipher_null)";
+		break;
+	case GCRY_CIPHER_DES:
+		cry = "cbc(des)";
+		break;
+	case GCRY_CIPHER_3DES:
+		cry = "cbc(des3_ede)";
+		break;
+	case GCRY_CIPHER_AES128:
+	case GCRY_CIPHER_AES192:
+	case GCRY_CIPHER_AES256:
+		cry = "cbc(aes)";
+		break;
+	default:
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	switch (s->ipsec.md_algo) {
+	case GCRY_MD_MD5:
+		md = "hmac(md5)";
+		break;
+	case GCRY_MD_SHA1:
+		md = "hmac(sha1)";
+		break;
+	case GCRY_MD_SHA256:
+		md = "hmac(sha256)";
+		break;
+	case GCRY_MD_SHA384:
+		md = "hmac(sha384)";
+		break;
+	case GCRY_MD_SHA512:
+		md = "hmac(sha512)";
+		break;
+	default:
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	xfrm_algo(m, XFRMA_ALG_CRYPT, cry, sa->key, s->ipsec.key_len, 0);
+	xfrm_algo(m, XFRMA_ALG_AUTH_TRUNC, md, sa->key + s->ipsec.key_len + s->ipsec.salt_len,
+		s->ipsec.md_len, s->ipsec.icv_len);
+	return 0;
+}
+
+static int xfrm_add_sa(struct sa_block *s, struct ike_sa *sa, int rx)
+{
+	struct xfrm_msg m;
+	struct xfrm_usersa_info *p;
+	struct xfrm_encap_tmpl *e;
+	struct xfrm_replay_state_esn *r;
+	unsigned int bmp_len, window = rx ? opt_replay_window : 0;
+
+	xfrm_msg_init(&m, XFRM_MSG_NEWSA, NLM_F_CREATE | NLM_F_EXCL);
+	p = xfrm_put(&m, sizeof(*p));
+	p->sel.family = AF_INET;
+	p->id.daddr.a4 = rx ? s->src.s_addr : s->dst.s_addr;
+	p->saddr.a4 = rx ? s->dst.s_addr : s->src.s_addr;
+	p->id.spi = sa->spi;
+	p->id.proto = IPPROTO_ESP;
+	p->family = AF_INET;
+	p->mode = XFRM_MODE_TUNNEL;
+	p->reqid = xfrm.reqid;
+	/*
+	 * The traffic is only counted in here: the kernel reports the soft
+	 * limit, where we rekey as esp_rekey_due() would, and stops using
+	 * the SA at the hard one, the peer's. Time is left to our timers.
+	 * Without ESN the packets are limited too: a sequence number about
+	 * to cycle needs a rekey, whoever is in charge of them.
+	 */
+	p->lft.soft_byte_limit = p->lft.hard_byte_limit = XFRM_INF;
+	p->lft.soft_packet_limit = p->lft.hard_packet_limit = XFRM_INF;
+	if (s->ipsec.life.kbytes) {
+		p->lft.hard_byte_limit = (uint64_t)s->ipsec.life.kbytes * 1024;
+		if (opt_rekey_at)
+			p->lft.soft_byte_limit = p->lft.hard_byte_limit * opt_rekey_at / 100;
+	}
+	if (!s->ipsec.esn)
+		p->lft.soft_packet_limit = ESP_REKEY_SEQ;
+
+	if (xfrm_algos(s, &m, sa) == -1)
+		return -1;
+
+	if (s->ipsec.esn) {
+		p->flags |= XFRM_STATE_ESN;
+		/* which needs a window, also where nothing is checked */
+		if (window == 0)
+			window = 32;
+	}
+	if (window) {
+		/* the plain replay_window field only goes up to 32 */
+		bmp_len = (window + 31) / 32;
+		r = xfrm_attr(&m, XFRMA_REPLAY_ESN_VAL, sizeof(*r) + bmp_len * sizeof(uint32_t));
+		r->bmp_len = bmp_len;
+		r->replay_window = window;
+	}
+
+	if (xfrm.encap) {
+		e = xfrm_attr(&m, XFRMA_ENCAP, sizeof(*e));
+		e->encap_type = xfrm.encap;
+		e->encap_sport = rx ? xfrm.dport : xfrm.sport;
+		e->encap_dport = rx ? xfrm.sport : xfrm.dport;
+	}
+
+	return xfrm_talk(&m);
+}
+
+static int xfrm_del_sa(struct sa_block *s, uint32_t spi, int rx)
+{
+	struct xfrm_msg m;
+	struct xfrm_usersa_id *p;
+
+	xfrm_msg_init(&m, XFRM_MSG_DELSA, 0);
+	p = xfrm_put(&m, sizeof(*p));
+	p->daddr.a4 = rx ? s->src.s_addr : s->dst.s_addr;
+	p->spi = spi;
+	p->family = AF_INET;
+	p->proto = IPPROTO_ESP;
+	return xfrm_talk(&m);
+}
+
+/*
+ * Traffic between our tunnel address and the target network goes
+ * through the SAs of our reqid, from us to the concentrator.
+ */
+static int xfrm_policy(struct sa_block *s, int dir, int del)
+{
+	struct xfrm_msg m;
+	struct xfrm_selector *sel;
+	struct xfrm_userpolicy_info *p = NULL;
+	struct xfrm_userpolicy_id *id;
+	struct xfrm_user_tmpl *t;
+	int out = (dir == XFRM_POLICY_OUT);
+
+	if (del) {
+		xfrm_msg_init(&m, XFRM_MSG_DELPOLICY, 0);
+		id = xfrm_put(&m, sizeof(*id));
+		id->dir = dir;
+		sel = &id->sel;
+	} else {
+		xfrm_msg_init(&m, XFRM_MSG_UPDPOLICY, NLM_F_CREATE);
+		p = xfrm_put(&m, sizeof(*p));
+		p->dir = dir;
+		p->action = XFRM_POLICY_ALLOW;
+		p->lft.soft_byte_limit = p->lft.hard_byte_limit = XFRM_INF;
+		p->lft.soft_packet_limit = p->lft.hard_packet_limit = XFRM_INF;
+		sel = &p->sel;
+	}
+
+	sel->family = AF_INET;
+	if (out) {
+		sel->saddr.a4 = s->our_address.s_addr;
+		sel->prefixlen_s = 32;
+		sel->daddr.a4 = xfrm.net.s_addr;
+		sel->prefixlen_d = xfrm.plen;
+	} else {
+		sel->saddr.a4 = xfrm.net.s_addr;
+		sel->prefixlen_s = xfrm.plen;
+		sel->daddr.a4 = s->our_address.s_addr;
+		sel->prefixlen_d = 32;
+	}
+
+	if (!del) {
+		t = xfrm_attr(&m, XFRMA_TMPL, sizeof(*t));
+		t->id.daddr.a4 = out ? s->dst.s_addr : s->src.s_addr;
+		t->id.proto = IPPROTO_ESP;
+		t->saddr.a4 = out ? s->src.s_addr : s->dst.s_addr;
+		t->family = AF_INET;
+		t->reqid = xfrm.reqid;
+		t->mode = XFRM_MODE_TUNNEL;
+		t->aalgos = t->ealgos = t->calgos = ~0U;
+	}
+
+	return xfrm_talk(&m);
+}
+
+/* The target network as configured, "net/mask" or "net/bits" */
+static int xfrm_target(void)
+{
+	const char *t = config[CONFIG_IPSEC_TARGET_NETWORK];
+	const char *p = t ? strchr(t, '/') : NULL;
+	char net[INET_ADDRSTRLEN];
+	struct in_addr mask;
+	uint32_t bits;
+
+	xfrm.net.s_addr = 0;
+	xfrm.plen = 0;
+	if (p == NULL || (size_t)(p - t) >= sizeof(net))
+		return 0;
+	memcpy(net, t, p - t);
+	net[p - t] = '\0';
+	if (inet_aton(net, &xfrm.net) == 0)
+		return -1;
+	if (strchr(p + 1, '.') != NULL) {
+		if (inet_aton(p + 1, &mask) == 0)
+			return -1;
+		for (bits = ntohl(mask.s_addr); bits; bits <<= 1)
+			xfrm.plen++;
+	} else
+		xfrm.plen = atoi(p + 1);
+	if (xfrm.plen < 0 || xfrm.plen > 32)
+		return -1;
+	if (xfrm.plen < 32)
+		xfrm.net.s_addr &= htonl(~(0xffffffffU >> xfrm.plen));
+	return 0;
+}
+
+int xfrm_update(struct sa_block *s)
+{
+	uint32_t rx_spi = xfrm.rx_spi, tx_spi = xfrm.tx_spi;
+
+	if (s->ipsec.rx.spi == rx_spi && s->ipsec.tx.spi == tx_spi)
+		return 0;
+
+	/*
+	 * Add the new pair first: the kernel prefers the most recently added
+	 * of the SAs matching a policy, so traffic moves over in one step.
+	 */
+	if (xfrm_add_sa(s, &s->ipsec.rx, 1) == -1)
+		return -1;
+	if (xfrm_add_sa(s, &s->ipsec.tx, 0) == -1) {
+		xfrm_del_sa(s, s->ipsec.rx.spi, 1);
+		return -1;
+	}
+	xfrm.rx_spi = s->ipsec.rx.spi;
+	xfrm.tx_spi = s->ipsec.tx.spi;
+	xfrm.expired = 0;
+
+	if (tx_spi)
+		xfrm_del_sa(s, tx_spi, 0);
+	if (rx_spi == 0)
+		return 0;
+	/* the peer may still have packets for the old inbound SA on the way */
+	if (opt_sa_grace == 0) {
+		xfrm_del_sa(s, rx_spi, 1);
+		return 0;
+	}
+	if (xfrm.nold_rx == ESP_RX_SAS - 1)
+		xfrm_grace(s, xfrm.old_rx[0].until);
+	xfrm.old_rx[xfrm.nold_rx].spi = rx_spi;
+	xfrm.old_rx[xfrm.nold_rx].until = time(NULL) + opt_sa_grace;
+	xfrm.nold_rx++;
+	return 0;
+}
+
+time_t xfrm_grace(struct sa_block *s, time_t now)
+{
+	int i, n = 0;
+
+	for (i = 0; i < xfrm.nold_rx; i++) {
+		if (xfrm.old_rx[i].until <= now) {
+			DEBUG(2, printf("grace period of kernel IPSec SA %#08x over\n", ntohl(xfrm.old_rx[i].spi)));
+			xfrm_del_sa(s, xfrm.old_rx[i].spi, 1);
+		} else
+			xfrm.old_rx[n++] = xfrm.old_rx[i];
+	}
+	xfrm.nold_rx = n;
+	return n ? xfrm.old_rx[0].until : 0;
+}
+
+int xfrm_event_fd(void)
+{
+	return xfrm.ev_fd;
+}
+
+int xfrm_expired(void)
+{
+	return xfrm.expired;
+}
+
+/* Pick the expire messages about our installed pair from the socket */
+void xfrm_events(void)
+{
+	union {
+		struct nlmsghdr n;
+		uint8_t buf[4096];
+	} r;
+	struct nlmsghdr *h;
+	struct xfrm_user_expire *e;
+	uint32_t spi;
+	ssize_t len;
+
+	while ((len = recv(xfrm.ev_fd, &r, sizeof(r), MSG_DONTWAIT)) > 0) {
+		for (h = &r.n; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type != XFRM_MSG_EXPIRE)
+				continue;
+			e = NLMSG_DATA(h);
+			spi = e->state.id.spi;
+			if (e->state.reqid != xfrm.reqid || (spi != xfrm.rx_spi && spi != xfrm.tx_spi))
+				continue;
+			if (e->hard)
+				logmsg(LOG_WARNING, "kernel dropped IPSec SA %#08x at the end of its lifetime",
+					ntohl(spi));
+			else
+				DEBUG(2, printf("kernel IPSec SA %#08x reached its soft lifetime\n", ntohl(spi)));
+			xfrm.expired = 1;
+		}
+	}
+}
+
+int xfrm_start(struct sa_block *s)
+{
+	struct sockaddr_nl nl;
+	struct sockaddr_in a;
+	socklen_t len = sizeof(a);
+	int encap, err;
+
+	switch (s->ipsec.natt_active_mode) {
+	case NATT_ACTIVE_NONE:
+		xfrm.encap = 0;
+		break;
+	case NATT_ACTIVE_RFC:
+	case NATT_ACTIVE_CISCO_UDP:
+		xfrm.encap = UDP_ENCAP_ESPINUDP;
+		break;
+	default:
+		/* the old drafts mark ESP, not IKE, we don't sort that out in the kernel */
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	if (xfrm.encap) {
+		if (getsockname(s->esp_fd, (struct sockaddr *)&a, &len) == -1)
+			return -1;
+		xfrm.sport = a.sin_port;
+		len = sizeof(a);
+		if (getpeername(s->esp_fd, (struct sockaddr *)&a, &len) == -1)
+			return -1;
+		xfrm.dport = a.sin_port;
+	}
+
+	if (xfrm_target() == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	xfrm.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_XFRM);
+	if (xfrm.fd == -1)
+		return -1;
+	xfrm.reqid = getpid();
+	xfrm.rx_spi = xfrm.tx_spi = 0;
+	xfrm.nold_rx = 0;
+
+	xfrm.ev_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_XFRM);
+	if (xfrm.ev_fd == -1)
+		goto fail;
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = 1 << (XFRMNLGRP_EXPIRE - 1);
+	if (bind(xfrm.ev_fd, (struct sockaddr *)&nl, sizeof(nl)) == -1)
+		goto fail;
+
+	if (xfrm_update(s) == -1)
+		goto fail;
+	if (xfrm_policy(s, XFRM_POLICY_OUT, 0) == -1)
+		goto fail;
+	if (xfrm_policy(s, XFRM_POLICY_IN, 0) == -1)
+		goto fail;
+
+	if (xfrm.encap) {
+		/* from now on only IKE and keepalives reach the socket */
+		encap = xfrm.encap;
+		if (setsockopt(s->esp_fd, SOL_UDP, UDP_ENCAP, &encap, sizeof(encap)) == -1)
+			goto fail;
+	} else {
+		/* the raw socket would get a copy of every ESP packet */
+		close(s->esp_fd);
+		s->esp_fd = -1;
+	}
+	return 0;
+
+fail:
+	err = errno;
+	xfrm_stop(s);
+	errno = err;
+	return -1;
+}
+
+void xfrm_stop(struct sa_block *s)
+{
+	int encap = 0;
+
+	if (xfrm.fd == -1)
+		return;
+
+	if (xfrm.encap && s->esp_fd != -1)
+		setsockopt(s->esp_fd, SOL_UDP, UDP_ENCAP, &encap, sizeof(encap));
+	xfrm_policy(s, XFRM_POLICY_OUT, 1);
+	xfrm_policy(s, XFRM_POLICY_IN, 1);
+	if (xfrm.tx_spi)
+		xfrm_del_sa(s, xfrm.tx_spi, 0);
+	if (xfrm.rx_spi)
+		xfrm_del_sa(s, xfrm.rx_spi, 1);
+	xfrm.rx_spi = xfrm.tx_spi = 0;
+	while (xfrm.nold_rx)
+		xfrm_del_sa(s, xfrm.old_rx[--xfrm.nold_rx].spi, 1);
+
+	if (xfrm.ev_fd != -1)
+		close(xfrm.ev_fd);
+	xfrm.ev_fd = -1;
+	close(xfrm.fd);
+	xfrm.fd = -1;
+}
+
+#endif
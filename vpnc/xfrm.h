@@ -0,0 +1,55 @@
+/* In-kernel ESP via the Linux XFRM netlink interface
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __XFRM_H__
+#define __XFRM_H__
+
+#include "sysdep.h"
+
+#ifdef HAVE_XFRM
+
+struct sa_block;
+
+/*
+ * Install the current SA pair and the tunnel policies and let the kernel
+ * take over the ESP socket. Returns -1 with errno set, leaving nothing
+ * behind, if the kernel can't carry this tunnel.
+ */
+extern int xfrm_start(struct sa_block *s);
+
+/*
+ * Replace the installed SA pair by the current keys after a rekey. The
+ * old inbound SA stays for opt_sa_grace seconds, see xfrm_grace().
+ */
+extern int xfrm_update(struct sa_block *s);
+
+/* Remove the old inbound SAs whose grace period ended, returns the next end or 0 */
+extern time_t xfrm_grace(struct sa_block *s, time_t now);
+
+/* Remove the policies and SAs again */
+extern void xfrm_stop(struct sa_block *s);
+
+/* Socket the kernel reports expiring SAs on, read it with xfrm_events() */
+extern int xfrm_event_fd(void);
+extern void xfrm_events(void);
+
+/* Whether the installed pair reached its soft lifetime and wants a rekey */
+extern int xfrm_expired(void);
+
+#endif
+
+#endif